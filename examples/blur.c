@@ -2,10 +2,12 @@
  * blur.c
  *
  * Example application and test utility for easimage.
- * Uses imgCreateGaussian(), imgSavePAM, viewDisplayImage()
+ * Uses imgCreateGaussian(), imgGaussianBlur(), imgSavePAM, viewDisplayImage()
  * 
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "easimage.h"
 
@@ -22,6 +24,38 @@ int main() {
 	printf("Kernel mean: %f\n", mean);
 	waitTime(2000);
 
+	// blurring keeps flat areas unchanged
+	Image *iFlat = imgNew(32, 32, 8);
+	assert(iFlat);
+	memset(iFlat->data, 255, iFlat->stride * iFlat->height);
+	Image *iFlatOut = imgGaussianBlur(iFlat, 11, 0., NULL);
+	assert(iFlatOut);
+	assert(*imgGetPixel(iFlatOut, 16, 16) == 255);
+	imgDestroy(iFlatOut);
+	imgDestroy(iFlat);
+
+	// and stays within 1 of imgConvolution() with the same Gaussian
+	Image *iRand = imgNew(64, 48, 8);
+	assert(iRand);
+	unsigned int x, y;
+	for( y=0 ; y<iRand->height ; y++ )
+	    for( x=0 ; x<iRand->width ; x++ )
+		iRand->data[y*iRand->stride + x] = rand();
+	int dim;
+	for( dim=3 ; dim<=15 ; dim+=2 ) {
+	    Image *iGauss = imgCreateGaussian(dim, 0.);
+	    Image *iConv = imgConvolution(iRand, iGauss, NULL);
+	    Image *iBlur = imgGaussianBlur(iRand, dim, 0., NULL);
+	    assert(iGauss && iConv && iBlur);
+	    for( y=0 ; y<iRand->height ; y++ )
+		for( x=0 ; x<iRand->width ; x++ )
+		    assert(abs(*imgGetPixel(iConv, x, y) - *imgGetPixel(iBlur, x, y)) <= 1);
+	    imgDestroy(iBlur);
+	    imgDestroy(iConv);
+	    imgDestroy(iGauss);
+	}
+	imgDestroy(iRand);
+
 	Image *iImag = imgFromBitmap("default.bmp");
 	assert(iImag);
 	Viewer *vImag = viewOpen(iImag->width, iImag->height, "Input image");
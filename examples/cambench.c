@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "easimage.h"
+
+// Measures capture and conversion throughput, without display.
+// Runs on build machines without cameras using a virtual camera.
+
+char *Device = "virtual:bars";
+unsigned int Frames = 1000;
+unsigned int Threads = 0;
+unsigned int Fps = CAM_FPS_MAX;
+unsigned int Format = RGB24;
+char *RecFile = NULL;
+int LowLatency = 0;
+
+
+void Usage(char *pname) {
+    printf("Usage: %s [options] [device]\n  Options:\n", pname);
+    printf("\t-n N  Number of frames to grab (%u)\n", Frames);
+    printf("\t-f N  Frame rate, 0 for the highest (no pacing on virtual cameras)\n");
+    printf("\t-t N  Number of conversion threads\n");
+    printf("\t-g    Convert to GREY instead of RGB24\n");
+    printf("  Device is a V4L2 device, a raw, Y4M or MJPEG file,\n");
+    printf("  or virtual:bars, virtual:gradient or virtual:noise (default %s)\n", Device);
+}
+
+
+int GetParams(int argc, char **argv) {
+	int i;
+	for ( i=1 ; i<argc ; i++ ) {
+	    if ( argv[i][0]!='-' ) {
+		Device = argv[i];
+		continue;
+	    }
+	    switch( argv[i][1] ) {
+		case 'n':
+		    if ( ++i<argc ) Frames = atoi(argv[i]);
+		    break;
+		case 'f':
+		    if ( ++i<argc ) Fps = atoi(argv[i]);
+		    if ( Fps==0 ) Fps = CAM_FPS_MAX;
+		    break;
+		case 't':
+		    if ( ++i<argc ) Threads = atoi(argv[i]);
+		    break;
+		case 'g':
+		    Format = GREY;
+		    break;
+		case 'r':
+		    if ( ++i<argc ) RecFile = argv[i];
+		    break;
+		case 'l':
+		    LowLatency = 1;
+		    break;
+		default:
+		    Usage(argv[0]);
+		    return -1;
+	    }
+	}
+	return 0;
+}
+
+
+int main(int argc, char * argv[])
+{
+	printf("\ncambench %s\n\n", STR(VERSION) );
+
+	if ( GetParams(argc,argv) ) exit(1);
+
+	CamParams par;
+	memset(&par, 0, sizeof(par));
+	par.fps = Fps;
+	par.n_threads = Threads;
+	par.low_latency = LowLatency;
+	Camera * cam = camOpenEx(Device, 640, 480, YUYV, &par);
+	if ( ! cam ) {
+	        fprintf(stderr, "camOpen failed.\n");
+		exit(1);
+	}
+	camPrintCaps(cam);
+
+	Image * img = imgNew(cam->width, cam->height, Format==GREY ? 8 : 24);
+	img->format = Format;
+
+	Recorder * rec = NULL;
+	if ( RecFile ) {
+		rec = recOpen(RecFile, 0, REC_DROP_NEWEST);
+		if ( ! rec ) exit(1);
+		camRecord(cam, rec);
+	}
+
+	unsigned int i;
+	long int t0 = GetTime();
+	for ( i=0 ; i<Frames ; i++ ) {
+	        if ( camGrabImage(cam,img) ) {
+		    fprintf(stderr, "GrabImage: Image not got\n");
+	            break;
+	    	}
+	}
+	long int ms = GetTime() - t0;
+	printf("\n%u frames in %.3f seconds. %.1f frames/sec\n",
+		i, ms/1000., i*1000./max(ms, 1) );
+
+	CamStats stats;
+	camGetStats(cam, &stats);
+	printf("%lu frames captured, %lu dropped, %lu skipped. Waiting %.3f ms/frame, converting %.3f ms/frame\n\n",
+		stats.frames, stats.dropped, stats.skipped,
+		stats.wait_us / 1000. / max(stats.frames, 1),
+		stats.convert_us / 1000. / max(stats.frames, 1) );
+
+	if ( rec ) {
+		camRecord(cam, NULL);
+		RecStats rstats;
+		recGetStats(rec, &rstats);
+		printf("Recording: %lu frames dropped, up to %u frames queued\n\n",
+			rstats.dropped, rstats.max_queued);
+		if ( recClose(rec) ) fprintf(stderr, "Recording '%s' failed\n", RecFile);
+	}
+
+	imgDestroy(img);
+	camClose(cam);
+	return 0;
+}
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "easimage.h"
+
+// Shows synchronised frames from two cameras side by side
+
+int main(int argc, char * argv[])
+{
+	printf("\ncamsync %s\n\n", STR(VERSION) );
+
+	char *dev[2] = { "/dev/video0", "/dev/video1" };
+	if ( argc>2 ) {
+		dev[0] = argv[1];
+		dev[1] = argv[2];
+	}
+	long long tolerance_us = argc>3 ? atoi(argv[3]) : 5000;
+
+	// initialise the library
+	init_easimage();
+
+	CameraGroup *grp = camGroupNew();
+	Camera *cam[2];
+	Image *img[2];
+	int c;
+	for ( c=0 ; c<2 ; c++ ) {
+		cam[c] = camOpen(dev[c], 640, 480, YUYV);
+		if ( ! cam[c] || camGroupAdd(grp, cam[c]) < 0 ) {
+			fprintf(stderr, "Could not use camera %s\n", dev[c]);
+			exit(1);
+		}
+		img[c] = imgNew(cam[c]->width, cam[c]->height, 24);
+		img[c]->format = RGB24;
+	}
+
+	// both frames in a single window
+	unsigned int width = img[0]->width + img[1]->width;
+	unsigned int height = max(img[0]->height, img[1]->height);
+	Image *pair = imgNew(width, height, 24);
+	pair->format = RGB24;
+	Viewer *view = viewOpen(width, height, "camsync");
+
+	int i;
+	long long skew = 0;
+	GetTime();
+	for ( i=0 ; i<100000 && ! easimageAppEnd ; i++ ) {
+
+		appProcEvents();
+
+		if ( camGroupGrabSync(grp, img, tolerance_us, 2000) ) {
+			fprintf(stderr, "No synchronised frames\n");
+			break;
+		}
+		skew += llabs(img[0]->timestamp - img[1]->timestamp);
+
+		unsigned int y;
+		memset(pair->data, 0, pair->stride * height);
+		for ( c=0 ; c<2 ; c++ )
+			for ( y=0 ; y<img[c]->height ; y++ )
+				memcpy(pair->data + y * pair->stride + c * img[0]->width * 3,
+					img[c]->data + y * img[c]->stride, img[c]->width * 3);
+		viewDisplayImage(view, pair);
+	}
+	printf("%d frame pairs in %.1f seconds. %.2f pairs/sec, mean skew %.2f ms\n\n",
+		i, GetTime()/1000., i*1000./GetTime(), i ? skew / 1000. / i : 0. );
+
+	camGroupDestroy(grp);
+	for ( c=0 ; c<2 ; c++ ) {
+		imgDestroy(img[c]);
+		camClose(cam[c]);
+	}
+	imgDestroy(pair);
+	viewClose(view);
+
+	// finally we unintialise the library
+	quit_easimage();
+	return 0;
+}
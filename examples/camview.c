@@ -7,6 +7,7 @@
 #include <fcntl.h>
 
 int Verbose=0;
+int Threaded=0;
 
 Image *img;
 
@@ -21,6 +22,7 @@ void Help() {
 void Usage(char *pname) {
     printf("Usage: %s [options]\n  Options:\n", pname);
     printf("\t-v    Increase verbosity (debug mode)\n");
+    printf("\t-t    Capture frames on a background thread\n");
 }
 
 
@@ -33,6 +35,9 @@ int GetParams(int argc, char **argv) {
 		    case 'v':
 			Verbose = 1;
 			break;
+		    case 't':
+			Threaded = 1;
+			break;
                     default:
                         Usage(argv[0]);
                         return -1;
@@ -74,6 +79,12 @@ int main(int argc, char * argv[])
 	Image * img = imgNew(cam->width, cam->height, 24);
 	img->format = RGB24;
 
+	unsigned int seq = 0;
+	if ( Threaded && camStartCapture(cam, img->format, 0) ) {
+	        fprintf(stderr, "camStartCapture failed.\n");
+		exit(1);
+	}
+
 	int i;
 	GetTime();
 	for ( i=0 ; i<100000 && ! easimageAppEnd ; i++ ) {
@@ -81,7 +92,8 @@ int main(int argc, char * argv[])
                 appProcEvents();
 
 	        // capture an image from the webcam
-	        if (camGrabImage(cam,img)) {
+	        if ( Threaded ? camGetFrame(cam, img, &seq, CAM_FRAME_LATEST) :
+				camGrabImage(cam,img) ) {
 		    fprintf(stderr, "GrabImage: Image not got\n");
 	            break;
 	    	}
@@ -92,6 +104,13 @@ int main(int argc, char * argv[])
 	printf("%d images processed in %.1f seconds. %.2f img/sec\n\n", 
 		i, GetTime()/1000., i*1000./GetTime() );
 
+	CamStats stats;
+	camGetStats(cam, &stats);
+	printf("%lu frames captured, %lu dropped. Waiting %.1f ms/frame, converting %.1f ms/frame\n\n",
+		stats.frames, stats.dropped,
+		stats.wait_us / 1000. / max(stats.frames, 1),
+		stats.convert_us / 1000. / max(stats.frames, 1) );
+
 	// now we will free the memory for the various objects
 	imgDestroy(img);
 	viewClose(view);
@@ -3,7 +3,7 @@
  *
  */
 
-
+#define _GNU_SOURCE		/* memmem() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,6 +21,13 @@
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <asm/types.h>          /* for videodev2.h */
 
@@ -31,6 +38,29 @@
 struct Buffer {
 	struct v4l2_buffer buf;
 	unsigned char *start;
+	int borrowed;		// buffer is lent out by camAcquireFrame()
+	Image *img;		// USERPTR mode: Image providing the buffer memory
+	int img_owned;		// img was allocated by the library
+	int dmabuf_fd;		// exported DMABUF descriptor, or -1
+	long long timestamp;	// capture time of the last dequeued frame, in us
+	unsigned int sequence;	// driver sequence number of the last dequeued frame
+	unsigned int bytesused;	// payload size of the last dequeued frame
+};
+
+// state of a virtual camera, see camOpenVirtual()
+struct VirtualCam {
+	unsigned int fps;
+	unsigned int sequence;		// number of frame periods elapsed
+	unsigned int next;		// buffer to try first on the next dequeue
+	unsigned char *queued;		// per buffer: 1 while owned by the virtual camera
+	// file replay
+	unsigned char *data;		// file contents, or frames converted from it
+	unsigned char **frames;
+	unsigned int *frame_len;
+	unsigned int n_frames;
+	// synthetic pattern, twice the frame width so it can scroll
+	unsigned char *pattern;
+	unsigned int pattern_row;	// bytes per pattern row
 };
 
 static void errno_exit(const char *s)
@@ -42,6 +72,14 @@ static void errno_exit(const char *s)
 }
 
 
+// monotonic clock, in microseconds
+static long long camClock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
 static int xioctl(Camera * cam, int request, void *arg)
 {
         int r;
@@ -52,6 +90,64 @@ static int xioctl(Camera * cam, int request, void *arg)
         return r;
 }
 
+// pixel size, in bits, of frames delivered in a given format
+static unsigned short pixFormatDepth(unsigned int format)
+{
+	switch( format ) {
+		case YUYV:
+			return 16;
+		case GREY:
+			return 8;
+		case GREY16:
+			return 16;
+		case RGB32:
+			return 32;
+		default:
+			return 24;
+	}
+}
+
+char *pixFormatName(unsigned int format, char* name) {
+        static char localName[20];
+	if ( !name ) name = localName;
+	switch( format ) {
+		case BGR24:
+			strcpy(name,"BGR24");
+			break;
+                case RGB24:
+                        strcpy(name,"RGB24");
+                        break;
+                case YUYV:
+                        strcpy(name,"YUYV");
+                        break;
+                case MJPEG:
+                        strcpy(name,"MJPEG");
+                        break;
+                case GREY:
+                        strcpy(name,"GREY");
+                        break;
+                case RGBA32:
+                        strcpy(name,"RGBA32");
+                        break;
+                case GREY16:
+                        strcpy(name,"GREY16");
+                        break;
+                case RGB48:
+                        strcpy(name,"RGB48");
+                        break;
+                case GREY32F:
+                        strcpy(name,"GREY32F");
+                        break;
+                case RGB96F:
+                        strcpy(name,"RGB96F");
+                        break;
+                default: 
+                        strcpy(name,"unknown");
+                        break;
+	}
+	return name;
+}
+
 int camPrintCaps(Camera *cam)
 {
 	if ( cam->handle==-1 ) {
@@ -60,6 +156,18 @@ int camPrintCaps(Camera *cam)
 	}
 	printf("Camera name: %s\n", cam->name);
 	printf("Frame Size: %ux%u\n", cam->width,cam->height);
+	double rates[16];
+	unsigned int i, n_rates = camEnumFrameRates(cam, rates, 16);
+	printf("Frame Rate: %.2f fps (supported:", camGetFrameRate(cam));
+	for ( i = 0 ; i < n_rates ; i++ )
+		printf(" %.2f", rates[i]);
+	printf(")\n");
+	if ( cam->virt ) {
+		printf("Virtual camera, %s frames", pixFormatName(cam->format, NULL));
+		if ( cam->virt->fps == CAM_FPS_MAX ) printf(" as fast as possible\n");
+		else printf(" at %u fps\n", cam->virt->fps);
+		return 0;
+	}
         struct v4l2_capability caps = {};
         if (-1 == xioctl(cam, VIDIOC_QUERYCAP, &caps))
         {
@@ -117,13 +225,13 @@ int camPrintCaps(Camera *cam)
 }
 
 // routine to initialise memory mapped i/o on the camera device
-static void init_mmap(Camera * cam)
+static void init_mmap(Camera * cam, unsigned int count)
 {
 	struct v4l2_requestbuffers req;
 
 	memset (&(req), 0, sizeof (req));
 
-	req.count               = 1;
+	req.count               = count;
 	req.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	req.memory              = V4L2_MEMORY_MMAP;
 
@@ -160,6 +268,9 @@ static void init_mmap(Camera * cam)
 
 		// copy the v4l2 buffer into the device buffers
 		cam->buffers[cam->n_buffers].buf = buffer;
+		cam->buffers[cam->n_buffers].borrowed = 0;
+		cam->buffers[cam->n_buffers].img = NULL;
+		cam->buffers[cam->n_buffers].dmabuf_fd = -1;
 		// memory map the device buffers
 		cam->buffers[cam->n_buffers].start = 
 			mmap( NULL, // start anywhere
@@ -177,8 +288,89 @@ static void init_mmap(Camera * cam)
 }
 
 
-// returns an index to the dequeued buffer
-static unsigned int camDequeueBuffer(Camera * cam)
+// routine to initialise user pointer i/o on the camera device
+// The driver writes frames straight into the pixel memory of Images.
+static void init_userptr(Camera * cam, unsigned int count, unsigned int frame_size,
+			Image **images)
+{
+	struct v4l2_requestbuffers req;
+
+	memset (&(req), 0, sizeof (req));
+
+	req.count               = count;
+	req.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory              = V4L2_MEMORY_USERPTR;
+
+	if (-1 == xioctl (cam, VIDIOC_REQBUFS, &req)) {
+		if (EINVAL == errno) {
+			fprintf (stderr, "%s does not support "
+					"user pointer i/o\n", cam->name);
+			exit (EXIT_FAILURE);
+		} else {
+			errno_exit ("VIDIOC_REQBUFS");
+		}
+	}
+	// user supplied Images can not be replaced
+	if ( images && req.count < count ) {
+		fprintf (stderr, "%s accepted only %u of %u user buffers\n",
+			cam->name, req.count, count);
+		exit (EXIT_FAILURE);
+	}
+	if ( images ) req.count = count;
+
+	// allocate memory for the buffers
+	cam->buffers = calloc (req.count, sizeof (*(cam->buffers)));
+
+	if (!cam->buffers) {
+		fprintf (stderr, "Out of memory\n");
+		exit (EXIT_FAILURE);
+	}
+
+	unsigned short depth = pixFormatDepth(cam->format);
+	for (cam->n_buffers = 0; cam->n_buffers < req.count; cam->n_buffers++) {
+		struct Buffer *b = &cam->buffers[cam->n_buffers];
+		Image *img;
+
+		if ( images ) {
+			img = images[cam->n_buffers];
+			b->img_owned = 0;
+		}
+		else {
+			// rows may be padded by the driver, so allocate enough rows
+			// to hold frame_size bytes and then restore the real height
+			unsigned int row = cam->width * depth/8;
+			img = imgNewEx(cam->width, (frame_size + row - 1) / row, depth, IMG_PACKED);
+			if ( img==NULL ) exit (EXIT_FAILURE);
+			img->height = cam->height;
+			img->format = cam->format;
+			b->img_owned = 1;
+		}
+		if ( img->stride != cam->width * depth/8 ) {
+			fprintf (stderr, "User buffer %u rows are not packed, see IMG_PACKED\n", cam->n_buffers);
+			exit (EXIT_FAILURE);
+		}
+		if ( img->stride * img->height < frame_size ) {
+			fprintf (stderr, "User buffer %u is too small for a %u bytes frame\n",
+				cam->n_buffers, frame_size);
+			exit (EXIT_FAILURE);
+		}
+
+		memset (&(b->buf), 0, sizeof (b->buf));
+		b->buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		b->buf.memory      = V4L2_MEMORY_USERPTR;
+		b->buf.index       = cam->n_buffers;
+		b->buf.m.userptr   = (unsigned long)img->data;
+		b->buf.length      = frame_size;
+		b->start = img->data;
+		b->img = img;
+		b->borrowed = 0;
+		b->dmabuf_fd = -1;
+	}
+}
+
+// waits for a frame to be ready for dequeuing
+// returns 1 when a frame is ready or 0 on timeout
+static int camWaitFrame(Camera * cam, unsigned int timeout_ms)
 {
 	while(1){
 		fd_set fds;
@@ -189,10 +381,12 @@ static unsigned int camDequeueBuffer(Camera * cam)
 		FD_SET (cam->handle, &fds);
 
 		// Timeout.
-		tv.tv_sec = 20;
-		tv.tv_usec = 0;
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
 		
+		long long t0 = camClock();
 		r = select (cam->handle + 1, &fds, NULL, NULL, &tv);
+		cam->stats.wait_us += camClock() - t0;
 
 		if (-1 == r) {
 			if (EINTR == errno){
@@ -201,248 +395,1681 @@ static unsigned int camDequeueBuffer(Camera * cam)
 			}
 			errno_exit ("select");
 		}
+		return r > 0;
+	}
+}
 
-		if (0 == r) {
-			fprintf (stderr, "select timeout\n");
-			exit (EXIT_FAILURE);
-		}
+// keeps the metadata of a dequeued frame and updates the counters
+static void camFrameDone(Camera * cam, unsigned int index, long long timestamp,
+			unsigned int sequence, unsigned int bytesused)
+{
+	struct Buffer *b = &cam->buffers[index];
+	b->timestamp = timestamp;
+	b->sequence = sequence;
+	b->bytesused = bytesused;
+	if ( cam->stats.frames > 0 && sequence > cam->stats.last_sequence + 1 )
+		cam->stats.dropped += sequence - cam->stats.last_sequence - 1;
+	cam->stats.last_sequence = sequence;
+	cam->stats.frames++;
+
+	if ( cam->recorder ) {
+		Image frame;
+		memset(&frame, 0, sizeof(frame));
+		frame.width = cam->width;
+		frame.height = cam->height;
+		frame.format = cam->format;
+		frame.depth = pixFormatDepth(cam->format);
+		frame.stride = cam->width * frame.depth/8;
+		frame.flags = IMG_PACKED;
+		frame.data = b->start;
+		frame.timestamp = timestamp;
+		frame.sequence = sequence;
+		recWrite(cam->recorder, &frame, cam->format == MJPEG ? bytesused : 0);
+	}
+}
 
-		// read the frame
-		struct v4l2_buffer buffer;
-		memset (&(buffer), 0, sizeof (buffer));
 
-		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buffer.memory = V4L2_MEMORY_MMAP;
-		
-		// dequeue a buffer
-		if (-1 == xioctl (cam, VIDIOC_DQBUF, &buffer)) {
-			switch (errno) {
-				case EAGAIN:
-					continue;
-
-				case EIO:
-					/* Could ignore EIO, see spec. */
-					/* fall through */
-
-				default:
-					errno_exit ("VIDIOC_DQBUF");
-			}
-		}
-		assert (buffer.index < cam->n_buffers);
+/*
+ * Virtual cameras
+ *
+ * A virtual camera replays frames from a file, or generates a moving test
+ * pattern, behind the same buffer queue as a V4L2 device. Its handle is a
+ * timerfd ticking at the frame rate, or an eventfd that is always readable
+ * when frames are not paced, so select() and epoll work unchanged.
+ */
 
-		// return the buffer index handle to the buffer
-		return buffer.index;
+// stores an RGB colour as pixel x of a row in a frame format
+// YUYV pixels pairs take the chroma of their first pixel
+static void camPutPixel(unsigned char *row, unsigned int x, unsigned int format,
+			int r, int g, int b)
+{
+	// full range BT.601, the inverse of YUYV_to_RGB24()
+	int y = (77*r + 150*g + 29*b + 128) >> 8;
+	int cb = ((-43*r - 85*g + 128*b + 128) >> 8) + 128;
+	int cr = ((128*r - 107*g - 21*b + 128) >> 8) + 128;
+	switch ( format ) {
+		case YUYV:
+			row[2*x] = y;
+			if ( x & 1 ) break;
+			row[2*x+1] = cb > 255 ? 255 : cb;
+			row[2*x+3] = cr > 255 ? 255 : cr;
+			break;
+		case GREY:
+			row[x] = y;
+			break;
+		case RGB24:	// b,g,r bytes
+			row[3*x] = b;
+			row[3*x+1] = g;
+			row[3*x+2] = r;
+			break;
+		case BGR24:
+			row[3*x] = r;
+			row[3*x+1] = g;
+			row[3*x+2] = b;
+			break;
+		case RGB32:
+			row[4*x] = r;
+			row[4*x+1] = g;
+			row[4*x+2] = b;
+			row[4*x+3] = 255;
+			break;
 	}
 }
 
+static const char *camPatterns[] = { "bars", "gradient", "noise" };
 
-// enqueue a given device buffer to the device
-static void camEnqueueBuffer(Camera * cam, unsigned int buffer_id)
+// colour of pixel (x,y) of a test pattern for a w x h frame
+static void camPatternColor(int pattern, unsigned int x, unsigned int y,
+			unsigned int w, unsigned int h, int *rgb)
 {
-	// enqueue a given buffer by index
-	if(-1 == xioctl(cam, VIDIOC_QBUF, &(cam->buffers[buffer_id].buf) )){
-		errno_exit("VIDIOC_QBUF");
+	static const unsigned char bars[8][3] = {
+		{ 255, 255, 255 }, { 255, 255, 0 }, { 0, 255, 255 }, { 0, 255, 0 },
+		{ 255, 0, 255 },   { 255, 0, 0 },   { 0, 0, 255 },   { 0, 0, 0 } };
+	uint32_t v;
+	switch ( pattern ) {
+		case 0:		// colour bars over a grey ramp
+			if ( y < h*3/4 ) {
+				const unsigned char *c = bars[x*8/w];
+				rgb[0] = c[0];
+				rgb[1] = c[1];
+				rgb[2] = c[2];
+			}
+			else rgb[0] = rgb[1] = rgb[2] = x*255 / max(w-1, 1);
+			break;
+		case 1:
+			rgb[0] = x*255 / w;
+			rgb[1] = y*255 / h;
+			rgb[2] = 255 - (rgb[0] + rgb[1]) / 2;
+			break;
+		default:	// deterministic noise
+			v = x * 0x9E3779B1u ^ y * 0x85EBCA77u;
+			v ^= v >> 15;
+			v *= 0x2C1B3C6Du;
+			v ^= v >> 12;
+			rgb[0] = v & 255;
+			rgb[1] = (v >> 8) & 255;
+			rgb[2] = (v >> 16) & 255;
+			break;
 	}
-
-	return;
 }
 
-char *pixFormatName(unsigned int format, char* name) {
-        static char localName[20];
-	if ( !name ) name = localName;
-	switch( format ) {
-		case BGR24:
-			strcpy(name,"BGR24");
-			break;
-                case RGB24:
-                        strcpy(name,"RGB24");
-                        break;
-                case YUYV:
-                        strcpy(name,"YUYV");
-                        break;
-                case MJPEG:
-                        strcpy(name,"MJPEG");
-                        break;
-                default: 
-                        strcpy(name,"unknown");
-                        break;
+static int camVirtualPattern(Camera * cam, const char *name)
+{
+	struct VirtualCam *vc = cam->virt;
+	int pattern;
+	for ( pattern = 0 ; pattern < 3 ; pattern++ )
+		if ( ! strcmp(name, camPatterns[pattern]) ) break;
+	if ( pattern == 3 ) {
+		fprintf(stderr, "Unknown virtual camera pattern '%s'. Use bars, gradient or noise.\n", name);
+		return 1;
 	}
-	return name;
+	if ( cam->format != YUYV && cam->format != GREY && cam->format != RGB24 &&
+	     cam->format != BGR24 && cam->format != RGB32 ) {
+		fprintf(stderr, "Virtual camera patterns can not be generated in %s format\n",
+			pixFormatName(cam->format, NULL));
+		return 1;
+	}
+	if ( cam->width == 0 ) cam->width = 640;
+	if ( cam->height == 0 ) cam->height = 480;
+	if ( cam->format == YUYV ) cam->width &= ~1u;
+
+	unsigned int w = cam->width, h = cam->height, x, y;
+	vc->pattern_row = 2 * w * pixFormatDepth(cam->format)/8;
+	vc->pattern = malloc(vc->pattern_row * h);
+	if ( vc->pattern == NULL ) {
+		fprintf(stderr, "Could not allocate memory for virtual camera\n");
+		return 1;
+	}
+	for ( y = 0 ; y < h ; y++ )
+		for ( x = 0 ; x < 2*w ; x++ ) {
+			int rgb[3];
+			camPatternColor(pattern, x % w, y, w, h, rgb);
+			camPutPixel(vc->pattern + y * vc->pattern_row, x, cam->format, rgb[0], rgb[1], rgb[2]);
+		}
+	return 0;
 }
 
+// copies frame number seq of the scrolling pattern into a buffer
+static void camVirtualRender(Camera * cam, struct Buffer * b, unsigned int seq)
+{
+	struct VirtualCam *vc = cam->virt;
+	unsigned int bpp = pixFormatDepth(cam->format)/8;
+	unsigned int row = cam->width * bpp;
+	// 4 pixels per frame, keeping YUYV pairs
+	unsigned int offset = (seq * 4u % cam->width) & ~1u;
+	unsigned int y;
+	for ( y = 0 ; y < cam->height ; y++ )
+		memcpy(b->start + y * row, vc->pattern + y * vc->pattern_row + offset * bpp, row);
+}
 
-void BGR24_to_RGB24(	unsigned char *in, 
-				unsigned char *out,
-				unsigned int nPixels )
+static int camVirtualAddFrame(struct VirtualCam *vc, unsigned char *start, unsigned int len)
 {
-	uint32_t i;
-	if ( in==out ) {
-		// iterate 1 pixels at a time, so 3 bytes for RGB or GBR
-		for(i = 0 ; i < nPixels ; i++ ) {
-			unsigned char temp = in[2];
-			in[2] = in[0];
-			in[0] = temp;
-			in += 3;
+	if ( (vc->n_frames & (vc->n_frames + 1)) == 0 ) {	// grow at powers of two
+		unsigned int n = 2 * vc->n_frames + 1;
+		unsigned char **frames = realloc(vc->frames, n * sizeof(*frames));
+		if ( frames ) vc->frames = frames;
+		unsigned int *frame_len = realloc(vc->frame_len, n * sizeof(*frame_len));
+		if ( frame_len ) vc->frame_len = frame_len;
+		if ( ! frames || ! frame_len ) {
+			fprintf(stderr, "Could not allocate memory for virtual camera\n");
+			return 1;
 		}
-		return;
-	}
-	// iterate 1 pixels at a time, so 3 bytes for RGB or GBR
-	for(i = 0 ; i < nPixels ; i++ ) {
-		out[0] = in[2];
-		out[1] = in[1];
-		out[2] = in[0];
-		in += 3;
-		out += 3;
 	}
+	vc->frames[vc->n_frames] = start;
+	vc->frame_len[vc->n_frames] = len;
+	vc->n_frames++;
+	return 0;
 }
 
-void YUYV_to_RGB24(unsigned char *buffer_ptr, unsigned char *img_ptr, unsigned int nPixels) {
-
-	int nBytes = nPixels * 2;
-	// iterate 2 pixels at a time, so 4 bytes for YUV and 6 bytes for RGB
-	uint32_t i, j;
-	for(i = 0, j = 0; i < nBytes; i+=4, j+=6){
-		// jml, May 2015
-		// Add unsigned
-		unsigned char * buffer_pos = buffer_ptr + i;
-		unsigned char * img_pos = img_ptr + j;
-		
-		// YCbCr to RGB conversion (from: http://www.equasys.de/colorconversion.html);
-		int y0 = buffer_pos[0];
-		int cb = buffer_pos[1];
-		int y1 = buffer_pos[2];
-		int cr = buffer_pos[3];
-		int r;
-		int g;
-		int b;
-
-		// first RGB
-		r = y0 + ((357 * cr) >> 8) - 179;
-
-		g = y0 - (( 87 * cb) >> 8) +  44 - ((181 * cr) >> 8) + 91;
-		b = y0 + ((450 * cb) >> 8) - 226;
-		// clamp to 0 to 255
-		img_pos[2] = r > 254 ? 255 : (r < 0 ? 0 : r);
-		img_pos[1] = g > 254 ? 255 : (g < 0 ? 0 : g);
-		img_pos[0] = b > 254 ? 255 : (b < 0 ? 0 : b);
-		
-		// second RGB
-		r = y1 + ((357 * cr) >> 8) - 179;
-		g = y1 - (( 87 * cb) >> 8) +  44 - ((181 * cr) >> 8) + 91;
-		b = y1 + ((450 * cb) >> 8) - 226;
-		img_pos[5] = r > 254 ? 255 : (r < 0 ? 0 : r);
-		img_pos[4] = g > 254 ? 255 : (g < 0 ? 0 : g);
-		img_pos[3] = b > 254 ? 255 : (b < 0 ? 0 : b);
+// converts the frames of a YUV4MPEG2 stream to YUYV or GREY
+static int camVirtualY4M(Camera * cam, unsigned char *file, size_t size, unsigned int *fps)
+{
+	struct VirtualCam *vc = cam->virt;
+	unsigned char *end = file + size;
+	unsigned char *p = memchr(file, '\n', size);
+	if ( p == NULL ) {
+		fprintf(stderr, "Invalid YUV4MPEG2 header in '%s'\n", cam->name);
+		return 1;
+	}
+	*p++ = 0;
+
+	// stream parameters
+	unsigned int w = 0, h = 0, num = 0, den = 0;
+	int sx = 1, sy = 1, mono = 0;
+	char *tok = strtok((char *)file + 9, " ");
+	for ( ; tok ; tok = strtok(NULL, " ") ) {
+		switch ( tok[0] ) {
+			case 'W': w = atoi(tok + 1); break;
+			case 'H': h = atoi(tok + 1); break;
+			case 'F': sscanf(tok + 1, "%u:%u", &num, &den); break;
+			case 'C':
+				if ( ! strncmp(tok + 1, "mono", 4) ) mono = 1;
+				else if ( ! strncmp(tok + 1, "444", 3) ) sx = sy = 0;
+				else if ( ! strncmp(tok + 1, "422", 3) ) sy = 0;
+				else if ( strncmp(tok + 1, "420", 3) ) {
+					fprintf(stderr, "YUV4MPEG2 colour space '%s' not supported\n", tok + 1);
+					return 1;
+				}
+				break;
+		}
+	}
+	if ( w == 0 || h == 0 || (w & 1 && cam->format != GREY) ) {
+		fprintf(stderr, "Invalid YUV4MPEG2 frame size %ux%u\n", w, h);
+		return 1;
+	}
+	if ( *fps == 0 && num && den ) *fps = max((num + den/2) / den, 1);
+	cam->width = w;
+	cam->height = h;
+	if ( cam->format != GREY ) cam->format = YUYV;
+
+	unsigned int cw = (w + sx) >> sx, ch = (h + sy) >> sy;
+	size_t in_size = (size_t)w * h + (mono ? 0 : 2 * (size_t)cw * ch);
+	size_t out_size = (size_t)w * h * pixFormatDepth(cam->format)/8;
+
+	// count the frames
+	unsigned int n = 0;
+	unsigned char *q;
+	for ( q = p ; end - q > 5 && ! memcmp(q, "FRAME", 5) ; n++ ) {
+		unsigned char *nl = memchr(q, '\n', end - q);
+		if ( nl == NULL || (size_t)(end - nl - 1) < in_size ) break;
+		q = nl + 1 + in_size;
+	}
+	if ( n == 0 ) {
+		fprintf(stderr, "No frames in '%s'\n", cam->name);
+		return 1;
+	}
+	vc->data = malloc(n * out_size);
+	if ( vc->data == NULL ) {
+		fprintf(stderr, "Could not allocate memory for virtual camera frames\n");
+		return 1;
 	}
-}
 
-void YUYV_to_BGR24(unsigned char *in, unsigned char *out,
-			unsigned int size) {
-	YUYV_to_RGB24(in,out,size);
-	BGR24_to_RGB24(out,out,size);
+	unsigned int i, x, y;
+	for ( i = 0, q = p ; i < n ; i++ ) {
+		const unsigned char *Y = (unsigned char *)memchr(q, '\n', end - q) + 1;
+		const unsigned char *U = Y + w * h;
+		const unsigned char *V = U + cw * ch;
+		unsigned char *out = vc->data + i * out_size;
+		if ( camVirtualAddFrame(vc, out, out_size) ) return 1;
+		q = (unsigned char *)Y + in_size;
+		if ( cam->format == GREY ) {
+			memcpy(out, Y, w * h);
+			continue;
+		}
+		for ( y = 0 ; y < h ; y++ )
+			for ( x = 0 ; x < w ; x += 2, out += 4 ) {
+				unsigned int c = (y >> sy) * cw + (x >> sx);
+				out[0] = Y[y*w + x];
+				out[1] = mono ? 128 : U[c];
+				out[2] = Y[y*w + x + 1];
+				out[3] = mono ? 128 : V[c];
+			}
+	}
+	return 0;
 }
 
-int camGrabImage(Camera * cam, Image *img)
+// loads the frames to replay: YUV4MPEG2, concatenated JPEG images
+// for MJPEG, or raw frames of the requested size and format
+static int camVirtualFile(Camera * cam, const char *path, unsigned int *fps)
 {
-	// dequeue a buffer
-	unsigned int buffer_id = camDequeueBuffer(cam);
+	struct VirtualCam *vc = cam->virt;
+	FILE *f = fopen(path, "rb");
+	if ( f == NULL ) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", path, errno, strerror(errno));
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+	unsigned char *file = size > 0 ? malloc(size) : NULL;
+	if ( file == NULL || fread(file, 1, size, f) != (size_t)size ) {
+		fprintf(stderr, "Failed to read '%s'\n", path);
+		free(file);
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
 
-	// Copy data across, converting to RGB along the way
-	unsigned char * buffer_ptr = cam->buffers[buffer_id].start;
-	unsigned char * img_ptr = img->data;
-	unsigned int img_size = img->width * img->height;
+	if ( size > 10 && ! memcmp(file, "YUV4MPEG2 ", 10) ) {
+		int res = camVirtualY4M(cam, file, size, fps);
+		free(file);
+		return res;
+	}
 
-	if ( cam->format == img->format ) {
-	    memcpy(img->data, buffer_ptr, 
-		img->width * img->height * img->depth/8);
-	}
-	else if ( (cam->format==RGB24 && img->format==BGR24) ||
-		  (cam->format==BGR24 && img->format==RGB24) ) 
-	    BGR24_to_RGB24( (unsigned char *)buffer_ptr, img_ptr, img_size );
-	else if ( cam->format==YUYV && img->format==RGB24 )
-	    YUYV_to_RGB24( (unsigned char *)buffer_ptr, img_ptr, img_size );
-	else if ( cam->format==YUYV && img->format==BGR24 )
-	    YUYV_to_BGR24( (unsigned char *)buffer_ptr, img_ptr, img_size );
+	// frames point into the file contents
+	vc->data = file;
+	if ( cam->format == MJPEG ) {
+		unsigned char *p = file, *end = file + size;
+		unsigned int w = 0, h = 0;
+		while ( p + 4 <= end ) {
+			unsigned char *soi = memmem(p, end - p, "\xff\xd8", 2);
+			if ( soi == NULL ) break;
+			unsigned char *eoi = memmem(soi + 2, end - soi - 2, "\xff\xd9", 2);
+			if ( eoi == NULL ) break;
+			if ( camVirtualAddFrame(vc, soi, eoi + 2 - soi) ) return 1;
+			p = eoi + 2;
+		}
+		// the first frame gives the size
+		if ( vc->n_frames ) {
+			JpegDecoder *dec = jpegNew();
+			int res = dec == NULL || jpegGetSize(dec, vc->frames[0], vc->frame_len[0], &w, &h);
+			jpegDestroy(dec);
+			if ( res ) return 1;
+			cam->width = w;
+			cam->height = h;
+		}
+	}
 	else {
-	    fprintf(stderr,"camGrabImage() error: %s (%u->%u)\n",
-		"The requested Pixel format conversion is not supported",cam->format,img->format); 
-	    printf("Cam format is %s (%u)\n", pixFormatName(cam->format, NULL), cam->format);
-	    printf("Img format is %s (%u)\n", pixFormatName(img->format, NULL), img->format);
-	    
+		size_t frame_size = (size_t)cam->width * cam->height * pixFormatDepth(cam->format)/8;
+		unsigned int i;
+		if ( frame_size ) {
+			for ( i = 0 ; i < size / frame_size ; i++ )
+				if ( camVirtualAddFrame(vc, file + i * frame_size, frame_size) ) return 1;
+		}
+	}
+	if ( vc->n_frames == 0 ) {
+		fprintf(stderr, "No %ux%u %s frames in '%s'\n", cam->width, cam->height,
+			pixFormatName(cam->format, NULL), path);
+		return 1;
 	}
-	// requeue the buffer
-	camEnqueueBuffer(cam, buffer_id);
-
-	// return the image
 	return 0;
 }
 
-Image * camGrabNewImage(Camera *cam) {
-	int depth = 24;
-	int format = cam->format;
-	if ( format==YUYV ) depth = 16;
-	Image *img = imgNew(cam->width, cam->height, depth);
-	img->format = format;
-	camGrabImage(cam, img);
-	return img;
+static void camVirtualClose(Camera * cam)
+{
+	struct VirtualCam *vc = cam->virt;
+	unsigned int i;
+	if ( vc->pattern )
+		for ( i = 0; i < cam->n_buffers; ++i )
+			free(cam->buffers[i].start);
+	free(cam->buffers);
+	cam->buffers = NULL;
+	if ( cam->handle >= 0 ) close(cam->handle);
+	cam->handle = -1;
+	free(vc->queued);
+	free(vc->data);
+	free(vc->frames);
+	free(vc->frame_len);
+	free(vc->pattern);
+	free(vc);
+	cam->virt = NULL;
 }
 
-
-static void camSetFormat(Camera *cam, unsigned int width, unsigned int height, int format)
+// opens a virtual camera, see camOpenEx()
+static Camera * camOpenVirtual(char *dev_name, unsigned int width, unsigned int height, int format,
+			CamParams *par)
 {
-	printf("Setting device format\n");
-
-	struct v4l2_format fmt;
-	unsigned int min;
-
-	if ( format==0 ) format = YUYV;
+	Camera * cam = calloc(1, sizeof(*cam));
+	struct VirtualCam *vc = calloc(1, sizeof(*vc));
+	if ( cam == NULL || vc == NULL ) {
+		fprintf(stderr, "Could not allocate memory for camera device structure\n");
+		free(cam);
+		free(vc);
+		return NULL;
+	}
+	cam->name = dev_name;
+	cam->handle = -1;
+	cam->width = width;
+	cam->height = height;
+	cam->format = format;
+	cam->memory = V4L2_MEMORY_MMAP;
+	cam->virt = vc;
+	cam->low_latency = par->low_latency;
+	cam->params = *par;
+
+	unsigned int fps = par->fps;
+	int res;
+	if ( ! strncmp(dev_name, CAM_VIRTUAL_PREFIX, strlen(CAM_VIRTUAL_PREFIX)) )
+		res = camVirtualPattern(cam, dev_name + strlen(CAM_VIRTUAL_PREFIX));
+	else
+		res = camVirtualFile(cam, dev_name, &fps);
+	if ( fps == 0 ) fps = CAM_DEFAULT_FPS;
+	vc->fps = fps;
+
+	// frame clock
+	if ( res == 0 ) {
+		if ( fps == CAM_FPS_MAX )
+			cam->handle = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+		else {
+			cam->handle = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			struct itimerspec its;
+			long long period = 1000000000LL / fps;
+			its.it_interval.tv_sec = period / 1000000000LL;
+			its.it_interval.tv_nsec = period % 1000000000LL;
+			its.it_value = its.it_interval;
+			if ( cam->handle >= 0 && timerfd_settime(cam->handle, 0, &its, NULL) == -1 ) {
+				close(cam->handle);
+				cam->handle = -1;
+			}
+		}
+		if ( cam->handle < 0 ) {
+			perror("Virtual camera clock");
+			res = 1;
+		}
+	}
 
-	memset (&(fmt), 0, sizeof (fmt));
-	
-	fmt.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width       = width; 
-	fmt.fmt.pix.height      = height;
-	fmt.fmt.pix.pixelformat = format;
-	fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
-	if (-1 == xioctl (cam, VIDIOC_S_FMT, &fmt)){
-		errno_exit ("VIDIOC_S_FMT");
+	// buffers are all queued at start, as with a streaming device
+	if ( res == 0 ) {
+		cam->n_buffers = par->n_buffers;
+		cam->buffers = calloc(cam->n_buffers, sizeof(*cam->buffers));
+		vc->queued = malloc(cam->n_buffers);
+		res = cam->buffers == NULL || vc->queued == NULL;
+		unsigned int i;
+		size_t frame_size = (size_t)cam->width * cam->height * pixFormatDepth(cam->format)/8;
+		for ( i = 0; res == 0 && i < cam->n_buffers; ++i ) {
+			cam->buffers[i].dmabuf_fd = -1;
+			vc->queued[i] = 1;
+			if ( vc->pattern ) {
+				cam->buffers[i].start = malloc(frame_size);
+				if ( cam->buffers[i].start == NULL ) res = 1;
+			}
+		}
+		if ( res ) fprintf(stderr, "Could not allocate memory for virtual camera buffers\n");
+	}
+	if ( res ) {
+		camVirtualClose(cam);
+		free(cam);
+		return NULL;
 	}
 
-    	// Note VIDIOC_S_FMT may change width and height.
-	
-	// Buggy driver paranoia.
-	min = fmt.fmt.pix.width * 2;
-	if (fmt.fmt.pix.bytesperline < min)
-		fmt.fmt.pix.bytesperline = min;
-	min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-	if (fmt.fmt.pix.sizeimage < min)
-		fmt.fmt.pix.sizeimage = min;
+	if ( par->n_threads > 1 ) camSetThreads(cam, par->n_threads);
+	return cam;
+}
 
-	// ONLY CHANGES IN IMAGE SIZE ARE HANDLED ATM
-	// set device image size to the returned width and height.
-	cam->width = fmt.fmt.pix.width;
-	cam->height = fmt.fmt.pix.height;
-	cam->format = fmt.fmt.pix.pixelformat;
+// produces the next frame of a virtual camera, see camTryDequeue()
+static int camVirtualDequeue(Camera * cam)
+{
+	struct VirtualCam *vc = cam->virt;
+	uint64_t ticks = 1;
+	if ( vc->fps != CAM_FPS_MAX && read(cam->handle, &ticks, sizeof(ticks)) != sizeof(ticks) )
+		return -1;
+	// frame periods missed by the application are lost, as with a real device
+	vc->sequence += ticks;
+	unsigned int seq = vc->sequence - 1;
 
-	// initialise for memory mapped io
-	init_mmap (cam);
-	
-	// initialise streaming for capture
-	enum v4l2_buf_type type;
-	
-	// queue buffers ready for capture
 	unsigned int i;
-	for ( i = 0; i < cam->n_buffers; ++i) {
-		// buffers are initialised, so just call the enqueue function
-		camEnqueueBuffer(cam, i);		
+	for ( i = 0; i < cam->n_buffers; ++i ) {
+		unsigned int id = (vc->next + i) % cam->n_buffers;
+		if ( ! vc->queued[id] ) continue;
+		struct Buffer *b = &cam->buffers[id];
+		unsigned int bytesused;
+		if ( vc->pattern ) {
+			camVirtualRender(cam, b, seq);
+			bytesused = cam->width * cam->height * pixFormatDepth(cam->format)/8;
+		}
+		else {
+			b->start = vc->frames[seq % vc->n_frames];
+			bytesused = vc->frame_len[seq % vc->n_frames];
+		}
+		vc->queued[id] = 0;
+		vc->next = id + 1;
+		camFrameDone(cam, id, camClock(), seq, bytesused);
+		return id;
 	}
-	
-	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	// every buffer is held by the application
+	return -1;
+}
 
-	// turn on streaming
-	if (-1 == xioctl (cam, VIDIOC_STREAMON, &type)){
-		if(errno == EINVAL){
-			fprintf(stderr, "buffer type not supported, or no buffers allocated or mapped\n");
+// dequeues a filled buffer without waiting
+// returns the buffer index, or -1 if no frame is ready
+static int camTryDequeue(Camera * cam)
+{
+	if ( cam->virt ) return camVirtualDequeue(cam);
+
+	struct v4l2_buffer buffer;
+	memset (&(buffer), 0, sizeof (buffer));
+
+	buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buffer.memory = cam->memory;
+
+	// dequeue a buffer
+	if (-1 == xioctl (cam, VIDIOC_DQBUF, &buffer)) {
+		switch (errno) {
+			case EAGAIN:
+				return -1;
+
+			case EIO:
+				/* Could ignore EIO, see spec. */
+				/* fall through */
+
+			default:
+				errno_exit ("VIDIOC_DQBUF");
+		}
+	}
+	assert (buffer.index < cam->n_buffers);
+
+	camFrameDone(cam, buffer.index,
+		buffer.timestamp.tv_sec * 1000000LL + buffer.timestamp.tv_usec,
+		buffer.sequence, buffer.bytesused);
+
+	// return the buffer index handle to the buffer
+	return buffer.index;
+}
+
+
+// enqueue a given device buffer to the device
+static void camEnqueueBuffer(Camera * cam, unsigned int buffer_id)
+{
+	if ( cam->virt ) {
+		cam->virt->queued[buffer_id] = 1;
+		return;
+	}
+
+	// enqueue a given buffer by index
+	if(-1 == xioctl(cam, VIDIOC_QBUF, &(cam->buffers[buffer_id].buf) )){
+		errno_exit("VIDIOC_QBUF");
+	}
+
+	return;
+}
+
+
+// returns an index to the dequeued buffer
+static unsigned int camDequeueBuffer(Camera * cam)
+{
+	while(1){
+		if ( ! camWaitFrame(cam, 20000) ) {
+			fprintf (stderr, "select timeout\n");
+			exit (EXIT_FAILURE);
+		}
+
+		// read the frame
+		int buffer_id = camTryDequeue(cam);
+		if ( buffer_id < 0 ) continue;
+
+		// low latency: skip to the newest frame already captured.
+		// Virtual cameras always deliver the current frame period.
+		if ( cam->low_latency && ! cam->virt ) {
+			int newer;
+			while ( (newer = camTryDequeue(cam)) >= 0 ) {
+				camEnqueueBuffer(cam, buffer_id);
+				cam->stats.skipped++;
+				buffer_id = newer;
+			}
+		}
+		return buffer_id;
+	}
+}
+
+
+
+// Frame conversion routine.
+// Converts a packed frame of width x height camera pixels.
+typedef void (*FrameConv)(unsigned char *in, unsigned char *out,
+			unsigned int width, unsigned int height);
+
+static void convSwap24(unsigned char *in, unsigned char *out, unsigned int w, unsigned int h)
+{
+	BGR24_to_RGB24(in, out, w*h);
+}
+
+static void convYUYV_RGB24(unsigned char *in, unsigned char *out, unsigned int w, unsigned int h)
+{
+	YUYV_to_RGB24(in, out, w*h);
+}
+
+static void convYUYV_BGR24(unsigned char *in, unsigned char *out, unsigned int w, unsigned int h)
+{
+	YUYV_to_BGR24(in, out, w*h);
+}
+
+static void convYUYV_GREY(unsigned char *in, unsigned char *out, unsigned int w, unsigned int h)
+{
+	YUYV_to_GREY(in, out, w*h);
+}
+
+static void convYUYV_RGBA32(unsigned char *in, unsigned char *out, unsigned int w, unsigned int h)
+{
+	YUYV_to_RGBA32(in, out, w*h);
+}
+
+// Supported capture conversions.
+// Entries with half set produce an image with half the camera width and height.
+static const struct {
+	unsigned int from;
+	unsigned int to;
+	int half;
+	FrameConv conv;
+} camConversions[] = {
+	{ RGB24, BGR24,  0, convSwap24 },
+	{ BGR24, RGB24,  0, convSwap24 },
+	{ YUYV,  RGB24,  0, convYUYV_RGB24 },
+	{ YUYV,  BGR24,  0, convYUYV_BGR24 },
+	{ YUYV,  GREY,   0, convYUYV_GREY },
+	{ YUYV,  RGBA32, 0, convYUYV_RGBA32 },
+	{ YUYV,  RGB24,  1, YUYV_to_RGB24_half },
+	{ YUYV,  BGR24,  1, YUYV_to_BGR24_half },
+	{ YUYV,  GREY,   1, YUYV_to_GREY_half },
+};
+
+// A frame conversion split into horizontal bands
+struct ConvJob {
+	FrameConv conv;
+	unsigned char *in;
+	unsigned char *out;
+	unsigned int width;		// camera frame width
+	unsigned int height;		// camera frame height
+	unsigned int in_row;		// bytes per camera row
+	unsigned int out_row;		// bytes per image row
+	unsigned int band_rows;		// camera rows per band
+	int half;
+	int rowwise;			// rows are not contiguous (region of interest or padded image)
+};
+
+static void camConvertBand(void *arg, unsigned int band)
+{
+	struct ConvJob *job = arg;
+	unsigned int y0 = band * job->band_rows;
+	if ( y0 >= job->height ) return;
+	unsigned int rows = min(job->band_rows, job->height - y0);
+	if ( ! job->rowwise ) {
+		job->conv(job->in + y0 * job->in_row, job->out + (y0 >> job->half) * job->out_row,
+			job->width, rows);
+		return;
+	}
+	// one row at a time, or one pair of rows when halving
+	unsigned int y, step = 1 << job->half;
+	for ( y = y0 ; y < y0 + rows ; y += step )
+		job->conv(job->in + y * job->in_row, job->out + (y >> job->half) * job->out_row,
+			job->width, min(step, y0 + rows - y));
+}
+
+// decodes a compressed frame into Image img
+// img may have the camera size, or 1/8 of it for a fast DC only decode
+static int camDecodeFrame(Camera * cam, struct Buffer * b, Image *img)
+{
+	if ( cam->jpeg == NULL ) {
+	    cam->jpeg = jpegNew();
+	    if ( cam->jpeg == NULL ) return 1;
+	}
+	img->timestamp = b->timestamp;
+	img->sequence = b->sequence;
+
+	long long t0 = camClock();
+	int res = jpegDecode(cam->jpeg, b->start, b->bytesused, img, cam->workers);
+	cam->stats.convert_us += camClock() - t0;
+	return res;
+}
+
+// converts a captured frame from the camera format into Image img
+// img may have the camera size, or half of it for down scaling conversions
+static int camConvertFrame(Camera * cam, struct Buffer * b, Image *img)
+{
+	unsigned char * buffer_ptr = b->start;
+	int half;
+	if ( imgMakeWritable(img) ) return 1;
+	if ( cam->format == MJPEG && img->format != MJPEG )
+	    return camDecodeFrame(cam, b, img);
+	if ( img->width == cam->width && img->height == cam->height )
+	    half = 0;
+	else if ( img->width == cam->width/2 && img->height == cam->height/2 )
+	    half = 1;
+	else {
+	    fprintf(stderr,"camGrabImage() error: image size %ux%u does not match camera size %ux%u\n",
+		img->width, img->height, cam->width, cam->height);
+	    return 1;
+	}
+
+	img->timestamp = b->timestamp;
+	img->sequence = b->sequence;
+
+	long long t0 = camClock();
+	unsigned int out_row = img->width * img->depth/8;
+	if ( cam->format == img->format && ! half ) {
+	    if ( img->stride == out_row )
+		memcpy(img->data, buffer_ptr, out_row * img->height);
+	    else {
+		unsigned int y;
+		for ( y = 0 ; y < img->height ; y++ )
+		    memcpy(img->data + y * img->stride, buffer_ptr + y * out_row, out_row);
+	    }
+	    cam->stats.convert_us += camClock() - t0;
+	    return 0;
+	}
+	unsigned int i;
+	for ( i = 0 ; i < sizeof(camConversions)/sizeof(camConversions[0]) ; i++ ) {
+	    if ( camConversions[i].from == cam->format &&
+		 camConversions[i].to == img->format &&
+		 camConversions[i].half == half ) {
+		struct ConvJob job;
+		job.conv = camConversions[i].conv;
+		job.in = buffer_ptr;
+		job.out = img->data;
+		job.width = cam->width;
+		job.height = cam->height;
+		job.in_row = cam->width * pixFormatDepth(cam->format)/8;
+		job.out_row = img->stride;
+		job.half = half;
+		job.rowwise = img->stride != out_row;
+		// one band per thread; half scale bands must keep row pairs together
+		unsigned int n_bands = poolSize(cam->workers);
+		job.band_rows = (cam->height + n_bands - 1) / n_bands;
+		if ( half ) job.band_rows = (job.band_rows + 1) & ~1u;
+		poolRun(cam->workers, camConvertBand, &job, n_bands);
+		cam->stats.convert_us += camClock() - t0;
+		return 0;
+	    }
+	}
+	fprintf(stderr,"camGrabImage() error: %s (%u->%u)\n",
+	    "The requested Pixel format conversion is not supported",cam->format,img->format); 
+	printf("Cam format is %s (%u)\n", pixFormatName(cam->format, NULL), cam->format);
+	printf("Img format is %s (%u)\n", pixFormatName(img->format, NULL), img->format);
+	return 1;
+}
+
+// tells if camConvertFrame() can produce full size images in pixel format format
+static int camCanConvert(Camera * cam, unsigned int format)
+{
+	if ( format == cam->format ) return 1;
+	if ( cam->format == MJPEG )
+	    return format == RGB24 || format == BGR24 || format == GREY;
+	unsigned int i;
+	for ( i = 0 ; i < sizeof(camConversions)/sizeof(camConversions[0]) ; i++ )
+	    if ( camConversions[i].from == cam->format &&
+		 camConversions[i].to == format &&
+		 ! camConversions[i].half )
+		return 1;
+	return 0;
+}
+
+int camGrabImage(Camera * cam, Image *img)
+{
+	if ( cam->thread ) {
+		fprintf(stderr, "camGrabImage() error: use camGetFrame() while the capture thread is running\n");
+		return 1;
+	}
+
+	// dequeue a buffer
+	unsigned int buffer_id = camDequeueBuffer(cam);
+
+	// Copy data across, converting to RGB along the way
+	int res = camConvertFrame(cam, &cam->buffers[buffer_id], img);
+
+	// requeue the buffer
+	camEnqueueBuffer(cam, buffer_id);
+
+	// return the image
+	return res;
+}
+
+// converts the w x h region at x,y of a captured frame into Image img
+// only the rows and columns inside the region are read and converted
+static int camConvertROI(Camera * cam, struct Buffer * b, Image *img,
+			unsigned int x, unsigned int y)
+{
+	unsigned int w = img->width, h = img->height;
+	unsigned int row_len = w * img->depth/8;
+	unsigned int r;
+	if ( imgMakeWritable(img) ) return 1;
+
+	if ( cam->format == MJPEG && img->format != MJPEG ) {
+		// JPEG blocks can not be skipped, decode the whole frame
+		Image *full = cam->scratch;
+		if ( full == NULL || full->width != cam->width || full->height != cam->height ||
+		     full->depth != img->depth ) {
+			if ( full ) imgDestroy(full);
+			full = cam->scratch = imgNew(cam->width, cam->height, img->depth);
+			if ( full == NULL ) return 1;
+		}
+		full->format = img->format;
+		int res = camDecodeFrame(cam, b, full);
+		for ( r = 0 ; r < h && ! res ; r++ )
+			memcpy(img->data + r * img->stride,
+				full->data + (y + r) * full->stride + x * img->depth/8, row_len);
+		img->timestamp = b->timestamp;
+		img->sequence = b->sequence;
+		return res;
+	}
+
+	// a YUYV macropixel holds two columns, copied or converted together
+	if ( cam->format == YUYV && (x & 1 || w & 1) ) {
+	    fprintf(stderr,"camGrabImageROI() error: YUYV regions must start at an even column and have an even width\n");
+	    return 1;
+	}
+	unsigned int in_depth = pixFormatDepth(cam->format);
+	unsigned int in_row = cam->width * in_depth/8;
+	unsigned char *in = b->start + y * in_row + x * in_depth/8;
+	img->timestamp = b->timestamp;
+	img->sequence = b->sequence;
+
+	long long t0 = camClock();
+	if ( cam->format == img->format ) {
+	    for ( r = 0 ; r < h ; r++ )
+		memcpy(img->data + r * img->stride, in + r * in_row, row_len);
+	    cam->stats.convert_us += camClock() - t0;
+	    return 0;
+	}
+	unsigned int i;
+	for ( i = 0 ; i < sizeof(camConversions)/sizeof(camConversions[0]) ; i++ ) {
+	    if ( camConversions[i].from == cam->format &&
+		 camConversions[i].to == img->format &&
+		 ! camConversions[i].half ) {
+		struct ConvJob job;
+		job.conv = camConversions[i].conv;
+		job.in = in;
+		job.out = img->data;
+		job.width = w;
+		job.height = h;
+		job.in_row = in_row;
+		job.out_row = img->stride;
+		job.half = 0;
+		job.rowwise = 1;
+		unsigned int n_bands = poolSize(cam->workers);
+		job.band_rows = (h + n_bands - 1) / n_bands;
+		poolRun(cam->workers, camConvertBand, &job, n_bands);
+		cam->stats.convert_us += camClock() - t0;
+		return 0;
+	    }
+	}
+	fprintf(stderr,"camGrabImageROI() error: %s (%s->%s)\n",
+	    "The requested Pixel format conversion is not supported",
+	    pixFormatName(cam->format, NULL), pixFormatName(img->format, NULL));
+	return 1;
+}
+
+//! Grabs a region of interest of the next frame
+/*!
+ *  Same as camGrabImage(), but only the @p w x @p h region whose top left corner is
+ *  at column @p x and row @p y of the camera frame is converted into @p img,
+ *  so the conversion cost follows the region size rather than the frame size.
+ *  Frames of MJPEG cameras are still decoded whole.
+ *  With YUYV cameras @p x and @p w must be even.
+ *
+ *  The driver still transfers whole frames. When the region does not move,
+ *  camSetCrop() lets the device itself capture only that window.
+ *  @param cam the Camera to capture from
+ *  @param img destination Image, @p w x @p h pixels
+ *  @param x first column of the region
+ *  @param y first row of the region
+ *  @param w number of columns of the region
+ *  @param h number of rows of the region
+ *  @return 0 on success and 1 on error
+ */
+int camGrabImageROI(Camera * cam, Image *img, unsigned int x, unsigned int y,
+			unsigned int w, unsigned int h)
+{
+	if ( cam->thread ) {
+		fprintf(stderr, "camGrabImageROI() error: use camGetFrame() while the capture thread is running\n");
+		return 1;
+	}
+	if ( x + w > cam->width || y + h > cam->height || w == 0 || h == 0 ) {
+		fprintf(stderr, "camGrabImageROI() error: region %ux%u+%u+%u is outside the %ux%u frame\n",
+			w, h, x, y, cam->width, cam->height);
+		return 1;
+	}
+	if ( img->format == MJPEG ) {
+		fprintf(stderr, "camGrabImageROI() error: compressed frames can not be cropped\n");
+		return 1;
+	}
+	if ( img->width != w || img->height != h ) {
+		fprintf(stderr, "camGrabImageROI() error: image size %ux%u does not match region size %ux%u\n",
+			img->width, img->height, w, h);
+		return 1;
+	}
+
+	unsigned int buffer_id = camDequeueBuffer(cam);
+	int res = camConvertROI(cam, &cam->buffers[buffer_id], img, x, y);
+	camEnqueueBuffer(cam, buffer_id);
+	return res;
+}
+
+Image * camGrabNewImage(Camera *cam) {
+	return camGrabNewImageEx(cam, NULL);
+}
+
+//! Grabs the next frame into an Image taken from a pool
+/*!
+ *  Same as camGrabNewImage(), but the Image comes from @p pool, see imgPoolGet().
+ */
+Image * camGrabNewImageEx(Camera *cam, ImagePool *pool) {
+	int format = cam->format;
+	// compressed frames are decoded
+	if ( format == MJPEG ) format = RGB24;
+	Image *img = imgPoolGet(pool, cam->width, cam->height, pixFormatDepth(format));
+	if ( img == NULL ) return NULL;
+	img->format = format;
+	camGrabImage(cam, img);
+	return img;
+}
+
+// gives the buffer of a borrowed frame back to the driver,
+// called when the last handle to the frame is released
+static void camFrameDispose(void *ctx, unsigned char *data)
+{
+	Camera * cam = ctx;
+	unsigned int i;
+	for ( i = 0; i < cam->n_buffers; ++i ) {
+		if ( cam->buffers[i].start == data && cam->buffers[i].borrowed ) {
+			cam->buffers[i].borrowed = 0;
+			camEnqueueBuffer(cam, i);
+			return;
+		}
+	}
+	fprintf(stderr, "camReleaseFrame() error: frame was not acquired from '%s'\n",
+		cam->name);
+}
+
+//! Borrows the next captured frame
+/*!
+ *  Dequeues the next frame and returns an Image that points straight into
+ *  the capture buffer, so no pixel data is copied or converted.
+ *  The Image keeps the camera format. It may be shared with imgRetain(),
+ *  and the buffer goes back to the driver when the last handle is released
+ *  by camReleaseFrame() or imgRelease(). Handles being written get a private
+ *  copy of the pixels first, see imgMakeWritable().
+ *  Frames are released in the thread using the camera, and before camClose().
+ *  While a frame is borrowed its buffer is not available to the driver,
+ *  so at most n_buffers-1 frames should be held at the same time.
+ *  @param cam the Camera to capture from
+ *  @return The borrowed frame, or NULL if every buffer is already lent out
+ */
+Image * camAcquireFrame(Camera * cam)
+{
+	if ( cam->thread ) {
+		fprintf(stderr, "camAcquireFrame() error: use camGetFrame() while the capture thread is running\n");
+		return NULL;
+	}
+	unsigned int i, n_borrowed = 0;
+	for ( i = 0; i < cam->n_buffers; ++i )
+		n_borrowed += cam->buffers[i].borrowed;
+	if ( n_borrowed >= cam->n_buffers ) {
+		fprintf(stderr, "camAcquireFrame() error: all %u buffers are borrowed\n",
+			cam->n_buffers);
+		return NULL;
+	}
+
+	unsigned int buffer_id = camDequeueBuffer(cam);
+	struct Buffer * b = &cam->buffers[buffer_id];
+	unsigned short depth = pixFormatDepth(cam->format);
+	Image * frame = imgWrap(b->start, cam->width, cam->height, depth,
+			cam->width * depth/8, camFrameDispose, cam);
+	if ( frame == NULL ) {
+		camEnqueueBuffer(cam, buffer_id);
+		return NULL;
+	}
+	b->borrowed = 1;
+
+	frame->format = cam->format;
+	frame->name = cam->name;
+	frame->timestamp = b->timestamp;
+	frame->sequence = b->sequence;
+	return frame;
+}
+
+//! Returns a borrowed frame to the driver
+/*!
+ *  Releases @p frame, previously obtained from camAcquireFrame().
+ *  Same as imgRelease(): the capture buffer is requeued once no handle
+ *  made by imgRetain() or imgView() uses it anymore.
+ *  @param cam the Camera the frame was acquired from
+ *  @param frame the borrowed frame
+ */
+void camReleaseFrame(Camera * cam, Image * frame)
+{
+	if ( frame == NULL ) return;
+	imgRelease(frame);
+}
+
+//! Exports the buffer holding a borrowed frame as a DMABUF
+/*!
+ *  Returns a DMABUF file descriptor for the memory mapped buffer holding
+ *  @p frame, previously obtained from camAcquireFrame(). The descriptor can be
+ *  passed to other devices (GPU, encoders) to share the frame without copies.
+ *  The same descriptor is returned every time the buffer is used and it
+ *  remains owned by the camera; it is closed by camClose().
+ *  Only available in V4L2_MEMORY_MMAP mode, on drivers supporting VIDIOC_EXPBUF.
+ *  @param cam the Camera the frame was acquired from
+ *  @param frame the borrowed frame
+ *  @return The DMABUF file descriptor, or -1 on error
+ */
+int camExportFrame(Camera * cam, Image * frame)
+{
+	if ( cam->memory != V4L2_MEMORY_MMAP || cam->virt ) {
+		fprintf(stderr, "camExportFrame() error: only memory mapped buffers can be exported\n");
+		return -1;
+	}
+	unsigned int i;
+	for ( i = 0; i < cam->n_buffers; ++i ) {
+		struct Buffer *b = &cam->buffers[i];
+		if ( b->start != frame->data || ! b->borrowed ) continue;
+		if ( b->dmabuf_fd < 0 ) {
+			struct v4l2_exportbuffer expbuf;
+			memset (&(expbuf), 0, sizeof (expbuf));
+			expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			expbuf.index = i;
+			expbuf.flags = O_RDWR | O_CLOEXEC;
+			if ( -1 == xioctl(cam, VIDIOC_EXPBUF, &expbuf) ) {
+				perror("VIDIOC_EXPBUF");
+				return -1;
+			}
+			b->dmabuf_fd = expbuf.fd;
+		}
+		return b->dmabuf_fd;
+	}
+	fprintf(stderr, "camExportFrame() error: frame was not acquired from '%s'\n",
+		cam->name);
+	return -1;
+}
+
+
+// One converted frame published by the capture thread.
+// seq holds the number of the frame stored in img, or 0 while it is being written.
+struct FrameSlot {
+	Image *img;
+	unsigned int seq;
+};
+
+// Background capture state.
+// Frames are numbered from 1. The capture thread is the only writer:
+// it fills slot (n % n_slots) for frame n and then publishes n.
+// Readers never take a lock; they copy a slot out and check that its
+// sequence number did not change meanwhile (seqlock protocol).
+struct CamThread {
+	pthread_t thread;
+	int stop;
+	unsigned int published;		// last published frame number, also used as futex word
+	unsigned int n_slots;
+	struct FrameSlot *slots;
+};
+
+static void futex_wake_all(unsigned int *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// sleeps while *addr==val, for at most timeout_ms
+static void futex_wait(unsigned int *addr, unsigned int val, unsigned int timeout_ms)
+{
+	struct timespec ts;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+static void *camCaptureLoop(void *arg)
+{
+	Camera * cam = arg;
+	struct CamThread *ct = cam->thread;
+
+	while ( ! __atomic_load_n(&ct->stop, __ATOMIC_RELAXED) ) {
+		// short timeout, so stop requests are noticed
+		if ( ! camWaitFrame(cam, 100) ) continue;
+
+		unsigned int buffer_id = camDequeueBuffer(cam);
+		unsigned int n = ct->published + 1;
+		if ( n==0 ) n = 1;	// 0 is reserved to mark slots being written
+		struct FrameSlot *slot = &ct->slots[n % ct->n_slots];
+
+		// invalidate the slot before touching its pixels
+		__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		int res = camConvertFrame(cam, &cam->buffers[buffer_id], slot->img);
+		camEnqueueBuffer(cam, buffer_id);
+		// a bad frame is dropped, its slot stays invalid until rewritten
+		if ( res ) continue;
+
+		__atomic_store_n(&slot->seq, n, __ATOMIC_RELEASE);
+		__atomic_store_n(&ct->published, n, __ATOMIC_RELEASE);
+		futex_wake_all(&ct->published);
+	}
+	return NULL;
+}
+
+//! Starts the background capture thread
+/*!
+ *  From now on a library owned thread dequeues and converts every frame
+ *  into a ring of @p n_slots Images using pixel format @p format.
+ *  Frames are then obtained by calling camGetFrame(), from one or more threads.
+ *  camGrabImage() and camAcquireFrame() are not available while the thread runs.
+ *  @param cam the Camera to capture from
+ *  @param format the pixel format of the published frames
+ *  @param n_slots number of frames kept in the ring. Zero selects CAM_DEFAULT_SLOTS.
+ *  @return 0 on success and 1 on error
+ */
+int camStartCapture(Camera * cam, unsigned int format, unsigned int n_slots)
+{
+	if ( cam->thread ) {
+		fprintf(stderr, "camStartCapture() error: capture thread already running\n");
+		return 1;
+	}
+	if ( ! camCanConvert(cam, format) ) {
+		char from[20], to[20];
+		fprintf(stderr, "camStartCapture() error: can not convert %s frames to %s\n",
+			pixFormatName(cam->format, from), pixFormatName(format, to));
+		return 1;
+	}
+	if ( n_slots==0 ) n_slots = CAM_DEFAULT_SLOTS;
+	// the slot after the newest one may be under rewrite
+	if ( n_slots<3 ) n_slots = 3;
+
+	struct CamThread *ct = calloc(1, sizeof(*ct));
+	if ( ct==NULL ) {
+		fprintf(stderr, "Could not allocate memory for capture thread\n");
+		return 1;
+	}
+	ct->n_slots = n_slots;
+	ct->slots = calloc(n_slots, sizeof(*ct->slots));
+	if ( ct->slots==NULL ) {
+		fprintf(stderr, "Could not allocate memory for capture thread\n");
+		free(ct);
+		return 1;
+	}
+	unsigned int i;
+	for ( i = 0; i < n_slots; ++i ) {
+		ct->slots[i].img = imgNew(cam->width, cam->height, pixFormatDepth(format));
+		if ( ct->slots[i].img==NULL ) break;
+		ct->slots[i].img->format = format;
+	}
+	if ( i < n_slots ) {
+		while ( i-- > 0 ) imgDestroy(ct->slots[i].img);
+		free(ct->slots);
+		free(ct);
+		return 1;
+	}
+
+	cam->thread = ct;
+	if ( pthread_create(&ct->thread, NULL, camCaptureLoop, cam) ) {
+		perror("Creating capture thread");
+		cam->thread = NULL;
+		for ( i = 0; i < n_slots; ++i ) imgDestroy(ct->slots[i].img);
+		free(ct->slots);
+		free(ct);
+		return 1;
+	}
+	return 0;
+}
+
+//! Stops the background capture thread
+/*!
+ *  Stops the thread started by camStartCapture() and releases its frame ring.
+ *  No camGetFrame() call may be in progress.
+ */
+void camStopCapture(Camera * cam)
+{
+	struct CamThread *ct = cam->thread;
+	if ( ct==NULL ) return;
+
+	__atomic_store_n(&ct->stop, 1, __ATOMIC_RELAXED);
+	pthread_join(ct->thread, NULL);
+	cam->thread = NULL;
+
+	unsigned int i;
+	for ( i = 0; i < ct->n_slots; ++i )
+		imgDestroy(ct->slots[i].img);
+	free(ct->slots);
+	free(ct);
+}
+
+//! Gets a frame published by the capture thread
+/*!
+ *  Copies a frame produced by the background capture thread into Image @p img,
+ *  which must have the size and format given to camStartCapture().
+ *  Each consumer keeps its own position in @p seq, the number of the last frame
+ *  it received. It should be initialised to 0.
+ *  With mode CAM_FRAME_LATEST the newest frame is returned and stale ones are dropped.
+ *  With mode CAM_FRAME_NEXT frames are returned in order. If the consumer falls
+ *  more than the ring size behind, the lost frames are skipped; the gap is visible in @p seq.
+ *  Blocks until a frame newer than @p seq is available.
+ *  @param cam the Camera running the capture thread
+ *  @param img the Image to store the frame
+ *  @param seq location of the consumer position
+ *  @param mode CAM_FRAME_LATEST or CAM_FRAME_NEXT
+ *  @return 0 on success and 1 on error
+ */
+int camGetFrame(Camera * cam, Image * img, unsigned int * seq, int mode)
+{
+	struct CamThread *ct = cam->thread;
+	if ( ct==NULL ) {
+		fprintf(stderr, "camGetFrame() error: capture thread is not running\n");
+		return 1;
+	}
+	Image *ref = ct->slots[0].img;
+	if ( img->width != ref->width || img->height != ref->height || img->depth != ref->depth ) {
+		fprintf(stderr, "camGetFrame() error: image does not match the capture format\n");
+		return 1;
+	}
+	if ( imgMakeWritable(img) ) return 1;
+
+	while(1) {
+		unsigned int pub = __atomic_load_n(&ct->published, __ATOMIC_ACQUIRE);
+		if ( pub == *seq ) {
+			// nothing new, sleep until the next publication
+			futex_wait(&ct->published, pub, 1000);
+			if ( __atomic_load_n(&ct->stop, __ATOMIC_RELAXED) ) return 1;
+			continue;
+		}
+		unsigned int want = pub;
+		if ( mode==CAM_FRAME_NEXT ) {
+			want = *seq + 1;
+			// frames older than this may already be overwritten
+			if ( pub - want > ct->n_slots - 2 )
+				want = pub - (ct->n_slots - 2);
+		}
+		struct FrameSlot *slot = &ct->slots[want % ct->n_slots];
+
+		if ( __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != want ) continue;
+		if ( img->stride == slot->img->stride )
+			memcpy(img->data, slot->img->data, img->stride * img->height);
+		else {
+			unsigned int y, row = img->width * img->depth/8;
+			for ( y = 0 ; y < img->height ; y++ )
+				memcpy(img->data + y * img->stride, slot->img->data + y * slot->img->stride, row);
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		// the writer got to this slot while we were copying, try again
+		if ( __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != want ) continue;
+
+		img->format = slot->img->format;
+		img->timestamp = slot->img->timestamp;
+		img->sequence = slot->img->sequence;
+		*seq = want;
+		return 0;
+	}
+}
+
+
+//! Gets the capture counters of a camera
+/*!
+ *  Copies the counters accumulated since the camera was opened,
+ *  or since the last camResetStats(), into @p stats.
+ *  While the capture thread runs the copy is not atomic, so
+ *  fields may come from consecutive frames.
+ */
+void camGetStats(Camera * cam, CamStats * stats)
+{
+	*stats = cam->stats;
+}
+
+//! Resets the capture counters of a camera
+void camResetStats(Camera * cam)
+{
+	memset(&cam->stats, 0, sizeof(cam->stats));
+}
+
+//! Sets the number of threads converting each frame
+/*!
+ *  Frame conversion in camGrabImage() (and in the capture thread) is split into
+ *  @p n_threads horizontal bands, converted in parallel by a pool of persistent
+ *  worker threads owned by the camera. The result is identical to the single
+ *  threaded conversion. A value of 0 or 1 converts on the calling thread only.
+ *  Must not be called while a frame is being converted.
+ *  @param cam the Camera to configure
+ *  @param n_threads total number of threads, including the calling one
+ *  @return 0 on success and 1 on error
+ */
+int camSetThreads(Camera * cam, unsigned int n_threads)
+{
+	poolDestroy(cam->workers);
+	cam->workers = NULL;
+	if ( n_threads <= 1 ) return 0;
+	cam->workers = poolNew(n_threads - 1);
+	return cam->workers == NULL;
+}
+
+
+/*
+ * Camera groups
+ */
+
+#define CAM_GROUP_EVENTS 16
+
+struct CameraGroup {
+	int epfd;			// epoll set with the handles of every camera
+	unsigned int n_cams;
+	Camera **cams;
+	int *held;			// newest buffer kept by camGroupGrabSync(), or -1
+};
+
+//! Creates an empty camera group
+/*!
+ *  A camera group waits on several open cameras at once, using a single epoll set.
+ *  Cameras are added with camGroupAdd(). Frames are then captured with
+ *  camGroupGrabAny() or camGroupGrabSync().
+ *  @return The new group, to be released by camGroupDestroy(), or NULL on error
+ */
+CameraGroup * camGroupNew(void)
+{
+	CameraGroup *grp = calloc(1, sizeof(*grp));
+	if ( grp==NULL ) {
+		fprintf(stderr, "Could not allocate memory for camera group\n");
+		return NULL;
+	}
+	grp->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if ( grp->epfd == -1 ) {
+		perror("epoll_create1");
+		free(grp);
+		return NULL;
+	}
+	return grp;
+}
+
+//! Adds a camera to a group
+/*!
+ *  The camera must stay open, and its capture thread stopped, while it belongs to the group.
+ *  Images passed to the group grab functions are indexed by the value returned here.
+ *  @param grp the camera group
+ *  @param cam an open Camera
+ *  @return The index of the camera in the group, or -1 on error
+ */
+int camGroupAdd(CameraGroup * grp, Camera * cam)
+{
+	if ( cam->thread ) {
+		fprintf(stderr, "camGroupAdd() error: camera is running a capture thread\n");
+		return -1;
+	}
+	Camera **cams = realloc(grp->cams, (grp->n_cams + 1) * sizeof(*cams));
+	if ( cams==NULL ) {
+		fprintf(stderr, "Could not allocate memory for camera group\n");
+		return -1;
+	}
+	grp->cams = cams;
+	int *held = realloc(grp->held, (grp->n_cams + 1) * sizeof(*held));
+	if ( held==NULL ) {
+		fprintf(stderr, "Could not allocate memory for camera group\n");
+		return -1;
+	}
+	grp->held = held;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = grp->n_cams;
+	if ( epoll_ctl(grp->epfd, EPOLL_CTL_ADD, cam->handle, &ev) == -1 ) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	grp->cams[grp->n_cams] = cam;
+	grp->held[grp->n_cams] = -1;
+	return grp->n_cams++;
+}
+
+// waits until some cameras have frames or the deadline (camClock() time) passes
+// stores the indices of the ready cameras and returns their number, 0 on timeout
+static int camGroupWait(CameraGroup * grp, long long deadline, unsigned int * ready)
+{
+	struct epoll_event ev[CAM_GROUP_EVENTS];
+	while(1) {
+		int timeout = -1;
+		if ( deadline != LLONG_MAX ) {
+			long long left = deadline - camClock();
+			timeout = left > 0 ? (left + 999) / 1000 : 0;
+		}
+		int n = epoll_wait(grp->epfd, ev, CAM_GROUP_EVENTS, timeout);
+		if ( n == -1 ) {
+			if ( errno == EINTR ) continue;
+			errno_exit("epoll_wait");
+		}
+		int i;
+		for ( i = 0 ; i < n ; i++ )
+			ready[i] = ev[i].data.u32;
+		return n;
+	}
+}
+
+static long long camGroupDeadline(int timeout_ms)
+{
+	return timeout_ms < 0 ? LLONG_MAX : camClock() + timeout_ms * 1000LL;
+}
+
+// gives the frame kept back for camera i to the driver
+static void camGroupRelease(CameraGroup * grp, unsigned int i)
+{
+	if ( grp->held[i] < 0 ) return;
+	camEnqueueBuffer(grp->cams[i], grp->held[i]);
+	grp->held[i] = -1;
+}
+
+// converts the frame kept back for camera i into img and releases it
+static int camGroupDeliver(CameraGroup * grp, unsigned int i, Image * img)
+{
+	Camera *cam = grp->cams[i];
+	int res = camConvertFrame(cam, &cam->buffers[grp->held[i]], img);
+	camGroupRelease(grp, i);
+	return res;
+}
+
+//! Grabs the next frame from any camera of a group
+/*!
+ *  Waits until any camera in the group delivers a frame and stores it in
+ *  @p imgs[i], where i is the camera index returned by camGroupAdd().
+ *  Ready cameras are served in turn, so a fast camera does not starve the others.
+ *  @param grp the camera group
+ *  @param imgs array with one destination Image per camera
+ *  @param timeout_ms maximum time to wait, in milliseconds. Negative waits forever.
+ *  @return The index of the camera that delivered the frame, or -1 on timeout or error
+ */
+int camGroupGrabAny(CameraGroup * grp, Image ** imgs, int timeout_ms)
+{
+	unsigned int i, ready[CAM_GROUP_EVENTS];
+	long long deadline = camGroupDeadline(timeout_ms);
+	while(1) {
+		int n = camGroupWait(grp, deadline, ready);
+		if ( n == 0 ) return -1;
+		for ( i = 0 ; i < (unsigned int)n ; i++ ) {
+			Camera *cam = grp->cams[ready[i]];
+			int buffer_id = camTryDequeue(cam);
+			if ( buffer_id < 0 ) continue;
+			int res = camConvertFrame(cam, &cam->buffers[buffer_id], imgs[ready[i]]);
+			camEnqueueBuffer(cam, buffer_id);
+			return res ? -1 : (int)ready[i];
+		}
+	}
+}
+
+//! Grabs a synchronised set of frames from every camera of a group
+/*!
+ *  Waits for one frame from each camera such that all their capture timestamps
+ *  fall within @p tolerance_us microseconds, and stores them in @p imgs.
+ *  The newest frame of each camera is kept while the others catch up;
+ *  the oldest one is dropped whenever the set is too spread out to match.
+ *  On timeout the frames kept so far are given back to the drivers.
+ *  The timestamps are those set by the drivers, so cameras should use the same
+ *  clock (normally CLOCK_MONOTONIC) and, ideally, a hardware trigger.
+ *  @param grp the camera group
+ *  @param imgs array with one destination Image per camera
+ *  @param tolerance_us maximum difference between frame timestamps, in microseconds
+ *  @param timeout_ms maximum time to wait, in milliseconds. Negative waits forever.
+ *  @return 0 on success and 1 on timeout or error
+ */
+int camGroupGrabSync(CameraGroup * grp, Image ** imgs, long long tolerance_us, int timeout_ms)
+{
+	unsigned int i, ready[CAM_GROUP_EVENTS];
+	long long deadline = camGroupDeadline(timeout_ms);
+
+	if ( grp->n_cams == 0 ) return 1;
+	while(1) {
+		// is the set complete and tight enough?
+		unsigned int n_held = 0, oldest = 0;
+		long long tmin = LLONG_MAX, tmax = LLONG_MIN;
+		for ( i = 0 ; i < grp->n_cams ; i++ ) {
+			if ( grp->held[i] < 0 ) continue;
+			long long t = grp->cams[i]->buffers[grp->held[i]].timestamp;
+			if ( t < tmin ) {
+				tmin = t;
+				oldest = i;
+			}
+			if ( t > tmax ) tmax = t;
+			n_held++;
+		}
+		if ( n_held == grp->n_cams ) {
+			if ( tmax - tmin <= tolerance_us ) {
+				int res = 0;
+				for ( i = 0 ; i < grp->n_cams ; i++ )
+					res |= camGroupDeliver(grp, i, imgs[i]);
+				return res;
+			}
+			// nothing newer can match the oldest frame
+			camGroupRelease(grp, oldest);
+			continue;
+		}
+
+		// cameras that always have frames never let camGroupWait() time out
+		int n = camClock() >= deadline ? 0 : camGroupWait(grp, deadline, ready);
+		if ( n == 0 ) {
+			for ( i = 0 ; i < grp->n_cams ; i++ )
+				camGroupRelease(grp, i);
+			return 1;
+		}
+		// keep only the newest frame of each ready camera
+		// a virtual camera at CAM_FPS_MAX always has a frame, so the drain is bounded
+		int k;
+		for ( k = 0 ; k < n ; k++ ) {
+			unsigned int c = ready[k];
+			unsigned int m;
+			int buffer_id;
+			for ( m = 0 ; m < grp->cams[c]->n_buffers ; m++ ) {
+				if ( (buffer_id = camTryDequeue(grp->cams[c])) < 0 ) break;
+				camGroupRelease(grp, c);
+				grp->held[c] = buffer_id;
+			}
+		}
+	}
+}
+
+//! Releases a camera group
+/*!
+ *  Frames kept back by the group are given back to the drivers.
+ *  The cameras themselves stay open and must be closed with camClose().
+ */
+void camGroupDestroy(CameraGroup * grp)
+{
+	if ( grp==NULL ) return;
+	unsigned int i;
+	for ( i = 0 ; i < grp->n_cams ; i++ )
+		camGroupRelease(grp, i);
+	close(grp->epfd);
+	free(grp->cams);
+	free(grp->held);
+	free(grp);
+}
+
+
+// Frame rates are handled as V4L2 frame intervals, in seconds per frame
+
+// lists the frame intervals supported by the device for its current size and format.
+// Stepwise and continuous ranges are reported by their two ends.
+// Returns the number of intervals stored in list.
+static unsigned int camEnumIntervals(Camera * cam, struct v4l2_fract *list, unsigned int max_n)
+{
+	struct v4l2_frmivalenum ival;
+	memset (&(ival), 0, sizeof (ival));
+	ival.pixel_format = cam->format;
+	ival.width = cam->width;
+	ival.height = cam->height;
+	unsigned int n = 0;
+	while ( n < max_n && 0 == xioctl(cam, VIDIOC_ENUM_FRAMEINTERVALS, &ival) ) {
+		if ( ival.type != V4L2_FRMIVAL_TYPE_DISCRETE ) {
+			list[n++] = ival.stepwise.min;
+			if ( n < max_n ) list[n++] = ival.stepwise.max;
+			break;
+		}
+		list[n++] = ival.discrete;
+		ival.index++;
+	}
+	return n;
+}
+
+// asks the device for fps frames per second, or for its highest rate with CAM_FPS_MAX.
+// Returns 0 on success and 1 if the device has no frame rate control.
+static int camSetFrameRate(Camera * cam, unsigned int fps)
+{
+	struct v4l2_streamparm parm;
+	memset (&(parm), 0, sizeof (parm));
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if ( -1 == xioctl(cam, VIDIOC_G_PARM, &parm) ||
+	     ! (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) ) {
+		fprintf(stderr, "%s has no frame rate control\n", cam->name);
+		return 1;
+	}
+
+	struct v4l2_fract tpf = { 1, fps };
+	if ( fps == CAM_FPS_MAX ) {
+		// shortest interval
+		struct v4l2_fract list[64];
+		unsigned int i, n = camEnumIntervals(cam, list, 64);
+		if ( n == 0 ) return 1;
+		tpf = list[0];
+		for ( i = 1 ; i < n ; i++ )
+			if ( (unsigned long long)list[i].numerator * tpf.denominator <
+			     (unsigned long long)tpf.numerator * list[i].denominator )
+				tpf = list[i];
+	}
+	parm.parm.capture.timeperframe = tpf;
+	if ( -1 == xioctl(cam, VIDIOC_S_PARM, &parm) ) {
+		perror("VIDIOC_S_PARM");
+		return 1;
+	}
+	return 0;
+}
+
+//! Lists the frame rates supported by a camera
+/*!
+ *  Enumerates the frame rates the device offers for its current frame size
+ *  and format, in frames per second. Devices with a continuous range report
+ *  its two ends. A paced virtual camera reports its own rate.
+ *  @param cam the Camera to query
+ *  @param rates array receiving the frame rates
+ *  @param max_rates size of @p rates
+ *  @return The number of frame rates stored in @p rates
+ */
+unsigned int camEnumFrameRates(Camera * cam, double *rates, unsigned int max_rates)
+{
+	if ( cam->virt ) {
+		if ( cam->virt->fps == CAM_FPS_MAX || max_rates == 0 ) return 0;
+		rates[0] = cam->virt->fps;
+		return 1;
+	}
+	struct v4l2_fract list[64];
+	unsigned int i, n = camEnumIntervals(cam, list, min(max_rates, 64));
+	for ( i = 0 ; i < n ; i++ )
+		rates[i] = list[i].numerator ? (double)list[i].denominator / list[i].numerator : 0;
+	return n;
+}
+
+//! Gets the frame rate of a camera
+/*!
+ *  @return The current frame rate, in frames per second, or 0 if unknown
+ *  or if the camera is a virtual camera delivering frames as fast as possible
+ */
+double camGetFrameRate(Camera * cam)
+{
+	if ( cam->virt )
+		return cam->virt->fps == CAM_FPS_MAX ? 0 : cam->virt->fps;
+	struct v4l2_streamparm parm;
+	memset (&(parm), 0, sizeof (parm));
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if ( -1 == xioctl(cam, VIDIOC_G_PARM, &parm) ||
+	     parm.parm.capture.timeperframe.numerator == 0 )
+		return 0;
+	return (double)parm.parm.capture.timeperframe.denominator /
+		parm.parm.capture.timeperframe.numerator;
+}
+
+
+static void camSetFormat(Camera *cam, unsigned int width, unsigned int height, int format,
+			CamParams *params)
+{
+	printf("Setting device format\n");
+
+	struct v4l2_format fmt;
+	unsigned int min;
+
+	if ( format==0 ) format = YUYV;
+
+	memset (&(fmt), 0, sizeof (fmt));
+	
+	fmt.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.fmt.pix.width       = width; 
+	fmt.fmt.pix.height      = height;
+	fmt.fmt.pix.pixelformat = format;
+	fmt.fmt.pix.field       = params->field;
+	if (-1 == xioctl (cam, VIDIOC_S_FMT, &fmt)){
+		errno_exit ("VIDIOC_S_FMT");
+	}
+
+    	// Note VIDIOC_S_FMT may change width and height.
+	
+	// Buggy driver paranoia.
+	min = fmt.fmt.pix.width * 2;
+	if (fmt.fmt.pix.bytesperline < min)
+		fmt.fmt.pix.bytesperline = min;
+	min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+	if (fmt.fmt.pix.sizeimage < min)
+		fmt.fmt.pix.sizeimage = min;
+
+	// ONLY CHANGES IN IMAGE SIZE ARE HANDLED ATM
+	// set device image size to the returned width and height.
+	cam->width = fmt.fmt.pix.width;
+	cam->height = fmt.fmt.pix.height;
+	cam->format = fmt.fmt.pix.pixelformat;
+
+	// the frame rate must be set before streaming starts
+	if ( params->fps ) camSetFrameRate(cam, params->fps);
+
+	// initialise buffers for the selected i/o method
+	cam->memory = params->memory;
+	if ( cam->memory == V4L2_MEMORY_USERPTR )
+		init_userptr (cam, params->n_buffers, fmt.fmt.pix.sizeimage, params->images);
+	else
+		init_mmap (cam, params->n_buffers);
+	
+	// initialise streaming for capture
+	enum v4l2_buf_type type;
+	
+	// queue buffers ready for capture
+	unsigned int i;
+	for ( i = 0; i < cam->n_buffers; ++i) {
+		// buffers are initialised, so just call the enqueue function
+		camEnqueueBuffer(cam, i);		
+	}
+	
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	// turn on streaming
+	if (-1 == xioctl (cam, VIDIOC_STREAMON, &type)){
+		if(errno == EINVAL){
+			fprintf(stderr, "buffer type not supported, or no buffers allocated or mapped\n");
 			exit(EXIT_FAILURE);
 		} else if(errno == EPIPE){
 			fprintf(stderr, "The driver implements pad-level format configuration and the pipeline configuration is invalid.\n");
@@ -455,6 +2082,123 @@ static void camSetFormat(Camera *cam, unsigned int width, unsigned int height, i
 }
 
 
+// unmaps or frees the capture buffers of a stopped device
+static void camFreeBuffers(Camera * cam)
+{
+	unsigned int i;
+	for (i = 0; i < cam->n_buffers; ++i){
+		if ( cam->buffers[i].dmabuf_fd >= 0 )
+			close(cam->buffers[i].dmabuf_fd);
+		if ( cam->memory == V4L2_MEMORY_USERPTR ) {
+			if ( cam->buffers[i].img_owned )
+				imgDestroy(cam->buffers[i].img);
+			continue;
+		}
+		if(-1 == munmap(cam->buffers[i].start, cam->buffers[i].buf.length)){
+			errno_exit("munmap");
+		}
+	}
+	
+	// free buffers
+	free (cam->buffers);
+	cam->buffers = NULL;
+	cam->n_buffers = 0;
+}
+
+
+//! Captures only a window of the sensor
+/*!
+ *  Asks the device to crop its frames to the @p w x @p h window whose top left
+ *  corner is at column @p x and row @p y of the sensor, using VIDIOC_S_SELECTION
+ *  (or VIDIOC_S_CROP on older drivers). Less data is then transferred and
+ *  converted for each frame. Streaming is restarted and the capture buffers
+ *  are reallocated, so this is meant for windows that seldom move; see
+ *  camGrabImageROI() for regions changing on every frame.
+ *
+ *  The driver may adjust the window. The frame size granted is stored in
+ *  Camera::width and Camera::height, and the window position in
+ *  Camera::crop_left and Camera::crop_top. A window as large as the sensor
+ *  restores the full frame.
+ *  Only memory mapped V4L2 devices can be cropped, with no frame borrowed
+ *  and the capture thread stopped.
+ *  @param cam the Camera to configure
+ *  @param x first sensor column of the window
+ *  @param y first sensor row of the window
+ *  @param w number of columns of the window
+ *  @param h number of rows of the window
+ *  @return 0 on success and 1 if the device can not crop
+ */
+int camSetCrop(Camera * cam, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+	if ( cam->virt || cam->memory != V4L2_MEMORY_MMAP ) {
+		fprintf(stderr, "camSetCrop() error: only memory mapped V4L2 devices can be cropped\n");
+		return 1;
+	}
+	if ( cam->thread ) {
+		fprintf(stderr, "camSetCrop() error: the capture thread is running\n");
+		return 1;
+	}
+	unsigned int i;
+	for ( i = 0; i < cam->n_buffers; ++i ) {
+		if ( cam->buffers[i].borrowed ) {
+			fprintf(stderr, "camSetCrop() error: frames are still borrowed\n");
+			return 1;
+		}
+	}
+
+	// stop streaming and release the buffers, so the frame size may change
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (-1 == xioctl (cam, VIDIOC_STREAMOFF, &type)){
+		errno_exit ("VIDIOC_STREAMOFF");
+	}
+	// keep the rate and field order chosen on opening
+	CamParams par = cam->params;
+	par.n_buffers = cam->n_buffers;
+	camFreeBuffers(cam);
+	struct v4l2_requestbuffers req;
+	memset (&(req), 0, sizeof (req));
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (-1 == xioctl (cam, VIDIOC_REQBUFS, &req)){
+		errno_exit ("VIDIOC_REQBUFS");
+	}
+
+	struct v4l2_selection sel;
+	memset (&(sel), 0, sizeof (sel));
+	sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	sel.target = V4L2_SEL_TGT_CROP;
+	sel.r.left = x;
+	sel.r.top = y;
+	sel.r.width = w;
+	sel.r.height = h;
+	int res = 0;
+	if (-1 == xioctl (cam, VIDIOC_S_SELECTION, &sel)) {
+		// older drivers only know the cropping ioctls
+		struct v4l2_crop crop;
+		memset (&(crop), 0, sizeof (crop));
+		crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		crop.c = sel.r;
+		if (-1 == xioctl (cam, VIDIOC_S_CROP, &crop)) {
+			perror("Cropping");
+			res = 1;
+		}
+		// S_CROP does not report adjustments
+		else if (0 == xioctl (cam, VIDIOC_G_CROP, &crop))
+			sel.r = crop.c;
+	}
+
+	// the frame takes the size of the window, unless the driver also scales
+	if ( res == 0 ) {
+		cam->crop_left = sel.r.left;
+		cam->crop_top = sel.r.top;
+		camSetFormat(cam, sel.r.width, sel.r.height, cam->format, &par);
+	}
+	else
+		camSetFormat(cam, cam->width, cam->height, cam->format, &par);
+	return res;
+}
+
+
 // close video capture device
 void camClose(Camera * cam)
 {
@@ -465,6 +2209,19 @@ void camClose(Camera * cam)
 
 	//printf("Stopping camera capture\n");
 
+	camStopCapture(cam);
+	camSetThreads(cam, 0);
+	jpegDestroy(cam->jpeg);
+	cam->jpeg = NULL;
+	if ( cam->scratch ) imgDestroy(cam->scratch);
+	cam->scratch = NULL;
+
+	if ( cam->virt ) {
+		camVirtualClose(cam);
+		free(cam);
+		return;
+	}
+
 	// stop capturing
 	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	if (-1 == xioctl (cam, VIDIOC_STREAMOFF, &type)){
@@ -472,15 +2229,7 @@ void camClose(Camera * cam)
 	}
 
 	// uninitialise the device
-	unsigned int i;
-	for (i = 0; i < cam->n_buffers; ++i){
-		if(-1 == munmap(cam->buffers[i].start, cam->buffers[i].buf.length)){
-			errno_exit("munmap");
-		}
-	}
-	
-	// free buffers
-	free (cam->buffers);
+	camFreeBuffers(cam);
 
 	// close the device
 	if (-1 == close(cam->handle)){
@@ -495,11 +2244,58 @@ void camClose(Camera * cam)
 // Open a video capture device
 Camera * camOpen(char *dev_name, unsigned int width, unsigned int height, int format)
 {
+	return camOpenEx(dev_name, width, height, format, NULL);
+}
+
+
+//! Opens a video capture device with extra parameters
+/*!
+ *  Same as camOpen(), but allows the capture setup to be tuned through @p params.
+ *  Passing NULL, or leaving fields at zero, selects the defaults used by camOpen().
+ *  The driver may grant a different number of buffers than requested;
+ *  the final value is available in Camera::n_buffers.
+ *
+ *  A non zero CamParams::fps sets the device frame rate, with CAM_FPS_MAX
+ *  selecting the highest rate offered for the frame size and format, see
+ *  camEnumFrameRates(). CamParams::low_latency trades smoothness for latency:
+ *  it defaults to CAM_LOW_LATENCY_BUFFERS buffers and the highest frame rate,
+ *  and every grab skips to the newest captured frame, requeuing older ones.
+ *
+ *  Instead of a V4L2 device, @p dev_name may name a virtual camera, useful for
+ *  tests and benchmarks on machines without cameras:
+ *  - "virtual:bars", "virtual:gradient" or "virtual:noise" generate a scrolling
+ *    test pattern of the requested size, in YUYV, GREY, RGB24, BGR24 or RGB32 format.
+ *  - A regular file is replayed in a loop. YUV4MPEG2 files give their own size
+ *    and frame rate and are delivered as YUYV (or GREY if requested). With format
+ *    MJPEG the file holds concatenated JPEG images. Otherwise it holds raw frames
+ *    of the requested size and format.
+ *
+ *  Virtual cameras deliver frames at CamParams::fps, the Y4M frame rate or CAM_DEFAULT_FPS.
+ *  CAM_FPS_MAX delivers them as fast as they are grabbed. Frames replayed from
+ *  files are not copied, so their pixel data must not be modified.
+ */
+Camera * camOpenEx(char *dev_name, unsigned int width, unsigned int height, int format,
+		CamParams *params)
+{
+	CamParams par;
+	memset(&par, 0, sizeof(par));
+	if ( params ) par = *params;
+	if ( par.n_buffers==0 )
+		par.n_buffers = par.low_latency ? CAM_LOW_LATENCY_BUFFERS : CAM_DEFAULT_BUFFERS;
+	if ( par.memory==0 ) par.memory = V4L2_MEMORY_MMAP;
+	if ( par.memory != V4L2_MEMORY_MMAP && par.memory != V4L2_MEMORY_USERPTR ) {
+		fprintf(stderr, "camOpenEx() error: unsupported memory type %u\n", par.memory);
+		return NULL;
+	}
+
 	// printf("Opening the device\n");
 	
 	if ( dev_name==NULL )	dev_name = "/dev/video0";
 	if ( format==0 )	format = YUYV;
 
+	if ( ! strncmp(dev_name, CAM_VIRTUAL_PREFIX, strlen(CAM_VIRTUAL_PREFIX)) )
+		return camOpenVirtual(dev_name, width, height, format, &par);
+
 	// initialise the device
 	struct stat st; 
 
@@ -509,19 +2305,34 @@ Camera * camOpen(char *dev_name, unsigned int width, unsigned int height, int fo
 		exit (EXIT_FAILURE);
 	}
 
+	// regular files are replayed
+	if ( S_ISREG (st.st_mode) )
+		return camOpenVirtual(dev_name, width, height, format, &par);
+
 	if (!S_ISCHR (st.st_mode)) {
 		fprintf (stderr, "%s is no device\n", dev_name);
 		exit (EXIT_FAILURE);
 	}
+	if ( par.low_latency && par.fps==0 ) par.fps = CAM_FPS_MAX;
 	
 	// set up the device
-	Camera * cam = malloc(sizeof(*cam));
+	Camera * cam = calloc(1, sizeof(*cam));
 	if(cam == NULL){
 		fprintf(stderr, "Could not allocate memory for camera device structure\n");
 		exit(EXIT_FAILURE);
 	}
 	cam->handle = -1;
 	cam->name = NULL;
+	cam->thread = NULL;
+	cam->workers = NULL;
+	cam->jpeg = NULL;
+	cam->scratch = NULL;
+	cam->recorder = NULL;
+	cam->crop_left = 0;
+	cam->crop_top = 0;
+	cam->low_latency = par.low_latency;
+	cam->params = par;
+	memset(&cam->stats, 0, sizeof(cam->stats));
 
 	// open the device
 	cam->handle = open(dev_name, O_RDWR | O_NONBLOCK, 0);
@@ -553,7 +2364,7 @@ Camera * camOpen(char *dev_name, unsigned int width, unsigned int height, int fo
 		exit (EXIT_FAILURE);
 	}
 
-	// check for memory mapped io
+	// check for streaming io (memory mapped or user pointer)
 	if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
 		fprintf (stderr, "%s does not support streaming i/o\n",
 			 cam->name);
@@ -561,7 +2372,9 @@ Camera * camOpen(char *dev_name, unsigned int width, unsigned int height, int fo
 	}
 
 	// Set the Camera's format
-	camSetFormat(cam, width, height, format);
+	camSetFormat(cam, width, height, format, &par);
+
+	if ( par.n_threads > 1 ) camSetThreads(cam, par.n_threads);
 
 	return cam;
 }
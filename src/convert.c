@@ -0,0 +1,1253 @@
+/**
+ * @file	convert.c
+ *
+ * Pixel format conversion routines.
+ *
+ * YUYV conversions, the conversions between packed pixels and separate
+ * component planes, and the conversions between 8 bit, 16 bit and float
+ * samples have SIMD implementations (SSE2, SSSE3, AVX2 and NEON)
+ * that are selected at run time according to the CPU features.
+ * All of them produce exactly the same output as the scalar code.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONV_X86
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CONV_NEON
+#include <arm_neon.h>
+#endif
+
+#include "easimage.h"
+
+/**
+ *  \addtogroup convert
+ *  @{
+ */
+
+//! Swaps the first and third component of 24 bit pixels
+/*!
+ *  Converts between RGB24 and BGR24. Conversion can be done in place (@p in equal to @p out).
+ */
+void BGR24_to_RGB24(	unsigned char *in,
+				unsigned char *out,
+				unsigned int nPixels )
+{
+	uint32_t i;
+	if ( in==out ) {
+		// iterate 1 pixels at a time, so 3 bytes for RGB or GBR
+		for(i = 0 ; i < nPixels ; i++ ) {
+			unsigned char temp = in[2];
+			in[2] = in[0];
+			in[0] = temp;
+			in += 3;
+		}
+		return;
+	}
+	// iterate 1 pixels at a time, so 3 bytes for RGB or GBR
+	for(i = 0 ; i < nPixels ; i++ ) {
+		out[0] = in[2];
+		out[1] = in[1];
+		out[2] = in[0];
+		in += 3;
+		out += 3;
+	}
+}
+
+/*
+ * YCbCr to RGB conversion (from: http://www.equasys.de/colorconversion.html)
+ *
+ *	r = y + ((357 * cr) >> 8) - 179
+ *	g = y - (( 87 * cb) >> 8) +  44 - ((181 * cr) >> 8) + 91
+ *	b = y + ((450 * cb) >> 8) - 226
+ *
+ * clamped to 0..255.
+ * The chroma terms are shared by both pixels of a YUYV pair.
+ * SIMD versions compute (k*c)>>8 as the high half of (c<<8)*k, which is exact,
+ * and clamp through unsigned saturation.
+ *
+ * All YUYV_to_24 kernels write components in the order c0,c1,c2 where
+ * swap==0 gives b,g,r (the RGB24 memory layout used by easimage) and
+ * swap==1 gives r,g,b (BGR24).
+ */
+
+typedef void (*yuyv24_fn)(const unsigned char *in, unsigned char *out,
+			unsigned int nPixels, int swap);
+
+static inline unsigned char clamp255(int v)
+{
+	return v > 254 ? 255 : (v < 0 ? 0 : v);
+}
+
+static void YUYV_to_24_scalar(const unsigned char *in, unsigned char *out,
+			unsigned int nPixels, int swap)
+{
+	const int ir = swap ? 0 : 2;
+	const int ib = swap ? 2 : 0;
+	unsigned int nBytes = nPixels * 2;
+	// iterate 2 pixels at a time, so 4 bytes for YUV and 6 bytes for RGB
+	uint32_t i;
+	for(i = 0; i < nBytes; i+=4, in+=4, out+=6){
+		int y0 = in[0];
+		int cb = in[1];
+		int y1 = in[2];
+		int cr = in[3];
+		int dr = ((357 * cr) >> 8) - 179;
+		int dg = - (( 87 * cb) >> 8) +  44 - ((181 * cr) >> 8) + 91;
+		int db = ((450 * cb) >> 8) - 226;
+
+		// first RGB
+		out[ir] = clamp255(y0 + dr);
+		out[1]  = clamp255(y0 + dg);
+		out[ib] = clamp255(y0 + db);
+		// second RGB
+		out[ir+3] = clamp255(y1 + dr);
+		out[4]    = clamp255(y1 + dg);
+		out[ib+3] = clamp255(y1 + db);
+	}
+}
+
+#ifdef CONV_X86
+
+// Converts 8 YUYV pixels (one 16 byte vector) into 16 bit r, g, b lanes
+#define YUYV8_TO_RGB16(v, r, g, b) do { \
+	__m128i y_  = _mm_and_si128(v, _mm_set1_epi16(0x00ff)); \
+	__m128i uv_ = _mm_srli_epi16(v, 8); \
+	__m128i cb_ = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv_, _MM_SHUFFLE(2,2,0,0)), _MM_SHUFFLE(2,2,0,0)); \
+	__m128i cr_ = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv_, _MM_SHUFFLE(3,3,1,1)), _MM_SHUFFLE(3,3,1,1)); \
+	cb_ = _mm_slli_epi16(cb_, 8); \
+	cr_ = _mm_slli_epi16(cr_, 8); \
+	r = _mm_add_epi16(y_, _mm_sub_epi16(_mm_mulhi_epu16(cr_, _mm_set1_epi16(357)), _mm_set1_epi16(179))); \
+	g = _mm_sub_epi16(_mm_add_epi16(y_, _mm_set1_epi16(135)), \
+		_mm_add_epi16(_mm_mulhi_epu16(cb_, _mm_set1_epi16(87)), _mm_mulhi_epu16(cr_, _mm_set1_epi16(181)))); \
+	b = _mm_add_epi16(y_, _mm_sub_epi16(_mm_mulhi_epu16(cb_, _mm_set1_epi16(450)), _mm_set1_epi16(226))); \
+} while(0)
+
+// Converts 16 YUYV pixels into 16 byte c0, c1, c2 vectors
+__attribute__((target("sse2")))
+static inline void yuyv16_sse2(const unsigned char *in, __m128i *c0, __m128i *c1, __m128i *c2, int swap)
+{
+	__m128i v0 = _mm_loadu_si128((const __m128i *)in);
+	__m128i v1 = _mm_loadu_si128((const __m128i *)(in + 16));
+	__m128i r0, g0, b0, r1, g1, b1;
+	YUYV8_TO_RGB16(v0, r0, g0, b0);
+	YUYV8_TO_RGB16(v1, r1, g1, b1);
+	__m128i r = _mm_packus_epi16(r0, r1);
+	__m128i b = _mm_packus_epi16(b0, b1);
+	*c1 = _mm_packus_epi16(g0, g1);
+	*c0 = swap ? r : b;
+	*c2 = swap ? b : r;
+}
+
+__attribute__((target("sse2")))
+static void YUYV_to_24_sse2(const unsigned char *in, unsigned char *out,
+			unsigned int nPixels, int swap)
+{
+	unsigned int n = nPixels & ~15u;
+	unsigned int i, k;
+	unsigned char c[3][16] __attribute__((aligned(16)));
+	for ( i = 0 ; i < n ; i += 16, in += 32, out += 48 ) {
+		__m128i c0, c1, c2;
+		yuyv16_sse2(in, &c0, &c1, &c2, swap);
+		// SSE2 has no byte shuffle, interleave through memory
+		_mm_store_si128((__m128i *)c[0], c0);
+		_mm_store_si128((__m128i *)c[1], c1);
+		_mm_store_si128((__m128i *)c[2], c2);
+		for ( k = 0 ; k < 16 ; k++ ) {
+			out[3*k]   = c[0][k];
+			out[3*k+1] = c[1][k];
+			out[3*k+2] = c[2][k];
+		}
+	}
+	YUYV_to_24_scalar(in, out, nPixels - n, swap);
+}
+
+// pshufb masks interleaving three planes of 16 bytes into 48 packed bytes
+#define M_ 0x80
+static const unsigned char ilv3_mask[9][16] __attribute__((aligned(16))) = {
+	{ 0,M_,M_, 1,M_,M_, 2,M_,M_, 3,M_,M_, 4,M_,M_, 5 },	// c0 -> out[0..15]
+	{ M_, 0,M_,M_, 1,M_,M_, 2,M_,M_, 3,M_,M_, 4,M_,M_ },	// c1 -> out[0..15]
+	{ M_,M_, 0,M_,M_, 1,M_,M_, 2,M_,M_, 3,M_,M_, 4,M_ },	// c2 -> out[0..15]
+	{ M_,M_, 6,M_,M_, 7,M_,M_, 8,M_,M_, 9,M_,M_,10,M_ },	// c0 -> out[16..31]
+	{ 5,M_,M_, 6,M_,M_, 7,M_,M_, 8,M_,M_, 9,M_,M_,10 },	// c1 -> out[16..31]
+	{ M_, 5,M_,M_, 6,M_,M_, 7,M_,M_, 8,M_,M_, 9,M_,M_ },	// c2 -> out[16..31]
+	{ M_,11,M_,M_,12,M_,M_,13,M_,M_,14,M_,M_,15,M_,M_ },	// c0 -> out[32..47]
+	{ M_,M_,11,M_,M_,12,M_,M_,13,M_,M_,14,M_,M_,15,M_ },	// c1 -> out[32..47]
+	{ 10,M_,M_,11,M_,M_,12,M_,M_,13,M_,M_,14,M_,M_,15 },	// c2 -> out[32..47]
+};
+#undef M_
+
+__attribute__((target("ssse3")))
+static void YUYV_to_24_ssse3(const unsigned char *in, unsigned char *out,
+			unsigned int nPixels, int swap)
+{
+	const __m128i *m = (const __m128i *)ilv3_mask;
+	unsigned int n = nPixels & ~15u;
+	unsigned int i;
+	for ( i = 0 ; i < n ; i += 16, in += 32, out += 48 ) {
+		__m128i c0, c1, c2;
+		yuyv16_sse2(in, &c0, &c1, &c2, swap);
+		__m128i o0 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(c0, m[0]),
+				_mm_shuffle_epi8(c1, m[1])), _mm_shuffle_epi8(c2, m[2]));
+		__m128i o1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(c0, m[3]),
+				_mm_shuffle_epi8(c1, m[4])), _mm_shuffle_epi8(c2, m[5]));
+		__m128i o2 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(c0, m[6]),
+				_mm_shuffle_epi8(c1, m[7])), _mm_shuffle_epi8(c2, m[8]));
+		_mm_storeu_si128((__m128i *)out, o0);
+		_mm_storeu_si128((__m128i *)(out + 16), o1);
+		_mm_storeu_si128((__m128i *)(out + 32), o2);
+	}
+	YUYV_to_24_scalar(in, out, nPixels - n, swap);
+}
+
+// AVX2 version of YUYV8_TO_RGB16, 16 pixels (8 per 128 bit lane)
+#define YUYV16_TO_RGB16_AVX2(v, r, g, b) do { \
+	__m256i y_  = _mm256_and_si256(v, _mm256_set1_epi16(0x00ff)); \
+	__m256i uv_ = _mm256_srli_epi16(v, 8); \
+	__m256i cb_ = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(uv_, _MM_SHUFFLE(2,2,0,0)), _MM_SHUFFLE(2,2,0,0)); \
+	__m256i cr_ = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(uv_, _MM_SHUFFLE(3,3,1,1)), _MM_SHUFFLE(3,3,1,1)); \
+	cb_ = _mm256_slli_epi16(cb_, 8); \
+	cr_ = _mm256_slli_epi16(cr_, 8); \
+	r = _mm256_add_epi16(y_, _mm256_sub_epi16(_mm256_mulhi_epu16(cr_, _mm256_set1_epi16(357)), _mm256_set1_epi16(179))); \
+	g = _mm256_sub_epi16(_mm256_add_epi16(y_, _mm256_set1_epi16(135)), \
+		_mm256_add_epi16(_mm256_mulhi_epu16(cb_, _mm256_set1_epi16(87)), _mm256_mulhi_epu16(cr_, _mm256_set1_epi16(181)))); \
+	b = _mm256_add_epi16(y_, _mm256_sub_epi16(_mm256_mulhi_epu16(cb_, _mm256_set1_epi16(450)), _mm256_set1_epi16(226))); \
+} while(0)
+
+// Converts 32 YUYV pixels into c0, c1, c2 vectors holding
+// pixels 0..15 in the low lane and pixels 16..31 in the high lane
+__attribute__((target("avx2")))
+static inline void yuyv32_avx2(const unsigned char *in, __m256i *c0, __m256i *c1, __m256i *c2, int swap)
+{
+	__m256i x0 = _mm256_loadu_si256((const __m256i *)in);
+	__m256i x1 = _mm256_loadu_si256((const __m256i *)(in + 32));
+	// arrange lanes so that packus keeps pixels in order within each lane
+	__m256i v0 = _mm256_permute2x128_si256(x0, x1, 0x20);	// pixels 0..7, 16..23
+	__m256i v1 = _mm256_permute2x128_si256(x0, x1, 0x31);	// pixels 8..15, 24..31
+	__m256i r0, g0, b0, r1, g1, b1;
+	YUYV16_TO_RGB16_AVX2(v0, r0, g0, b0);
+	YUYV16_TO_RGB16_AVX2(v1, r1, g1, b1);
+	__m256i r = _mm256_packus_epi16(r0, r1);
+	__m256i b = _mm256_packus_epi16(b0, b1);
+	*c1 = _mm256_packus_epi16(g0, g1);
+	*c0 = swap ? r : b;
+	*c2 = swap ? b : r;
+}
+
+__attribute__((target("avx2")))
+static void YUYV_to_24_avx2(const unsigned char *in, unsigned char *out,
+			unsigned int nPixels, int swap)
+{
+	__m256i m[9];
+	unsigned int i;
+	for ( i = 0 ; i < 9 ; i++ )
+		m[i] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)ilv3_mask[i]));
+	unsigned int n = nPixels & ~31u;
+	for ( i = 0 ; i < n ; i += 32, in += 64, out += 96 ) {
+		__m256i c0, c1, c2;
+		yuyv32_avx2(in, &c0, &c1, &c2, swap);
+		__m256i o0 = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(c0, m[0]),
+				_mm256_shuffle_epi8(c1, m[1])), _mm256_shuffle_epi8(c2, m[2]));
+		__m256i o1 = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(c0, m[3]),
+				_mm256_shuffle_epi8(c1, m[4])), _mm256_shuffle_epi8(c2, m[5]));
+		__m256i o2 = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(c0, m[6]),
+				_mm256_shuffle_epi8(c1, m[7])), _mm256_shuffle_epi8(c2, m[8]));
+		// each lane holds 48 consecutive bytes split over o0, o1, o2
+		_mm256_storeu_si256((__m256i *)out, _mm256_permute2x128_si256(o0, o1, 0x20));
+		_mm256_storeu_si256((__m256i *)(out + 32), _mm256_permute2x128_si256(o2, o0, 0x30));
+		_mm256_storeu_si256((__m256i *)(out + 64), _mm256_permute2x128_si256(o1, o2, 0x31));
+	}
+	YUYV_to_24_ssse3(in, out, nPixels - n, swap);
+}
+
+#endif // CONV_X86
+
+#ifdef CONV_NEON
+
+// Converts 16 luma values sharing chroma terms into saturated bytes
+static inline uint8x16_t neon_add_sat(uint8x16_t y, int16x8_t dlo, int16x8_t dhi)
+{
+	int16x8_t lo = vaddq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(y))), dlo);
+	int16x8_t hi = vaddq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(y))), dhi);
+	return vcombine_u8(vqmovun_s16(lo), vqmovun_s16(hi));
+}
+
+// chroma term (k*c)>>8 - off, for k = 256 + kl when k>255
+static inline int16x8_t neon_term(uint16x8_t c, uint16_t k, int16_t off)
+{
+	uint16x8_t t;
+	if ( k > 255 )
+		t = vaddq_u16(c, vshrq_n_u16(vmulq_n_u16(c, k - 256), 8));
+	else
+		t = vshrq_n_u16(vmulq_n_u16(c, k), 8);
+	return vsubq_s16(vreinterpretq_s16_u16(t), vdupq_n_s16(off));
+}
+
+static void YUYV_to_24_neon(const unsigned char *in, unsigned char *out,
+			unsigned int nPixels, int swap)
+{
+	unsigned int n = nPixels & ~31u;
+	unsigned int i;
+	for ( i = 0 ; i < n ; i += 32, in += 64, out += 96 ) {
+		// val[0]=y0, val[1]=cb, val[2]=y1, val[3]=cr for 16 pixel pairs
+		uint8x16x4_t v = vld4q_u8(in);
+		uint16x8_t cbl = vmovl_u8(vget_low_u8(v.val[1]));
+		uint16x8_t cbh = vmovl_u8(vget_high_u8(v.val[1]));
+		uint16x8_t crl = vmovl_u8(vget_low_u8(v.val[3]));
+		uint16x8_t crh = vmovl_u8(vget_high_u8(v.val[3]));
+		int16x8_t drl = neon_term(crl, 357, 179);
+		int16x8_t drh = neon_term(crh, 357, 179);
+		int16x8_t dbl = neon_term(cbl, 450, 226);
+		int16x8_t dbh = neon_term(cbh, 450, 226);
+		// g = y + 135 - (87*cb)>>8 - (181*cr)>>8
+		int16x8_t dgl = vsubq_s16(vdupq_n_s16(135), vaddq_s16(neon_term(cbl, 87, 0), neon_term(crl, 181, 0)));
+		int16x8_t dgh = vsubq_s16(vdupq_n_s16(135), vaddq_s16(neon_term(cbh, 87, 0), neon_term(crh, 181, 0)));
+
+		uint8x16x2_t r = vzipq_u8(neon_add_sat(v.val[0], drl, drh), neon_add_sat(v.val[2], drl, drh));
+		uint8x16x2_t g = vzipq_u8(neon_add_sat(v.val[0], dgl, dgh), neon_add_sat(v.val[2], dgl, dgh));
+		uint8x16x2_t b = vzipq_u8(neon_add_sat(v.val[0], dbl, dbh), neon_add_sat(v.val[2], dbl, dbh));
+		int k;
+		for ( k = 0 ; k < 2 ; k++ ) {
+			uint8x16x3_t o;
+			o.val[0] = swap ? r.val[k] : b.val[k];
+			o.val[1] = g.val[k];
+			o.val[2] = swap ? b.val[k] : r.val[k];
+			vst3q_u8(out + 48*k, o);
+		}
+	}
+	YUYV_to_24_scalar(in, out, nPixels - n, swap);
+}
+
+#endif // CONV_NEON
+
+/*
+ * Luma only and RGBA32 conversions
+ */
+
+static void YUYV_to_GREY_scalar(const unsigned char *in, unsigned char *out, unsigned int nPixels)
+{
+	unsigned int i;
+	for ( i = 0 ; i < nPixels ; i++ )
+		out[i] = in[2*i];
+}
+
+// RGBA32 is stored as r,g,b,a bytes
+static void YUYV_to_RGBA32_scalar(const unsigned char *in, unsigned char *out, unsigned int nPixels)
+{
+	unsigned int i;
+	for ( i = 0 ; i < nPixels ; i += 2, in += 4, out += 8 ) {
+		int y0 = in[0];
+		int cb = in[1];
+		int y1 = in[2];
+		int cr = in[3];
+		int dr = ((357 * cr) >> 8) - 179;
+		int dg = - (( 87 * cb) >> 8) +  44 - ((181 * cr) >> 8) + 91;
+		int db = ((450 * cb) >> 8) - 226;
+		out[0] = clamp255(y0 + dr);
+		out[1] = clamp255(y0 + dg);
+		out[2] = clamp255(y0 + db);
+		out[3] = 255;
+		out[4] = clamp255(y1 + dr);
+		out[5] = clamp255(y1 + dg);
+		out[6] = clamp255(y1 + db);
+		out[7] = 255;
+	}
+}
+
+#ifdef CONV_X86
+__attribute__((target("sse2")))
+static void YUYV_to_GREY_sse2(const unsigned char *in, unsigned char *out, unsigned int nPixels)
+{
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+	unsigned int n = nPixels & ~15u;
+	unsigned int i;
+	for ( i = 0 ; i < n ; i += 16, in += 32, out += 16 ) {
+		__m128i v0 = _mm_and_si128(_mm_loadu_si128((const __m128i *)in), mask);
+		__m128i v1 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(in + 16)), mask);
+		_mm_storeu_si128((__m128i *)out, _mm_packus_epi16(v0, v1));
+	}
+	YUYV_to_GREY_scalar(in, out, nPixels - n);
+}
+
+__attribute__((target("sse2")))
+static void YUYV_to_RGBA32_sse2(const unsigned char *in, unsigned char *out, unsigned int nPixels)
+{
+	const __m128i alpha = _mm_set1_epi8((char)0xff);
+	unsigned int n = nPixels & ~15u;
+	unsigned int i;
+	for ( i = 0 ; i < n ; i += 16, in += 32, out += 64 ) {
+		__m128i r, g, b;
+		yuyv16_sse2(in, &r, &g, &b, 1);
+		__m128i rg_lo = _mm_unpacklo_epi8(r, g);
+		__m128i rg_hi = _mm_unpackhi_epi8(r, g);
+		__m128i ba_lo = _mm_unpacklo_epi8(b, alpha);
+		__m128i ba_hi = _mm_unpackhi_epi8(b, alpha);
+		_mm_storeu_si128((__m128i *)out,        _mm_unpacklo_epi16(rg_lo, ba_lo));
+		_mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi16(rg_lo, ba_lo));
+		_mm_storeu_si128((__m128i *)(out + 32), _mm_unpacklo_epi16(rg_hi, ba_hi));
+		_mm_storeu_si128((__m128i *)(out + 48), _mm_unpackhi_epi16(rg_hi, ba_hi));
+	}
+	YUYV_to_RGBA32_scalar(in, out, nPixels - n);
+}
+#endif // CONV_X86
+
+#ifdef CONV_NEON
+static void YUYV_to_GREY_neon(const unsigned char *in, unsigned char *out, unsigned int nPixels)
+{
+	unsigned int n = nPixels & ~15u;
+	unsigned int i;
+	for ( i = 0 ; i < n ; i += 16, in += 32, out += 16 )
+		vst1q_u8(out, vld2q_u8(in).val[0]);
+	YUYV_to_GREY_scalar(in, out, nPixels - n);
+}
+#endif // CONV_NEON
+
+/*
+ * Packed pixels to and from component planes.
+ * Plane k holds byte k of every pixel, whatever the format, so the planes
+ * of an RGB24 image are b, g, r and those of BGR24 and RGBA32 are r, g, b(, a).
+ */
+
+static void Deinterleave3_scalar(const unsigned char *in, unsigned char *c0,
+			unsigned char *c1, unsigned char *c2, unsigned int nPixels)
+{
+	unsigned int i;
+	for ( i = 0 ; i < nPixels ; i++, in += 3 ) {
+		c0[i] = in[0];
+		c1[i] = in[1];
+		c2[i] = in[2];
+	}
+}
+
+static void Interleave3_scalar(const unsigned char *c0, const unsigned char *c1,
+			const unsigned char *c2, unsigned char *out, unsigned int nPixels)
+{
+	unsigned int i;
+	for ( i = 0 ; i < nPixels ; i++, out += 3 ) {
+		out[0] = c0[i];
+		out[1] = c1[i];
+		out[2] = c2[i];
+	}
+}
+
+static void Deinterleave4_scalar(const unsigned char *in, unsigned char *c0, unsigned char *c1,
+			unsigned char *c2, unsigned char *c3, unsigned int nPixels)
+{
+	unsigned int i;
+	for ( i = 0 ; i < nPixels ; i++, in += 4 ) {
+		c0[i] = in[0];
+		c1[i] = in[1];
+		c2[i] = in[2];
+		c3[i] = in[3];
+	}
+}
+
+static void Interleave4_scalar(const unsigned char *c0, const unsigned char *c1,
+			const unsigned char *c2, const unsigned char *c3,
+			unsigned char *out, unsigned int nPixels)
+{
+	unsigned int i;
+	for ( i = 0 ; i < nPixels ; i++, out += 4 ) {
+		out[0] = c0[i];
+		out[1] = c1[i];
+		out[2] = c2[i];
+		out[3] = c3[i];
+	}
+}
+
+#ifdef CONV_X86
+
+// pshufb masks gathering three planes of 16 bytes from 48 packed bytes
+#define M_ 0x80
+static const unsigned char dlv3_mask[9][16] __attribute__((aligned(16))) = {
+	{  0, 3, 6, 9,12,15,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_ },	// in[0..15] -> c0
+	{ M_,M_,M_,M_,M_,M_, 2, 5, 8,11,14,M_,M_,M_,M_,M_ },	// in[16..31] -> c0
+	{ M_,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_, 1, 4, 7,10,13 },	// in[32..47] -> c0
+	{  1, 4, 7,10,13,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_ },	// in[0..15] -> c1
+	{ M_,M_,M_,M_,M_, 0, 3, 6, 9,12,15,M_,M_,M_,M_,M_ },	// in[16..31] -> c1
+	{ M_,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_, 2, 5, 8,11,14 },	// in[32..47] -> c1
+	{  2, 5, 8,11,14,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_,M_ },	// in[0..15] -> c2
+	{ M_,M_,M_,M_,M_, 1, 4, 7,10,13,M_,M_,M_,M_,M_,M_ },	// in[16..31] -> c2
+	{ M_,M_,M_,M_,M_,M_,M_,M_,M_,M_, 0, 3, 6, 9,12,15 },	// in[32..47] -> c2
+};
+#undef M_
+
+// groups the bytes of four 4 byte pixels by component
+static const unsigned char dlv4_mask[16] __attribute__((aligned(16))) =
+	{ 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15 };
+
+__attribute__((target("ssse3")))
+static void Deinterleave3_ssse3(const unsigned char *in, unsigned char *c0,
+			unsigned char *c1, unsigned char *c2, unsigned int nPixels)
+{
+	const __m128i *m = (const __m128i *)dlv3_mask;
+	unsigned int n = nPixels & ~15u;
+	unsigned int i;
+	for ( i = 0 ; i < n ; i += 16, in += 48 ) {
+		__m128i a0 = _mm_loadu_si128((const __m128i *)in);
+		__m128i a1 = _mm_loadu_si128((const __m128i *)(in + 16));
+		__m128i a2 = _mm_loadu_si128((const __m128i *)(in + 32));
+		_mm_storeu_si128((__m128i *)(c0 + i), _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(a0, m[0]), _mm_shuffle_epi8(a1, m[1])), _mm_shuffle_epi8(a2, m[2])));
+		_mm_storeu_si128((__m128i *)(c1 + i), _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(a0, m[3]), _mm_shuffle_epi8(a1, m[4])), _mm_shuffle_epi8(a2, m[5])));
+		_mm_storeu_si128((__m128i *)(c2 + i), _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(a0, m[6]), _mm_shuffle_epi8(a1, m[7])), _mm_shuffle_epi8(a2, m[8])));
+	}
+	Deinterleave3_scalar(in, c0 + n, c1 + n, c2 + n, nPixels - n);
+}
+
+__attribute__((target("ssse3")))
+static void Interleave3_ssse3(const unsigned char *c0, const unsigned char *c1,
+			const unsigned char *c2, unsigned char *out, unsigned int nPixels)
+{
+	const __m128i *m = (const __m128i *)ilv3_mask;
+	unsigned int n = nPixels & ~15u;
+	unsigned int i;
+	for ( i = 0 ; i < n ; i += 16, out += 48 ) {
+		__m128i p0 = _mm_loadu_si128((const __m128i *)(c0 + i));
+		__m128i p1 = _mm_loadu_si128((const __m128i *)(c1 + i));
+		__m128i p2 = _mm_loadu_si128((const __m128i *)(c2 + i));
+		_mm_storeu_si128((__m128i *)out, _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(p0, m[0]), _mm_shuffle_epi8(p1, m[1])), _mm_shuffle_epi8(p2, m[2])));
+		_mm_storeu_si128((__m128i *)(out + 16), _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(p0, m[3]), _mm_shuffle_epi8(p1, m[4])), _mm_shuffle_epi8(p2, m[5])));
+		_mm_storeu_si128((__m128i *)(out + 32), _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(p0, m[6]), _mm_shuffle_epi8(p1, m[7])), _mm_shuffle_epi8(p2, m[8])));
+	}
+	Interleave3_scalar(c0 + n, c1 + n, c2 + n, out, nPixels - n);
+}
+
+// same as Interleave3_ssse3(), 32 pixels at a time, see YUYV_to_24_avx2()
+__attribute__((target("avx2")))
+static void Interleave3_avx2(const unsigned char *c0, const unsigned char *c1,
+			const unsigned char *c2, unsigned char *out, unsigned int nPixels)
+{
+	__m256i m[9];
+	unsigned int i;
+	for ( i = 0 ; i < 9 ; i++ )
+		m[i] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)ilv3_mask[i]));
+	unsigned int n = nPixels & ~31u;
+	for ( i = 0 ; i < n ; i += 32, out += 96 ) {
+		__m256i p0 = _mm256_loadu_si256((const __m256i *)(c0 + i));
+		__m256i p1 = _mm256_loadu_si256((const __m256i *)(c1 + i));
+		__m256i p2 = _mm256_loadu_si256((const __m256i *)(c2 + i));
+		__m256i o0 = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(p0, m[0]),
+				_mm256_shuffle_epi8(p1, m[1])), _mm256_shuffle_epi8(p2, m[2]));
+		__m256i o1 = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(p0, m[3]),
+				_mm256_shuffle_epi8(p1, m[4])), _mm256_shuffle_epi8(p2, m[5]));
+		__m256i o2 = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(p0, m[6]),
+				_mm256_shuffle_epi8(p1, m[7])), _mm256_shuffle_epi8(p2, m[8]));
+		_mm256_storeu_si256((__m256i *)out, _mm256_permute2x128_si256(o0, o1, 0x20));
+		_mm256_storeu_si256((__m256i *)(out + 32), _mm256_permute2x128_si256(o2, o0, 0x30));
+		_mm256_storeu_si256((__m256i *)(out + 64), _mm256_permute2x128_si256(o1, o2, 0x31));
+	}
+	Interleave3_ssse3(c0 + n, c1 + n, c2 + n, out, nPixels - n);
+}
+
+__attribute__((target("ssse3")))
+static void Deinterleave4_ssse3(const unsigned char *in, unsigned char *c0, unsigned char *c1,
+			unsigned char *c2, unsigned char *c3, unsigned int nPixels)
+{
+	const __m128i m = _mm_load_si128((const __m128i *)dlv4_mask);
+	unsigned int n = nPixels & ~15u;
+	unsigned int i;
+	for ( i = 0 ; i < n ; i += 16, in += 64 ) {
+		// each vector becomes c0 c0 c0 c0 c1 c1 c1 c1 ..., then a 4x4 transpose of 32 bit groups
+		__m128i v0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)in), m);
+		__m128i v1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + 16)), m);
+		__m128i v2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + 32)), m);
+		__m128i v3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + 48)), m);
+		__m128i t0 = _mm_unpacklo_epi32(v0, v1);
+		__m128i t1 = _mm_unpacklo_epi32(v2, v3);
+		__m128i t2 = _mm_unpackhi_epi32(v0, v1);
+		__m128i t3 = _mm_unpackhi_epi32(v2, v3);
+		_mm_storeu_si128((__m128i *)(c0 + i), _mm_unpacklo_epi64(t0, t1));
+		_mm_storeu_si128((__m128i *)(c1 + i), _mm_unpackhi_epi64(t0, t1));
+		_mm_storeu_si128((__m128i *)(c2 + i), _mm_unpacklo_epi64(t2, t3));
+		_mm_storeu_si128((__m128i *)(c3 + i), _mm_unpackhi_epi64(t2, t3));
+	}
+	Deinterleave4_scalar(in, c0 + n, c1 + n, c2 + n, c3 + n, nPixels - n);
+}
+
+__attribute__((target("sse2")))
+static void Interleave4_sse2(const unsigned char *c0, const unsigned char *c1,
+			const unsigned char *c2, const unsigned char *c3,
+			unsigned char *out, unsigned int nPixels)
+{
+	unsigned int n = nPixels & ~15u;
+	unsigned int i;
+	for ( i = 0 ; i < n ; i += 16, out += 64 ) {
+		__m128i p0 = _mm_loadu_si128((const __m128i *)(c0 + i));
+		__m128i p1 = _mm_loadu_si128((const __m128i *)(c1 + i));
+		__m128i p2 = _mm_loadu_si128((const __m128i *)(c2 + i));
+		__m128i p3 = _mm_loadu_si128((const __m128i *)(c3 + i));
+		__m128i lo01 = _mm_unpacklo_epi8(p0, p1);
+		__m128i hi01 = _mm_unpackhi_epi8(p0, p1);
+		__m128i lo23 = _mm_unpacklo_epi8(p2, p3);
+		__m128i hi23 = _mm_unpackhi_epi8(p2, p3);
+		_mm_storeu_si128((__m128i *)out,        _mm_unpacklo_epi16(lo01, lo23));
+		_mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi16(lo01, lo23));
+		_mm_storeu_si128((__m128i *)(out + 32), _mm_unpacklo_epi16(hi01, hi23));
+		_mm_storeu_si128((__m128i *)(out + 48), _mm_unpackhi_epi16(hi01, hi23));
+	}
+	Interleave4_scalar(c0 + n, c1 + n, c2 + n, c3 + n, out, nPixels - n);
+}
+
+#endif // CONV_X86
+
+#ifdef CONV_NEON
+
+static void Deinterleave3_neon(const unsigned char *in, unsigned char *c0,
+			unsigned char *c1, unsigned char *c2, unsigned int nPixels)
+{
+	unsigned int n = nPixels & ~15u;
+	unsigned int i;
+	for ( i = 0 ; i < n ; i += 16, in += 48 ) {
+		uint8x16x3_t v = vld3q_u8(in);
+		vst1q_u8(c0 + i, v.val[0]);
+		vst1q_u8(c1 + i, v.val[1]);
+		vst1q_u8(c2 + i, v.val[2]);
+	}
+	Deinterleave3_scalar(in, c0 + n, c1 + n, c2 + n, nPixels - n);
+}
+
+static void Interleave3_neon(const unsigned char *c0, const unsigned char *c1,
+			const unsigned char *c2, unsigned char *out, unsigned int nPixels)
+{
+	unsigned int n = nPixels & ~15u;
+	unsigned int i;
+	for ( i = 0 ; i < n ; i += 16, out += 48 ) {
+		uint8x16x3_t v;
+		v.val[0] = vld1q_u8(c0 + i);
+		v.val[1] = vld1q_u8(c1 + i);
+		v.val[2] = vld1q_u8(c2 + i);
+		vst3q_u8(out, v);
+	}
+	Interleave3_scalar(c0 + n, c1 + n, c2 + n, out, nPixels - n);
+}
+
+static void Deinterleave4_neon(const unsigned char *in, unsigned char *c0, unsigned char *c1,
+			unsigned char *c2, unsigned char *c3, unsigned int nPixels)
+{
+	unsigned int n = nPixels & ~15u;
+	unsigned int i;
+	for ( i = 0 ; i < n ; i += 16, in += 64 ) {
+		uint8x16x4_t v = vld4q_u8(in);
+		vst1q_u8(c0 + i, v.val[0]);
+		vst1q_u8(c1 + i, v.val[1]);
+		vst1q_u8(c2 + i, v.val[2]);
+		vst1q_u8(c3 + i, v.val[3]);
+	}
+	Deinterleave4_scalar(in, c0 + n, c1 + n, c2 + n, c3 + n, nPixels - n);
+}
+
+static void Interleave4_neon(const unsigned char *c0, const unsigned char *c1,
+			const unsigned char *c2, const unsigned char *c3,
+			unsigned char *out, unsigned int nPixels)
+{
+	unsigned int n = nPixels & ~15u;
+	unsigned int i;
+	for ( i = 0 ; i < n ; i += 16, out += 64 ) {
+		uint8x16x4_t v;
+		v.val[0] = vld1q_u8(c0 + i);
+		v.val[1] = vld1q_u8(c1 + i);
+		v.val[2] = vld1q_u8(c2 + i);
+		v.val[3] = vld1q_u8(c3 + i);
+		vst4q_u8(out, v);
+	}
+	Interleave4_scalar(c0 + n, c1 + n, c2 + n, c3 + n, out, nPixels - n);
+}
+
+#endif // CONV_NEON
+
+/*
+ * Sample size conversions.
+ * 8 bit values v become v*257 as 16 bit values and v/255 as floats,
+ * 16 bit values v become v>>8 and v/65535. Floats are clamped to 0..1
+ * and rounded to the nearest integer, ties to even, as the SIMD conversions do.
+ */
+
+static void U8_to_U16_scalar(const unsigned char *in, uint16_t *out, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i < n ; i++ )
+		out[i] = in[i] * 257;
+}
+
+static void U16_to_U8_scalar(const uint16_t *in, unsigned char *out, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i < n ; i++ )
+		out[i] = in[i] >> 8;
+}
+
+static void U8_to_F32_scalar(const unsigned char *in, float *out, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i < n ; i++ )
+		out[i] = in[i] * (1.f/255.f);
+}
+
+static void U16_to_F32_scalar(const uint16_t *in, float *out, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i < n ; i++ )
+		out[i] = in[i] * (1.f/65535.f);
+}
+
+// NaN gives 0, as the SIMD max
+static inline float clampf(float v, float top)
+{
+	v = v > 0.f ? v : 0.f;
+	return v < top ? v : top;
+}
+
+static void F32_to_U8_scalar(const float *in, unsigned char *out, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i < n ; i++ )
+		out[i] = lrintf(clampf(in[i] * 255.f, 255.f));
+}
+
+static void F32_to_U16_scalar(const float *in, uint16_t *out, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i < n ; i++ )
+		out[i] = lrintf(clampf(in[i] * 65535.f, 65535.f));
+}
+
+#ifdef CONV_X86
+
+__attribute__((target("sse2")))
+static void U8_to_U16_sse2(const unsigned char *in, uint16_t *out, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i + 16 <= n ; i += 16 ) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		// v | v<<8 is v*257
+		_mm_storeu_si128((__m128i *)(out + i),     _mm_unpacklo_epi8(v, v));
+		_mm_storeu_si128((__m128i *)(out + i + 8), _mm_unpackhi_epi8(v, v));
+	}
+	U8_to_U16_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void U16_to_U8_sse2(const uint16_t *in, unsigned char *out, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i + 16 <= n ; i += 16 ) {
+		__m128i lo = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(in + i)), 8);
+		__m128i hi = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(in + i + 8)), 8);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+	}
+	U16_to_U8_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void U8_to_F32_sse2(const unsigned char *in, float *out, unsigned int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 k = _mm_set1_ps(1.f/255.f);
+	unsigned int i;
+	for ( i = 0 ; i + 16 <= n ; i += 16 ) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		_mm_storeu_ps(out + i,      _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), k));
+		_mm_storeu_ps(out + i + 4,  _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), k));
+		_mm_storeu_ps(out + i + 8,  _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), k));
+		_mm_storeu_ps(out + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), k));
+	}
+	U8_to_F32_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void U16_to_F32_sse2(const uint16_t *in, float *out, unsigned int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 k = _mm_set1_ps(1.f/65535.f);
+	unsigned int i;
+	for ( i = 0 ; i + 8 <= n ; i += 8 ) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		_mm_storeu_ps(out + i,     _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)), k));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)), k));
+	}
+	U16_to_F32_scalar(in + i, out + i, n - i);
+}
+
+// scales 4 floats and rounds them to integers in 0..top
+__attribute__((target("sse2")))
+static inline __m128i f32_round_sse2(const float *in, __m128 scale, __m128 top)
+{
+	__m128 v = _mm_mul_ps(_mm_loadu_ps(in), scale);
+	v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), top);
+	return _mm_cvtps_epi32(v);
+}
+
+__attribute__((target("sse2")))
+static void F32_to_U8_sse2(const float *in, unsigned char *out, unsigned int n)
+{
+	const __m128 scale = _mm_set1_ps(255.f);
+	unsigned int i;
+	for ( i = 0 ; i + 16 <= n ; i += 16 ) {
+		__m128i lo = _mm_packs_epi32(f32_round_sse2(in + i, scale, scale),
+					f32_round_sse2(in + i + 4, scale, scale));
+		__m128i hi = _mm_packs_epi32(f32_round_sse2(in + i + 8, scale, scale),
+					f32_round_sse2(in + i + 12, scale, scale));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+	}
+	F32_to_U8_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void F32_to_U16_sse2(const float *in, uint16_t *out, unsigned int n)
+{
+	const __m128 scale = _mm_set1_ps(65535.f);
+	const __m128i bias = _mm_set1_epi32(32768);
+	unsigned int i;
+	for ( i = 0 ; i + 8 <= n ; i += 8 ) {
+		// SSE2 only packs signed values, pack around zero and flip the sign bit back
+		__m128i lo = _mm_sub_epi32(f32_round_sse2(in + i, scale, scale), bias);
+		__m128i hi = _mm_sub_epi32(f32_round_sse2(in + i + 4, scale, scale), bias);
+		_mm_storeu_si128((__m128i *)(out + i),
+			_mm_xor_si128(_mm_packs_epi32(lo, hi), _mm_set1_epi16((short)0x8000)));
+	}
+	F32_to_U16_scalar(in + i, out + i, n - i);
+}
+
+#endif // CONV_X86
+
+#ifdef CONV_NEON
+
+static void U8_to_U16_neon(const unsigned char *in, uint16_t *out, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i + 16 <= n ; i += 16 ) {
+		uint8x16_t v = vld1q_u8(in + i);
+		uint8x16x2_t z = vzipq_u8(v, v);
+		vst1q_u16(out + i,     vreinterpretq_u16_u8(z.val[0]));
+		vst1q_u16(out + i + 8, vreinterpretq_u16_u8(z.val[1]));
+	}
+	U8_to_U16_scalar(in + i, out + i, n - i);
+}
+
+static void U16_to_U8_neon(const uint16_t *in, unsigned char *out, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i + 8 <= n ; i += 8 )
+		vst1_u8(out + i, vshrn_n_u16(vld1q_u16(in + i), 8));
+	U16_to_U8_scalar(in + i, out + i, n - i);
+}
+
+static void U8_to_F32_neon(const unsigned char *in, float *out, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i + 8 <= n ; i += 8 ) {
+		uint16x8_t v = vmovl_u8(vld1_u8(in + i));
+		vst1q_f32(out + i,     vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))), 1.f/255.f));
+		vst1q_f32(out + i + 4, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(v))), 1.f/255.f));
+	}
+	U8_to_F32_scalar(in + i, out + i, n - i);
+}
+
+static void U16_to_F32_neon(const uint16_t *in, float *out, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i + 8 <= n ; i += 8 ) {
+		uint16x8_t v = vld1q_u16(in + i);
+		vst1q_f32(out + i,     vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))), 1.f/65535.f));
+		vst1q_f32(out + i + 4, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(v))), 1.f/65535.f));
+	}
+	U16_to_F32_scalar(in + i, out + i, n - i);
+}
+
+#ifdef __aarch64__
+// scales 4 floats and rounds them to integers in 0..top, NaN giving 0
+static inline uint32x4_t f32_round_neon(const float *in, float scale, float top)
+{
+	float32x4_t v = vmaxnmq_f32(vmulq_n_f32(vld1q_f32(in), scale), vdupq_n_f32(0.f));
+	return vcvtnq_u32_f32(vminq_f32(v, vdupq_n_f32(top)));
+}
+
+static void F32_to_U8_neon(const float *in, unsigned char *out, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i + 8 <= n ; i += 8 ) {
+		uint16x8_t v = vcombine_u16(vmovn_u32(f32_round_neon(in + i, 255.f, 255.f)),
+					    vmovn_u32(f32_round_neon(in + i + 4, 255.f, 255.f)));
+		vst1_u8(out + i, vmovn_u16(v));
+	}
+	F32_to_U8_scalar(in + i, out + i, n - i);
+}
+
+static void F32_to_U16_neon(const float *in, uint16_t *out, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i + 8 <= n ; i += 8 ) {
+		vst1_u16(out + i,     vmovn_u32(f32_round_neon(in + i, 65535.f, 65535.f)));
+		vst1_u16(out + i + 4, vmovn_u32(f32_round_neon(in + i + 4, 65535.f, 65535.f)));
+	}
+	F32_to_U16_scalar(in + i, out + i, n - i);
+}
+#endif // __aarch64__
+
+#endif // CONV_NEON
+
+/*
+ * Half resolution conversions.
+ * Each output pixel is built from one YUYV pair on two consecutive rows:
+ * the four luma values and the two chroma samples of each kind are averaged
+ * before the colour conversion.
+ */
+
+static void YUYV_half_row_24(const unsigned char *r0, const unsigned char *r1,
+			unsigned char *out, unsigned int outWidth, int swap)
+{
+	const int ir = swap ? 0 : 2;
+	const int ib = swap ? 2 : 0;
+	unsigned int i;
+	for ( i = 0 ; i < outWidth ; i++, r0 += 4, r1 += 4, out += 3 ) {
+		int y  = (r0[0] + r0[2] + r1[0] + r1[2] + 2) >> 2;
+		int cb = (r0[1] + r1[1] + 1) >> 1;
+		int cr = (r0[3] + r1[3] + 1) >> 1;
+		out[ir] = clamp255(y + ((357 * cr) >> 8) - 179);
+		out[1]  = clamp255(y - (( 87 * cb) >> 8) +  44 - ((181 * cr) >> 8) + 91);
+		out[ib] = clamp255(y + ((450 * cb) >> 8) - 226);
+	}
+}
+
+static void YUYV_half_row_GREY(const unsigned char *r0, const unsigned char *r1,
+			unsigned char *out, unsigned int outWidth)
+{
+	unsigned int i;
+	for ( i = 0 ; i < outWidth ; i++, r0 += 4, r1 += 4 )
+		out[i] = (r0[0] + r0[2] + r1[0] + r1[2] + 2) >> 2;
+}
+
+static yuyv24_fn yuyv24_impl = NULL;
+
+// selects the fastest YUYV conversion supported by the running CPU
+static yuyv24_fn yuyv24_select(void)
+{
+	yuyv24_fn fn = YUYV_to_24_scalar;
+#if defined(CONV_X86)
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("avx2") )		fn = YUYV_to_24_avx2;
+	else if ( __builtin_cpu_supports("ssse3") )	fn = YUYV_to_24_ssse3;
+	else if ( __builtin_cpu_supports("sse2") )	fn = YUYV_to_24_sse2;
+#elif defined(CONV_NEON)
+	fn = YUYV_to_24_neon;
+#endif
+	// concurrent first calls all store the same value
+	__atomic_store_n(&yuyv24_impl, fn, __ATOMIC_RELAXED);
+	return fn;
+}
+
+static inline yuyv24_fn yuyv24_get(void)
+{
+	yuyv24_fn fn = __atomic_load_n(&yuyv24_impl, __ATOMIC_RELAXED);
+	return fn ? fn : yuyv24_select();
+}
+
+//! Converts YUYV pixels to RGB24
+/*!
+ *  @param buffer_ptr source YUYV data
+ *  @param img_ptr destination RGB24 data
+ *  @param nPixels number of pixels to convert. Must be even.
+ */
+void YUYV_to_RGB24(unsigned char *buffer_ptr, unsigned char *img_ptr, unsigned int nPixels) {
+	yuyv24_get()(buffer_ptr, img_ptr, nPixels, 0);
+}
+
+//! Converts YUYV pixels to BGR24
+/*!
+ *  @param in source YUYV data
+ *  @param out destination BGR24 data
+ *  @param size number of pixels to convert. Must be even.
+ */
+void YUYV_to_BGR24(unsigned char *in, unsigned char *out,
+			unsigned int size) {
+	yuyv24_get()(in, out, size, 1);
+}
+
+//! Extracts the luma of YUYV pixels
+/*!
+ *  Produces a GREY image using only the Y bytes, without any colour computation.
+ *  @param in source YUYV data
+ *  @param out destination GREY data
+ *  @param nPixels number of pixels to convert
+ */
+void YUYV_to_GREY(unsigned char *in, unsigned char *out, unsigned int nPixels)
+{
+#if defined(CONV_X86)
+	if ( __builtin_cpu_supports("sse2") ) {
+		YUYV_to_GREY_sse2(in, out, nPixels);
+		return;
+	}
+#elif defined(CONV_NEON)
+	YUYV_to_GREY_neon(in, out, nPixels);
+	return;
+#endif
+	YUYV_to_GREY_scalar(in, out, nPixels);
+}
+
+//! Converts YUYV pixels to RGBA32
+/*!
+ *  Alpha is set to 255.
+ *  @param in source YUYV data
+ *  @param out destination RGBA32 data
+ *  @param nPixels number of pixels to convert. Must be even.
+ */
+void YUYV_to_RGBA32(unsigned char *in, unsigned char *out, unsigned int nPixels)
+{
+#if defined(CONV_X86)
+	if ( __builtin_cpu_supports("sse2") ) {
+		YUYV_to_RGBA32_sse2(in, out, nPixels);
+		return;
+	}
+#endif
+	YUYV_to_RGBA32_scalar(in, out, nPixels);
+}
+
+//! Splits 3 byte pixels into component planes
+/*!
+ *  Plane k receives byte k of every pixel, so RGB24 pixels give b, g, r planes
+ *  and BGR24 pixels give r, g, b planes.
+ *  @param in source pixels
+ *  @param c0 destination of the first bytes
+ *  @param c1 destination of the second bytes
+ *  @param c2 destination of the third bytes
+ *  @param nPixels number of pixels to convert
+ */
+void Deinterleave3(const unsigned char *in, unsigned char *c0, unsigned char *c1,
+			unsigned char *c2, unsigned int nPixels)
+{
+#if defined(CONV_X86)
+	if ( __builtin_cpu_supports("ssse3") ) {
+		Deinterleave3_ssse3(in, c0, c1, c2, nPixels);
+		return;
+	}
+#elif defined(CONV_NEON)
+	Deinterleave3_neon(in, c0, c1, c2, nPixels);
+	return;
+#endif
+	Deinterleave3_scalar(in, c0, c1, c2, nPixels);
+}
+
+//! Merges component planes into 3 byte pixels
+/*!
+ *  Inverse of Deinterleave3().
+ */
+void Interleave3(const unsigned char *c0, const unsigned char *c1, const unsigned char *c2,
+			unsigned char *out, unsigned int nPixels)
+{
+#if defined(CONV_X86)
+	if ( __builtin_cpu_supports("avx2") ) {
+		Interleave3_avx2(c0, c1, c2, out, nPixels);
+		return;
+	}
+	if ( __builtin_cpu_supports("ssse3") ) {
+		Interleave3_ssse3(c0, c1, c2, out, nPixels);
+		return;
+	}
+#elif defined(CONV_NEON)
+	Interleave3_neon(c0, c1, c2, out, nPixels);
+	return;
+#endif
+	Interleave3_scalar(c0, c1, c2, out, nPixels);
+}
+
+//! Splits 4 byte pixels into component planes
+/*!
+ *  Same as Deinterleave3(), RGBA32 pixels give r, g, b, a planes.
+ */
+void Deinterleave4(const unsigned char *in, unsigned char *c0, unsigned char *c1,
+			unsigned char *c2, unsigned char *c3, unsigned int nPixels)
+{
+#if defined(CONV_X86)
+	if ( __builtin_cpu_supports("ssse3") ) {
+		Deinterleave4_ssse3(in, c0, c1, c2, c3, nPixels);
+		return;
+	}
+#elif defined(CONV_NEON)
+	Deinterleave4_neon(in, c0, c1, c2, c3, nPixels);
+	return;
+#endif
+	Deinterleave4_scalar(in, c0, c1, c2, c3, nPixels);
+}
+
+//! Merges component planes into 4 byte pixels
+/*!
+ *  Inverse of Deinterleave4().
+ */
+void Interleave4(const unsigned char *c0, const unsigned char *c1, const unsigned char *c2,
+			const unsigned char *c3, unsigned char *out, unsigned int nPixels)
+{
+#if defined(CONV_X86)
+	if ( __builtin_cpu_supports("sse2") ) {
+		Interleave4_sse2(c0, c1, c2, c3, out, nPixels);
+		return;
+	}
+#elif defined(CONV_NEON)
+	Interleave4_neon(c0, c1, c2, c3, out, nPixels);
+	return;
+#endif
+	Interleave4_scalar(c0, c1, c2, c3, out, nPixels);
+}
+
+//! Widens 8 bit samples to 16 bits
+/*!
+ *  Value v becomes v*257, so 255 maps to 65535.
+ *  @param in source samples
+ *  @param out destination samples
+ *  @param nSamples number of samples, the number of pixels times the number of components
+ */
+void U8_to_U16(const unsigned char *in, uint16_t *out, unsigned int nSamples)
+{
+#if defined(CONV_X86)
+	if ( __builtin_cpu_supports("sse2") ) {
+		U8_to_U16_sse2(in, out, nSamples);
+		return;
+	}
+#elif defined(CONV_NEON)
+	U8_to_U16_neon(in, out, nSamples);
+	return;
+#endif
+	U8_to_U16_scalar(in, out, nSamples);
+}
+
+//! Reduces 16 bit samples to their most significant byte
+void U16_to_U8(const uint16_t *in, unsigned char *out, unsigned int nSamples)
+{
+#if defined(CONV_X86)
+	if ( __builtin_cpu_supports("sse2") ) {
+		U16_to_U8_sse2(in, out, nSamples);
+		return;
+	}
+#elif defined(CONV_NEON)
+	U16_to_U8_neon(in, out, nSamples);
+	return;
+#endif
+	U16_to_U8_scalar(in, out, nSamples);
+}
+
+//! Converts 8 bit samples to floats in the range 0 to 1
+void U8_to_F32(const unsigned char *in, float *out, unsigned int nSamples)
+{
+#if defined(CONV_X86)
+	if ( __builtin_cpu_supports("sse2") ) {
+		U8_to_F32_sse2(in, out, nSamples);
+		return;
+	}
+#elif defined(CONV_NEON)
+	U8_to_F32_neon(in, out, nSamples);
+	return;
+#endif
+	U8_to_F32_scalar(in, out, nSamples);
+}
+
+//! Converts 16 bit samples to floats in the range 0 to 1
+void U16_to_F32(const uint16_t *in, float *out, unsigned int nSamples)
+{
+#if defined(CONV_X86)
+	if ( __builtin_cpu_supports("sse2") ) {
+		U16_to_F32_sse2(in, out, nSamples);
+		return;
+	}
+#elif defined(CONV_NEON)
+	U16_to_F32_neon(in, out, nSamples);
+	return;
+#endif
+	U16_to_F32_scalar(in, out, nSamples);
+}
+
+//! Converts floats to 8 bit samples
+/*!
+ *  Values are scaled by 255, clamped to 0..255 and rounded to the nearest integer.
+ */
+void F32_to_U8(const float *in, unsigned char *out, unsigned int nSamples)
+{
+#if defined(CONV_X86)
+	if ( __builtin_cpu_supports("sse2") ) {
+		F32_to_U8_sse2(in, out, nSamples);
+		return;
+	}
+#elif defined(CONV_NEON) && defined(__aarch64__)
+	F32_to_U8_neon(in, out, nSamples);
+	return;
+#endif
+	F32_to_U8_scalar(in, out, nSamples);
+}
+
+//! Converts floats to 16 bit samples
+/*!
+ *  Values are scaled by 65535, clamped to 0..65535 and rounded to the nearest integer.
+ */
+void F32_to_U16(const float *in, uint16_t *out, unsigned int nSamples)
+{
+#if defined(CONV_X86)
+	if ( __builtin_cpu_supports("sse2") ) {
+		F32_to_U16_sse2(in, out, nSamples);
+		return;
+	}
+#elif defined(CONV_NEON) && defined(__aarch64__)
+	F32_to_U16_neon(in, out, nSamples);
+	return;
+#endif
+	F32_to_U16_scalar(in, out, nSamples);
+}
+
+//! Converts a YUYV frame to a half resolution RGB24 image
+/*!
+ *  Every 2x2 block of source pixels is averaged into one output pixel.
+ *  @param in source YUYV frame
+ *  @param out destination RGB24 image, (width/2)x(height/2) pixels
+ *  @param width number of columns of the source frame. Must be even.
+ *  @param height number of rows of the source frame
+ */
+void YUYV_to_RGB24_half(unsigned char *in, unsigned char *out,
+			unsigned int width, unsigned int height)
+{
+	unsigned int y;
+	for ( y = 0 ; y + 1 < height ; y += 2, in += 4*width, out += 3*(width/2) )
+		YUYV_half_row_24(in, in + 2*width, out, width/2, 0);
+}
+
+//! Converts a YUYV frame to a half resolution BGR24 image
+/*!
+ *  Same as YUYV_to_RGB24_half(), producing BGR24 data.
+ */
+void YUYV_to_BGR24_half(unsigned char *in, unsigned char *out,
+			unsigned int width, unsigned int height)
+{
+	unsigned int y;
+	for ( y = 0 ; y + 1 < height ; y += 2, in += 4*width, out += 3*(width/2) )
+		YUYV_half_row_24(in, in + 2*width, out, width/2, 1);
+}
+
+//! Converts a YUYV frame to a half resolution GREY image
+/*!
+ *  Every 2x2 block of luma values is averaged into one output pixel.
+ *  @param in source YUYV frame
+ *  @param out destination GREY image, (width/2)x(height/2) pixels
+ *  @param width number of columns of the source frame. Must be even.
+ *  @param height number of rows of the source frame
+ */
+void YUYV_to_GREY_half(unsigned char *in, unsigned char *out,
+			unsigned int width, unsigned int height)
+{
+	unsigned int y;
+	for ( y = 0 ; y + 1 < height ; y += 2, in += 4*width, out += width/2 )
+		YUYV_half_row_GREY(in, in + 2*width, out, width/2);
+}
+
+/**
+ *  @}
+ */
@@ -10,6 +10,7 @@
 #ifndef _EASIMAGE_H_
 #define _EASIMAGE_H_
 
+#include <stdint.h>
 #include <linux/videodev2.h>
 #include <SDL/SDL.h>
 
@@ -26,8 +27,14 @@
 #define YUYV 	V4L2_PIX_FMT_YUYV
 #define RGB32 	V4L2_PIX_FMT_RGB32
 #define RGBA32  V4L2_PIX_FMT_RGB32
-#define RGB48	V4L2_PIX_FMT_RGB48
+#ifndef V4L2_PIX_FMT_RGB48
+#define V4L2_PIX_FMT_RGB48	v4l2_fourcc('R', 'G', 'B', '6')
+#endif
+#define RGB48	V4L2_PIX_FMT_RGB48	///< 16 bit samples, in the RGB24 order
 #define GREY	V4L2_PIX_FMT_GREY
+#define GREY16	V4L2_PIX_FMT_Y16	///< 16 bit samples
+#define GREY32F	v4l2_fourcc('Y', 'F', '3', '2')	///< float samples, 0 to 1 for black to white
+#define RGB96F	v4l2_fourcc('R', 'F', '3', '2')	///< float samples, in the RGB24 order
 #define MJPEG   V4L2_PIX_FMT_MJPEG
 /** @}*/
 
@@ -41,29 +48,145 @@ extern int easimageAppEnd;
 //! Memory block to store image data
 //forward declarations of internal types
 struct Buffer;
+struct ImgBlock;
+struct CamThread;
+struct VirtualCam;
 
-//! Represents an image capturing device
+//! Pool of persistent worker threads
+typedef struct WorkPool WorkPool;
+
+//! Set of cameras captured together, see camGroupNew()
+typedef struct CameraGroup CameraGroup;
+
+//! Streaming frame recorder, see recOpen()
+typedef struct Recorder Recorder;
+
+//! Recycled image storage, see imgPoolNew()
+typedef struct ImagePool ImagePool;
+
+//! JPEG decoder state, see jpegNew()
+typedef struct JpegDecoder JpegDecoder;
+
+//! Kernel spectrum for FFT filtering, see fftKernelNew()
+typedef struct FFTKernel FFTKernel;
+
+//! Capture counters of a camera, see camGetStats()
 typedef struct {
-	unsigned int width;	 	///< The width of the camera frame (Number of columns)
-	unsigned int height;	 	///< The height of the camera frame  (Number of rows)
-	unsigned int format;		///< Format identifier
-	char *name;	 	 	///< The name of the device
-	int handle;		 	///< The stream handle
-	struct Buffer *buffers;  	///< location of image buffers
-	unsigned int n_buffers;	 	///< Number of allocated buffers
-} Camera;
+	unsigned long frames;		///< Number of frames dequeued from the driver
+	unsigned long dropped;		///< Number of frames lost by the driver (gaps in the sequence numbers)
+	long long wait_us;		///< Time spent waiting for frames, in microseconds
+	long long convert_us;		///< Time spent converting frames, in microseconds
+	unsigned long skipped;		///< Number of frames skipped to deliver newer ones (low latency mode)
+	unsigned int last_sequence;	///< Sequence number of the last dequeued frame
+} CamStats;
 
 //! Stores an image
-typedef struct {
+typedef struct Image {
 	unsigned int width;		///< The width of the image (Number of columns)
 	unsigned int height;		///< The height of the image (Number of rows)
 	unsigned short int depth;	///< The depth of the image (number of bit per pixel)
 	unsigned int format;		///< Format identifier
 	unsigned char *mem_ptr;		///< location of image buffers
 	unsigned char *data;		///< location of pixel data
+	unsigned int stride;		///< Number of bytes from one row to the next
+	unsigned int flags;		///< Allocation flags, see imgNewEx()
+	ImagePool *pool;		///< Pool the image returns to on imgDestroy(), or NULL
+	struct ImgBlock *block;		///< Pixel memory shared with views and imgRetain() handles, or NULL
 	char *name;	 	 	///< The name of the image
+	long long timestamp;		///< Capture time, in microseconds, as reported by the driver
+	unsigned int sequence;		///< Capture sequence number, as reported by the driver
 } Image;
 
+//! Maximum number of planes of a PlanarImage
+#define IMG_MAX_PLANES		4
+
+//! Stores an image as separate component planes, see imgToPlanar()
+typedef struct {
+	unsigned int width;		///< The width of the image (Number of columns)
+	unsigned int height;		///< The height of the image (Number of rows)
+	unsigned int format;		///< Format of the packed pixels, kept for imgFromPlanar()
+	unsigned int n_planes;		///< Number of planes, the packed pixel size in bytes
+	Image *plane[IMG_MAX_PLANES];	///< 8 bit Images, plane k holding byte k of every pixel
+} PlanarImage;
+
+//! Summed area tables of an Image, see imgIntegral()
+typedef struct {
+	unsigned int width;		///< The width of the image (Number of columns)
+	unsigned int height;		///< The height of the image (Number of rows)
+	unsigned int n_comp;		///< Number of components of each pixel
+	unsigned int stride;		///< Number of entries in a table row, (width+1)*n_comp
+	uint64_t *sum;			///< (height+1) rows; entry x,y,c sums component c of the pixels left of x and above y
+	uint64_t *sqsum;		///< Same for the squared samples, or NULL
+} IntegralImage;
+
+//! Alignment of pixel data and row strides of allocated Images, in bytes
+#define IMG_ALIGN		64
+
+/** imgNewEx() flags */
+#define IMG_PACKED		0x01	///< Rows are not padded, stride is width*depth/8
+#define IMG_HUGE_PAGES		0x02	///< Back large images with huge pages
+#define IMG_VIEW		0x04	///< Set on images made by imgView(), writes reach the parent
+
+//! Largest sum of absolute weights of an imgConvolutionInt() kernel, so 8 bit sums fit in an int
+#define IMG_CONV_INT_MAX_WEIGHT	8421504
+
+//! Default number of capture buffers requested by camOpen()
+#define CAM_DEFAULT_BUFFERS	4
+//! Default number of capture buffers in low latency mode, see CamParams::low_latency
+#define CAM_LOW_LATENCY_BUFFERS	2
+//! Default number of frames kept by the background capture thread
+#define CAM_DEFAULT_SLOTS	4
+
+//! Default frame rate of virtual cameras
+#define CAM_DEFAULT_FPS		30
+//! Frame rate asking virtual cameras to deliver frames as fast as possible
+#define CAM_FPS_MAX		0xFFFFFFFFu
+//! Device name prefix of synthetic virtual cameras, as in "virtual:bars"
+#define CAM_VIRTUAL_PREFIX	"virtual:"
+
+/** camGetFrame() modes */
+#define CAM_FRAME_LATEST	0	///< Get the newest frame, dropping stale ones
+#define CAM_FRAME_NEXT		1	///< Get every frame, in order
+
+//! Optional camera opening parameters, used by camOpenEx()
+/*!
+ *  Fields left at zero select the library defaults.
+ */
+typedef struct {
+	unsigned int n_buffers;		///< Number of capture buffers to request from the driver
+	unsigned int memory;		///< V4L2_MEMORY_MMAP (default) or V4L2_MEMORY_USERPTR
+	Image **images;			///< V4L2_MEMORY_USERPTR only: n_buffers Images, created by imgNewEx() with IMG_PACKED,
+					///< used as capture buffers. NULL lets the library allocate them.
+	unsigned int n_threads;		///< Number of threads converting each frame, see camSetThreads()
+	unsigned int fps;		///< Frame rate, or CAM_FPS_MAX for the highest one (no pacing on virtual cameras).
+					///< Zero keeps the driver rate, or selects the file rate or CAM_DEFAULT_FPS.
+	unsigned int field;		///< V4L2 field order. Zero (V4L2_FIELD_ANY) lets the driver choose.
+	int low_latency;		///< Shallow queue, highest frame rate and grabs of the newest frame only
+} CamParams;
+
+//! Represents an image capturing device
+typedef struct {
+	unsigned int width;	 	///< The width of the camera frame (Number of columns)
+	unsigned int height;	 	///< The height of the camera frame  (Number of rows)
+	unsigned int format;		///< Format identifier
+	char *name;	 	 	///< The name of the device
+	int handle;		 	///< The stream handle
+	struct Buffer *buffers;  	///< location of image buffers
+	unsigned int n_buffers;	 	///< Number of allocated buffers
+	unsigned int memory;		///< V4L2 memory type of the buffers
+	struct CamThread *thread;	///< Background capture state, NULL when not running
+	WorkPool *workers;		///< Threads sharing frame conversion, NULL for single threaded
+	JpegDecoder *jpeg;		///< Decoder for MJPEG frames, created on first use
+	Image *scratch;			///< Whole decoded frame for MJPEG region grabs, created on first use
+	struct VirtualCam *virt;	///< Virtual camera state, NULL for V4L2 devices
+	Recorder *recorder;		///< Recorder receiving every captured frame, see camRecord()
+	unsigned int crop_left;		///< First sensor column of the frame, see camSetCrop()
+	unsigned int crop_top;		///< First sensor row of the frame, see camSetCrop()
+	int low_latency;		///< Grabs skip to the newest captured frame
+	CamStats stats;			///< Capture counters
+	CamParams params;		///< Parameters the camera was opened with, defaults included, see camOpenEx()
+} Camera;
+
 //! Represents an image presenting device
 typedef struct {
 	unsigned int width;		///< The width of the image (Number of columns)
@@ -72,6 +195,42 @@ typedef struct {
 } Viewer;
 
 
+//! Recorder queue policies, see recOpen()
+#define REC_DROP_NEWEST		0	///< Drop incoming frames while the queue is full
+#define REC_DROP_OLDEST		1	///< Drop the oldest queued frame to make room
+#define REC_BLOCK		2	///< Make recWrite() wait for room (back-pressure)
+//! Default number of frames queued by a recorder
+#define REC_DEFAULT_SLOTS	16
+//! Magic string starting recorder files
+#define REC_FILE_MAGIC		"EASIREC1"
+
+//! Header of each frame in a recorder file
+/*!
+ *  A recorder file starts with the 8 bytes of REC_FILE_MAGIC followed by
+ *  two 32 bit words: the size of this file header (16) and a reserved zero.
+ *  Frames follow, each one as a RecFrameHeader and then its data.
+ *  All values are little endian.
+ */
+typedef struct {
+	char magic[4];			///< "FRME"
+	unsigned int size;		///< Number of data bytes following this header
+	unsigned int width;		///< Frame width
+	unsigned int height;		///< Frame height
+	unsigned int format;		///< Pixel format identifier
+	unsigned int depth;		///< Bits per pixel
+	unsigned int sequence;		///< Capture sequence number
+	unsigned int reserved;
+	long long timestamp;		///< Capture time, in microseconds
+} RecFrameHeader;
+
+//! Recorder counters, see recGetStats()
+typedef struct {
+	unsigned long frames;		///< Number of frames written to the file
+	unsigned long dropped;		///< Number of frames dropped by the queue policy or on errors
+	unsigned long long bytes;	///< Number of bytes written, headers included
+	unsigned int max_queued;	///< Highest number of frames waiting in the queue
+} RecStats;
+
 /** \defgroup util Utility functions 
  *  \addtogroup util
  *  @{
@@ -85,6 +244,10 @@ void waitTime(unsigned int milliseconds);
 long int GetTime();
 int kbhit();
 int appProcEvents();
+WorkPool *poolNew(unsigned int n_threads);
+void poolRun(WorkPool *pool, void (*task)(void *arg, unsigned int index), void *arg, unsigned int n_tasks);
+unsigned int poolSize(WorkPool *pool);
+void poolDestroy(WorkPool *pool);
 
 /** @}*/
 
@@ -94,34 +257,126 @@ int appProcEvents();
  *  Functions to get info and image data from a connected camera
  */
 Camera * camOpen(char *dev_name, unsigned int width, unsigned int height, int format);
+Camera * camOpenEx(char *dev_name, unsigned int width, unsigned int height, int format, CamParams *params);
 unsigned int camGetWidth(Camera * cam);
 unsigned int camGetHeight(Camera * cam);
 Image * camGrabNewImage(Camera * cam);
+Image * camGrabNewImageEx(Camera * cam, ImagePool * pool);
 int camGrabImage(Camera * cam, Image * img);
+int camGrabImageROI(Camera * cam, Image * img, unsigned int x, unsigned int y,
+			unsigned int w, unsigned int h);
+int camSetCrop(Camera * cam, unsigned int x, unsigned int y, unsigned int w, unsigned int h);
+Image * camAcquireFrame(Camera * cam);
+void camReleaseFrame(Camera * cam, Image * frame);
+int camExportFrame(Camera * cam, Image * frame);
+int camStartCapture(Camera * cam, unsigned int format, unsigned int n_slots);
+int camGetFrame(Camera * cam, Image * img, unsigned int * seq, int mode);
+void camStopCapture(Camera * cam);
+int camSetThreads(Camera * cam, unsigned int n_threads);
+unsigned int camEnumFrameRates(Camera * cam, double * rates, unsigned int max_rates);
+double camGetFrameRate(Camera * cam);
+void camGetStats(Camera * cam, CamStats * stats);
+void camResetStats(Camera * cam);
+CameraGroup * camGroupNew(void);
+int camGroupAdd(CameraGroup * grp, Camera * cam);
+int camGroupGrabAny(CameraGroup * grp, Image ** imgs, int timeout_ms);
+int camGroupGrabSync(CameraGroup * grp, Image ** imgs, long long tolerance_us, int timeout_ms);
+void camGroupDestroy(CameraGroup * grp);
 void camClose(Camera * cam);
 int camPrintCaps(Camera *cam);
 /** @}*/
 
+/** \defgroup convert Pixel format conversion
+ *  \addtogroup convert
+ *  @{
+ *  Functions to convert pixel data between formats
+ */
+void BGR24_to_RGB24(unsigned char *in, unsigned char *out, unsigned int nPixels);
+void YUYV_to_RGB24(unsigned char *in, unsigned char *out, unsigned int nPixels);
+void YUYV_to_BGR24(unsigned char *in, unsigned char *out, unsigned int nPixels);
+void YUYV_to_GREY(unsigned char *in, unsigned char *out, unsigned int nPixels);
+void YUYV_to_RGBA32(unsigned char *in, unsigned char *out, unsigned int nPixels);
+void YUYV_to_RGB24_half(unsigned char *in, unsigned char *out, unsigned int width, unsigned int height);
+void YUYV_to_BGR24_half(unsigned char *in, unsigned char *out, unsigned int width, unsigned int height);
+void YUYV_to_GREY_half(unsigned char *in, unsigned char *out, unsigned int width, unsigned int height);
+void U8_to_U16(const unsigned char *in, uint16_t *out, unsigned int nSamples);
+void U16_to_U8(const uint16_t *in, unsigned char *out, unsigned int nSamples);
+void U8_to_F32(const unsigned char *in, float *out, unsigned int nSamples);
+void U16_to_F32(const uint16_t *in, float *out, unsigned int nSamples);
+void F32_to_U8(const float *in, unsigned char *out, unsigned int nSamples);
+void F32_to_U16(const float *in, uint16_t *out, unsigned int nSamples);
+void Deinterleave3(const unsigned char *in, unsigned char *c0, unsigned char *c1, unsigned char *c2, unsigned int nPixels);
+void Interleave3(const unsigned char *c0, const unsigned char *c1, const unsigned char *c2, unsigned char *out, unsigned int nPixels);
+void Deinterleave4(const unsigned char *in, unsigned char *c0, unsigned char *c1, unsigned char *c2, unsigned char *c3, unsigned int nPixels);
+void Interleave4(const unsigned char *c0, const unsigned char *c1, const unsigned char *c2, const unsigned char *c3, unsigned char *out, unsigned int nPixels);
+JpegDecoder *jpegNew(void);
+int jpegGetSize(JpegDecoder *dec, const unsigned char *data, unsigned int size, unsigned int *width, unsigned int *height);
+int jpegDecode(JpegDecoder *dec, const unsigned char *data, unsigned int size, Image *img, WorkPool *workers);
+void jpegDestroy(JpegDecoder *dec);
+/** @}*/
+
+/** \defgroup record Frame recording
+ *  \addtogroup record
+ *  @{
+ *  Functions to stream frames to disk
+ */
+Recorder *recOpen(const char *filename, unsigned int n_slots, int policy);
+int recWrite(Recorder *rec, Image *img, unsigned int size);
+void recGetStats(Recorder *rec, RecStats *stats);
+int recClose(Recorder *rec);
+int camRecord(Camera *cam, Recorder *rec);
+/** @}*/
+
 /** \defgroup image Image operations 
  *  \addtogroup image
  *  @{
  *  Functions to create and process image structures
  */	
 Image  *imgNew(unsigned int width, unsigned int height, unsigned short depth);
+Image  *imgNewEx(unsigned int width, unsigned int height, unsigned short depth, unsigned int flags);
 Image  *imgFromBitmap(const char *filename);
 Image  *imgFromPPM(const char *filename);
+Image  *imgFromJPEG(const char *filename);
 Image  *imgFromFile(const char *filename);
 int 	imgSavePPM(Image *img, char *fname);
 int     imgSavePAM(Image *img, char *fname);
 int	imgSaveRAW(Image *img, char *fname);
 Image  *imgCopy(Image * img);
+Image  *imgCopyEx(Image * img, ImagePool *pool);
 void 	imgScale(Image *img, unsigned int sfactor);
 Image  *imgCrop(Image *img, int x1, int y1, int x2, int y2);
+Image  *imgCropEx(Image *img, int x1, int y1, int x2, int y2, ImagePool *pool);
+Image  *imgView(Image *img, int x1, int y1, int x2, int y2);
+Image  *imgConvertFormat(Image *img, unsigned int format, Image *res);
 Image  *imgCreateGaussian(int dim, float sig);
 Image  *imgConvolution(Image *img1, Image *img2, Image *res);
-int	imgFindPattern(Image *img, Image *pattern, int *x, int *y);
-int	imgFindPatternArea(Image *img, Image *pattern, int x1, int y1, int x2, int y2, int *x, int *y);
+Image  *imgConvolutionInt(Image *img, const short *kern, int kw, int kh, int divisor, int bias, Image *res);
+Image  *imgSeparableConvolution(Image *img, Image *hkern, Image *vkern, Image *res);
+Image  *imgCreateGaussian1D(int dim, float sig);
+Image  *imgGaussianBlur(Image *img, int dim, float sig, Image *res);
+long long imgFindPattern(Image *img, Image *pattern, int *x, int *y);
+long long imgFindPatternArea(Image *img, Image *pattern, int x1, int y1, int x2, int y2, int *x, int *y);
+long long imgFindPatternPyramid(Image *img, Image *pattern, int x1, int y1, int x2, int y2,
+		int levels, int candidates, int *x, int *y);
 void 	imgDestroy(Image * img);
+Image  *imgRetain(Image *img);
+void	imgRelease(Image *img);
+int	imgMakeWritable(Image *img);
+Image  *imgWrap(unsigned char *data, unsigned int width, unsigned int height, unsigned short depth,
+		unsigned int stride, void (*dispose)(void *ctx, unsigned char *data), void *ctx);
+PlanarImage *imgPlanarNew(unsigned int width, unsigned int height, unsigned int n_planes);
+void	imgPlanarDestroy(PlanarImage *pl);
+PlanarImage *imgToPlanar(Image *img, PlanarImage *res);
+Image  *imgFromPlanar(PlanarImage *pl, Image *res);
+PlanarImage *imgPlanarConvolution(PlanarImage *src, Image *kern, PlanarImage *res);
+int	imgPlanarFindPattern(PlanarImage *img, PlanarImage *pat, int *x, int *y);
+int	imgPlanarFindPatternArea(PlanarImage *img, PlanarImage *pat, int x1, int y1, int x2, int y2, int *x, int *y);
+void	imgPlanarGetMeanArea(PlanarImage *pl, int x1, int y1, int x2, int y2, float *mean);
+void	imgPlanarGetMean(PlanarImage *pl, float *mean);
+ImagePool *imgPoolNew(void);
+Image  *imgPoolGet(ImagePool *pool, unsigned int width, unsigned int height, unsigned short depth);
+void	imgPoolReset(ImagePool *pool);
+void	imgPoolDestroy(ImagePool *pool);
 void 	imgMakeSymmetricX(Image *img);
 void 	imgMakeSymmetricY(Image *img);
 void 	imgMakeSymmetric(Image *img);
@@ -129,11 +384,17 @@ int 	imgGetSymmetryError(Image *img, int x, int y, int radius);
 Image  *imgPatternDifference( Image *img, Image *pat, Image *res, int x1, int y1, int x2, int y2);
 int 	imgGetPixelDifference(unsigned char *p1, unsigned char *p2);
 
-int     imgGetSumArea( Image *img,                      // Image to analyze 
+long long imgGetSumArea( Image *img,                      // Image to analyze 
                         int x1, int y1, int x2, int y2);
 float 	imgGetMeanArea(	Image *img, 			 // Image to analyze (where to search)
 			int x1, int y1, int x2, int y2); // Rectangular area of img to use
 float 	imgGetMean(Image *img);
+IntegralImage *imgIntegralNew(unsigned int width, unsigned int height, unsigned int n_comp, int squares);
+void	imgIntegralDestroy(IntegralImage *ii);
+IntegralImage *imgIntegral(Image *img, int squares, IntegralImage *res);
+long long imgIntegralSum(IntegralImage *ii, int x1, int y1, int x2, int y2, int c);
+double	imgIntegralMean(IntegralImage *ii, int x1, int y1, int x2, int y2, int c);
+double	imgIntegralVariance(IntegralImage *ii, int x1, int y1, int x2, int y2, int c);
 
 unsigned int imgGetWidth(Image * img);
 unsigned int imgGetHeight(Image * img);
@@ -149,6 +410,17 @@ void MarkImagePosition(Image * img, int x, int y);
 
 /** @}*/
 
+/** \defgroup fft FFT filtering
+ *  \addtogroup fft
+ *  @{
+ *  Convolution and pattern search in the frequency domain, for large kernels
+ */
+FFTKernel *fftKernelNew(Image *kern, unsigned int tile);
+void	fftKernelDestroy(FFTKernel *fk);
+Image  *fftConvolution(Image *img, FFTKernel *fk, Image *res);
+long long fftFindPatternArea(Image *img, FFTKernel *fpat, int x1, int y1, int x2, int y2, int *x, int *y);
+/** @}*/
+
 /* Viewer operations */
 /** \defgroup view Viewer operations 
  *  \addtogroup view
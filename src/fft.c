@@ -0,0 +1,519 @@
+/**
+ * @file	fft.c
+ *
+ * FFT based convolution and pattern correlation.
+ *
+ * Large kernels and patterns are applied in the frequency domain.
+ * The image is cut in blocks that are transformed with a mixed radix
+ * (2, 3, 4, 5) real 2-D FFT, multiplied by the kernel spectrum and
+ * transformed back, the partial results being added together (overlap-add).
+ * The kernel spectrum is computed once by fftKernelNew() and can be
+ * reused for every frame.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#include "easimage.h"
+
+#include <complex.h>
+
+#define FFT_MAX_FACTORS	32
+#define FFT_MIN_TILE	64
+
+typedef double complex cplx;
+
+// complex product, without the special cases of C99 multiplication
+static inline cplx cmul(cplx a, cplx b)
+{
+	double ar = creal(a), ai = cimag(a), br = creal(b), bi = cimag(b);
+	return (ar*br - ai*bi) + (ar*bi + ai*br)*I;
+}
+
+// Transform of a given length
+typedef struct {
+	int n;
+	int fac[2*FFT_MAX_FACTORS];	// radix and remaining length of each stage
+	cplx *tw[2];			// forward and inverse twiddle factors
+} FFTPlan;
+
+struct FFTKernel {
+	int kw, kh;			// kernel size
+	int kcomp;			// components with their own kernel
+	int tw, th;			// transform size
+	int bw, bh;			// image block size
+	unsigned long divisor;		// convolution normalization, as imgConvolution()
+	long long sumsq;		// sum of squared kernel samples
+	FFTPlan *row, *col;
+	cplx *kspec[IMG_MAX_PLANES];	// kernel spectra, th x (tw/2+1)
+	cplx *spec, *acc;		// work spectra
+	cplx *line[2];			// work row or column
+	double *buf;			// work block, th x tw
+};
+
+/**
+ *  \addtogroup fft
+ *  @{
+ */
+
+// smallest even n >= x with no prime factors other than 2, 3 and 5
+static int fftGoodSize(int x)
+{
+	int n;
+	for ( n = x + (x & 1) ; ; n += 2 ) {
+		int m = n;
+		while ( m % 2 == 0 ) m /= 2;
+		while ( m % 3 == 0 ) m /= 3;
+		while ( m % 5 == 0 ) m /= 5;
+		if ( m == 1 ) return n;
+	}
+}
+
+static void fftPlanDestroy(FFTPlan *p)
+{
+	if ( ! p ) return;
+	free(p->tw[0]);
+	free(p->tw[1]);
+	free(p);
+}
+
+static FFTPlan *fftPlanNew(int n)
+{
+	FFTPlan *p = calloc(1, sizeof(FFTPlan));
+	if ( ! p ) return NULL;
+	p->n = n;
+	p->tw[0] = malloc(n * sizeof(cplx));
+	p->tw[1] = malloc(n * sizeof(cplx));
+	if ( ! p->tw[0] || ! p->tw[1] ) {
+		fftPlanDestroy(p);
+		return NULL;
+	}
+	int k;
+	for ( k=0 ; k<n ; k++ ) {
+		double a = -2.0 * M_PI * k / n;
+		p->tw[0][k] = cos(a) + sin(a)*I;
+		p->tw[1][k] = conj(p->tw[0][k]);
+	}
+	// radix 4 stages first, then 2, 3, 5 and any other prime
+	int r = 4, m = n, *f = p->fac;
+	while ( m > 1 ) {
+		while ( m % r ) {
+			if ( r == 4 ) r = 2;
+			else if ( r == 2 ) r = 3;
+			else r += 2;
+		}
+		m /= r;
+		*f++ = r;
+		*f++ = m;
+	}
+	return p;
+}
+
+static void fftBfly2(cplx *out, size_t fstride, const cplx *tw, int m)
+{
+	int k;
+	for ( k=0 ; k<m ; k++ ) {
+		cplx t = cmul(out[k+m], tw[k*fstride]);
+		out[k+m] = out[k] - t;
+		out[k] += t;
+	}
+}
+
+static void fftBfly4(cplx *out, size_t fstride, const cplx *tw, int m, int inv)
+{
+	int k;
+	for ( k=0 ; k<m ; k++ ) {
+		cplx s0 = cmul(out[k+m], tw[k*fstride]);
+		cplx s1 = cmul(out[k+2*m], tw[2*k*fstride]);
+		cplx s2 = cmul(out[k+3*m], tw[3*k*fstride]);
+		cplx s5 = out[k] - s1;
+		cplx s3 = s0 + s2;
+		cplx d = s0 - s2;
+		cplx s4 = inv ? -cimag(d) + creal(d)*I : cimag(d) - creal(d)*I;
+		out[k] += s1;
+		out[k+2*m] = out[k] - s3;
+		out[k] += s3;
+		out[k+m] = s5 + s4;
+		out[k+3*m] = s5 - s4;
+	}
+}
+
+static void fftBflyGeneric(cplx *out, size_t fstride, const cplx *tw, int m, int p, int n)
+{
+	cplx scratch[p];
+	int u, q, q1;
+	for ( u=0 ; u<m ; u++ ) {
+		for ( q1=0 ; q1<p ; q1++ )
+			scratch[q1] = out[u + q1*m];
+		for ( q1=0 ; q1<p ; q1++ ) {
+			int k = u + q1*m;
+			size_t t = 0;
+			out[k] = scratch[0];
+			for ( q=1 ; q<p ; q++ ) {
+				t += fstride * k;
+				if ( t >= (size_t)n ) t -= n;
+				out[k] += cmul(scratch[q], tw[t]);
+			}
+		}
+	}
+}
+
+// recursive decimation in time, out gets the n/fstride outputs of this stage
+static void fftWork(const FFTPlan *p, cplx *out, const cplx *in, size_t fstride,
+			int istride, const int *fac, int inv)
+{
+	const int radix = fac[0], m = fac[1];
+	int k;
+	if ( m == 1 )
+		for ( k=0 ; k<radix ; k++ )
+			out[k] = in[k*fstride*istride];
+	else
+		for ( k=0 ; k<radix ; k++ )
+			fftWork(p, out + k*m, in + k*fstride*istride, fstride*radix, istride, fac+2, inv);
+	switch ( radix ) {
+		case 2:  fftBfly2(out, fstride, p->tw[inv], m); break;
+		case 4:  fftBfly4(out, fstride, p->tw[inv], m, inv); break;
+		default: fftBflyGeneric(out, fstride, p->tw[inv], m, radix, p->n);
+	}
+}
+
+// unnormalized complex transform of in, read with stride istride, into out
+static void fftRun(const FFTPlan *p, const cplx *in, int istride, cplx *out, int inv)
+{
+	if ( p->n == 1 )
+		out[0] = in[0];
+	else
+		fftWork(p, out, in, 1, istride, p->fac, inv);
+}
+
+// spectrum of the real block buf (th x tw, rows from nrows on are zero) into spec (th x tw/2+1)
+static void fftForward2D(FFTKernel *fk, const double *buf, int nrows, cplx *spec)
+{
+	const int tw = fk->tw, th = fk->th, hw = tw/2 + 1;
+	cplx *z = fk->line[0], *zf = fk->line[1];
+	int r, k;
+	// two real rows per complex transform
+	for ( r=0 ; r<th ; r+=2 ) {
+		cplx *a = spec + r*hw, *b = a + hw;
+		if ( r >= nrows ) {
+			memset(a, 0, 2*hw*sizeof(cplx));
+			continue;
+		}
+		const double *ra = buf + r*tw, *rb = ra + tw;
+		if ( r+1 < nrows )
+			for ( k=0 ; k<tw ; k++ ) z[k] = ra[k] + rb[k]*I;
+		else
+			for ( k=0 ; k<tw ; k++ ) z[k] = ra[k];
+		fftRun(fk->row, z, 1, zf, 0);
+		for ( k=0 ; k<hw ; k++ ) {
+			cplx zk = zf[k], zn = conj(zf[k ? tw-k : 0]);
+			a[k] = 0.5 * (zk + zn);
+			cplx d = zk - zn;
+			b[k] = 0.5*cimag(d) - 0.5*creal(d)*I;
+		}
+	}
+	for ( k=0 ; k<hw ; k++ ) {
+		fftRun(fk->col, spec + k, hw, z, 0);
+		for ( r=0 ; r<th ; r++ )
+			spec[r*hw + k] = z[r];
+	}
+}
+
+// inverse of fftForward2D(), the first nrows rows of buf are produced; spec is destroyed
+static void fftInverse2D(FFTKernel *fk, cplx *spec, int nrows, double *buf)
+{
+	const int tw = fk->tw, th = fk->th, hw = tw/2 + 1;
+	const double scale = 1.0 / ((double)tw * th);
+	cplx *z = fk->line[0], *zf = fk->line[1];
+	int r, k;
+	for ( k=0 ; k<hw ; k++ ) {
+		fftRun(fk->col, spec + k, hw, z, 1);
+		for ( r=0 ; r<th ; r++ )
+			spec[r*hw + k] = z[r];
+	}
+	for ( r=0 ; r<nrows ; r+=2 ) {
+		const cplx *a = spec + r*hw, *b = a + hw;
+		// a + i b, with the hermitian symmetry of both for the upper half
+		for ( k=0 ; k<hw ; k++ )
+			zf[k] = (creal(a[k]) - cimag(b[k])) + (cimag(a[k]) + creal(b[k]))*I;
+		for ( ; k<tw ; k++ )
+			zf[k] = (creal(a[tw-k]) + cimag(b[tw-k])) + (creal(b[tw-k]) - cimag(a[tw-k]))*I;
+		fftRun(fk->row, zf, 1, z, 1);
+		double *ra = buf + r*tw, *rb = ra + tw;
+		for ( k=0 ; k<tw ; k++ ) {
+			ra[k] = creal(z[k]) * scale;
+			rb[k] = cimag(z[k]) * scale;
+		}
+	}
+}
+
+/*
+ * Adds to acc, ow x oh values for the output area starting at ox,oy, the sum over
+ * components c0 to c1-1 of the correlation of img with the kernel:
+ *   acc(x,y) += img_c(x+i-kw/2, y+j-kh/2) * kern_c(i,j), for all i, j
+ * Samples outside the image count as zero.
+ */
+static void fftCorrelate(FFTKernel *fk, Image *img, int c0, int c1,
+			int ox, int oy, int ow, int oh, double *acc)
+{
+	const int tw = fk->tw, hw = tw/2 + 1, n = fk->th * hw;
+	const int xc = fk->kw/2, yc = fk->kh/2;
+	const int xs = fk->kw-1-xc, ys = fk->kh-1-yc;	// output shift in a block
+	const int comp = img->depth/8;
+	// image samples that reach the output area
+	int ix0 = max(0, ox - xc), ix1 = min((int)img->width-1, ox+ow-1+xs);
+	int iy0 = max(0, oy - yc), iy1 = min((int)img->height-1, oy+oh-1+ys);
+	int bx0, by0, c, k, u, v;
+	for ( by0=iy0 ; by0<=iy1 ; by0+=fk->bh ) {
+		int rows = min(fk->bh, iy1-by0+1);
+		for ( bx0=ix0 ; bx0<=ix1 ; bx0+=fk->bw ) {
+			int cols = min(fk->bw, ix1-bx0+1);
+			for ( c=c0 ; c<c1 ; c++ ) {
+				for ( v=0 ; v<rows ; v++ ) {
+					const unsigned char *src = img->data + (by0+v)*img->stride + bx0*comp + c;
+					double *dst = fk->buf + v*tw;
+					for ( u=0 ; u<cols ; u++ )
+						dst[u] = src[u*comp];
+					memset(dst + cols, 0, (tw-cols)*sizeof(double));
+				}
+				fftForward2D(fk, fk->buf, rows, fk->spec);
+				const cplx *ks = fk->kspec[fk->kcomp > 1 ? c : 0];
+				if ( c == c0 )
+					for ( k=0 ; k<n ; k++ ) fk->acc[k] = cmul(fk->spec[k], ks[k]);
+				else
+					for ( k=0 ; k<n ; k++ ) fk->acc[k] += cmul(fk->spec[k], ks[k]);
+			}
+			int orows = rows + fk->kh - 1, ocols = cols + fk->kw - 1;
+			fftInverse2D(fk, fk->acc, orows, fk->buf);
+			for ( v=0 ; v<orows ; v++ ) {
+				int y = by0 + v - ys;
+				if ( y < oy || y >= oy+oh ) continue;
+				int ua = max(0, ox - (bx0 - xs)), ub = min(ocols, ox + ow - (bx0 - xs));
+				const double *src = fk->buf + v*tw;
+				double *dst = acc + (y-oy)*ow + (bx0 - xs - ox);
+				for ( u=ua ; u<ub ; u++ )
+					dst[u] += src[u];
+			}
+		}
+	}
+}
+
+//! Destroys an FFT kernel
+void fftKernelDestroy(FFTKernel *fk)
+{
+	int c;
+	if ( ! fk ) return;
+	fftPlanDestroy(fk->row);
+	fftPlanDestroy(fk->col);
+	for ( c=0 ; c<IMG_MAX_PLANES ; c++ )
+		free(fk->kspec[c]);
+	free(fk->spec);
+	free(fk->acc);
+	free(fk->line[0]);
+	free(fk->line[1]);
+	free(fk->buf);
+	free(fk);
+}
+
+//! Creates an FFT kernel
+/*!
+ *  Computes the spectrum of kernel or pattern Image @p kern, to be used
+ *  by fftConvolution() and fftFindPatternArea() on any number of images.
+ *  A kernel is not thread safe: it holds the work buffers of the transforms.
+ *  @param kern 8 bit Image, GREY applies to every component, otherwise one kernel per component
+ *  @param tile the transform size, 0 to choose it from the kernel size.
+ *  	   Larger transforms mean fewer blocks but more work per block.
+ *  @return The new kernel, or NULL on error
+ */
+FFTKernel *fftKernelNew(Image *kern, unsigned int tile)
+{
+	const int comp = kern->depth/8;
+	if ( kern->format==RGB48 || kern->format==GREY16 || kern->format==GREY32F
+			|| kern->format==RGB96F || comp<1 || comp>IMG_MAX_PLANES ) {
+		fprintf(stderr, "FFT kernel must have 8 bit samples\n");
+		return NULL;
+	}
+	FFTKernel *fk = calloc(1, sizeof(FFTKernel));
+	if ( ! fk ) {
+		fprintf(stderr, "Failed to allocate FFT kernel\n");
+		return NULL;
+	}
+	fk->kw = kern->width;
+	fk->kh = kern->height;
+	fk->kcomp = comp;
+	if ( tile == 0 )	// a power of 2 about 4 times the kernel size
+		for ( tile=FFT_MIN_TILE ; tile < 3*max(fk->kw, fk->kh) ; tile*=2 ) ;
+	fk->tw = fftGoodSize(max((int)tile, 2*fk->kw));
+	fk->th = fftGoodSize(max((int)tile, 2*fk->kh));
+	fk->bw = fk->tw - fk->kw + 1;
+	fk->bh = fk->th - fk->kh + 1;
+	fk->divisor = imgGetMean(kern) * kern->width * kern->height;
+
+	const int hw = fk->tw/2 + 1, n = fk->th * hw;
+	int c, x, y, ok = 1;
+	fk->row = fftPlanNew(fk->tw);
+	fk->col = fftPlanNew(fk->th);
+	fk->spec = malloc(n * sizeof(cplx));
+	fk->acc = malloc(n * sizeof(cplx));
+	fk->line[0] = malloc(max(fk->tw, fk->th) * sizeof(cplx));
+	fk->line[1] = malloc(max(fk->tw, fk->th) * sizeof(cplx));
+	fk->buf = calloc(fk->tw * fk->th, sizeof(double));
+	for ( c=0 ; c<comp ; c++ )
+		ok = ok && (fk->kspec[c] = malloc(n * sizeof(cplx)));
+	if ( ! ok || ! fk->row || ! fk->col || ! fk->spec || ! fk->acc
+			|| ! fk->line[0] || ! fk->line[1] || ! fk->buf ) {
+		fprintf(stderr, "Failed to allocate FFT kernel\n");
+		fftKernelDestroy(fk);
+		return NULL;
+	}
+	// correlation is convolution with the kernel reversed
+	for ( c=0 ; c<comp ; c++ ) {
+		memset(fk->buf, 0, fk->tw * fk->th * sizeof(double));
+		for ( y=0 ; y<fk->kh ; y++ )
+			for ( x=0 ; x<fk->kw ; x++ ) {
+				int s = imgGetPixel(kern, x, y)[c];
+				fk->buf[(fk->kh-1-y)*fk->tw + fk->kw-1-x] = s;
+				fk->sumsq += s*s;
+			}
+		fftForward2D(fk, fk->buf, fk->kh, fk->kspec[c]);
+	}
+	return fk;
+}
+
+//! FFT image convolution
+/*!
+ *  Same as imgConvolution(), with the kernel spectrum of @p fk.
+ *  Faster than direct convolution for large kernels.
+ *  @param img the 8 bit Image to filter
+ *  @param fk the kernel, from fftKernelNew()
+ *  @param res the destination, matching @p img, or NULL to create a new Image
+ *  @return The filtered Image, or NULL on error
+ */
+Image *fftConvolution(Image *img, FFTKernel *fk, Image *res)
+{
+	const int comp = img->depth/8;
+	const int w = img->width, h = img->height;
+	if ( img->format==RGB48 || img->format==GREY16 || img->format==GREY32F
+			|| img->format==RGB96F || (fk->kcomp>1 && fk->kcomp!=comp) ) {
+		fprintf(stderr, "FFT convolution kernel does not match the image\n");
+		return NULL;
+	}
+	if ( fk->divisor == 0 ) {
+		fprintf(stderr, "Bad convolution kernel\n");
+		return NULL;
+	}
+	double *acc = malloc(w * h * sizeof(double));
+	if ( ! acc ) {
+		fprintf(stderr, "Failed to allocate memory for convolution\n");
+		return NULL;
+	}
+	if ( ! res ) {
+		res = imgNew(w, h, img->depth);
+		if ( ! res ) {
+			free(acc);
+			return NULL;
+		}
+		res->format = img->format;
+	}
+	if ( imgMakeWritable(res) ) {
+		free(acc);
+		return NULL;
+	}
+	int c, x, y;
+	for ( c=0 ; c<comp ; c++ ) {
+		memset(acc, 0, w * h * sizeof(double));
+		fftCorrelate(fk, img, c, c+1, 0, 0, w, h, acc);
+		for ( y=0 ; y<h ; y++ ) {
+			unsigned char *out = res->data + y*res->stride + c;
+			const double *a = acc + y*w;
+			for ( x=0 ; x<w ; x++ ) {
+				// sums are integers, rounding removes the transform error
+				unsigned long v = a[x] > 0 ? (unsigned long)(a[x] + 0.5) / fk->divisor : 0;
+				out[x*comp] = v > 255 ? 255 : v;
+			}
+		}
+	}
+	free(acc);
+	return res;
+}
+
+//! Searches image area for a pattern, in the frequency domain
+/*!
+ *  Selects the location in the area of Image @p img where the sum of squared
+ *  differences to the pattern of @p fpat is minimum, over all components.
+ *  The squared differences are obtained from the correlation of the image
+ *  and the pattern, so the cost does not grow with the pattern size.
+ *  The area is clamped to the locations where the pattern fits the image.
+ *  @param img Image to be searched, with the pattern depth.
+ *  @param fpat the pattern, from fftKernelNew()
+ *  @param x1 the column number of the top left corner of the image area to be searched
+ *  @param y1 the row number of the top left corner of the image area to be searched
+ *  @param x2 the column number of the bottom right corner of the image area
+ *  @param y2 the row number of the bottom right corner of the image area to be searched
+ *  @param best_x location to store the column number of the selected location.
+ *  @param best_y location to store the row number of the selected location.
+ *  @return The sum of squared differences at the selected location,
+ *  	    LLONG_MAX if there is none, -1 on error.
+ */
+long long fftFindPatternArea(Image *img, FFTKernel *fpat, int x1, int y1, int x2, int y2,
+			int *best_x, int *best_y)
+{
+	const int comp = img->depth/8;
+	const int xc = fpat->kw/2, yc = fpat->kh/2;
+	*best_x = *best_y = -1;
+	if ( img->format==RGB48 || img->format==GREY16 || img->format==GREY32F
+			|| img->format==RGB96F || fpat->kcomp != comp ) {
+		fprintf(stderr, "FFT pattern does not match the image\n");
+		return -1;
+	}
+	x1 = max(x1, xc);
+	y1 = max(y1, yc);
+	x2 = min(x2, (int)img->width - fpat->kw + xc);
+	y2 = min(y2, (int)img->height - fpat->kh + yc);
+	if ( x1>x2 || y1>y2 ) return LLONG_MAX;
+
+	const int ow = x2-x1+1, oh = y2-y1+1;
+	// squared image samples summed over windows, from a table of running sums
+	const int sw = ow + fpat->kw - 1, sh = oh + fpat->kh - 1;
+	double *acc = calloc(ow * oh, sizeof(double));
+	long long *sq = calloc((sw+1) * (sh+1), sizeof(long long));
+	if ( ! acc || ! sq ) {
+		fprintf(stderr, "Failed to allocate memory for pattern search\n");
+		free(acc);
+		free(sq);
+		return -1;
+	}
+	int x, y;
+	for ( y=0 ; y<sh ; y++ ) {
+		const unsigned char *row = img->data + (y1-yc+y)*img->stride + (x1-xc)*comp;
+		long long line = 0;
+		for ( x=0 ; x<sw*comp ; x++ ) {
+			line += row[x] * row[x];
+			if ( x % comp == comp-1 )
+				sq[(y+1)*(sw+1) + x/comp + 1] = sq[y*(sw+1) + x/comp + 1] + line;
+		}
+	}
+	fftCorrelate(fpat, img, 0, comp, x1, y1, ow, oh, acc);
+
+	long long best = LLONG_MAX;
+	for ( y=0 ; y<oh ; y++ )
+		for ( x=0 ; x<ow ; x++ ) {
+			const long long *s0 = sq + y*(sw+1) + x, *s1 = s0 + fpat->kh*(sw+1);
+			long long win = s1[fpat->kw] - s1[0] - s0[fpat->kw] + s0[0];
+			long long d = win - 2*llround(acc[y*ow + x]) + fpat->sumsq;
+			if ( d < best ) {
+				best = d;
+				*best_x = x1 + x;
+				*best_y = y1 + y;
+			}
+		}
+	free(acc);
+	free(sq);
+	return best;
+}
+
+/** @}*/
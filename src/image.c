@@ -8,6 +8,7 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <malloc.h>
 #include <string.h>
 
@@ -15,13 +16,119 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <limits.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define IMG_X86
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define IMG_NEON
+#include <arm_neon.h>
+#endif
+
 #include "easimage.h"
 
+#define IMG_HUGE_PAGE	(2 << 20)	// huge page size on x86-64 and arm64
+
 /**  
  *  \addtogroup image
  *  @{
  */
 
+/*
+ * Pixel memory is held in blocks shared by the Images using it: the Image
+ * that allocated it, its views, and the handles made by imgRetain().
+ * The memory is released with the last of them. Handles other than views
+ * are copy on write: imgMakeWritable() gives them a private copy while the
+ * block has other owners.
+ */
+struct ImgBlock {
+	unsigned int refs;		// Images using the memory
+	unsigned int owners;		// Images using the memory, views excluded
+	unsigned char *mem;
+	size_t mapped;			// length of an explicit huge page mapping, or 0
+	void (*dispose)(void *ctx, unsigned char *mem);	// for wrapped memory
+	void *ctx;
+};
+
+static struct ImgBlock *imgBlockNew(unsigned char *mem)
+{
+	struct ImgBlock *blk = calloc(1, sizeof(struct ImgBlock));
+	if ( blk == NULL ) {
+		fprintf(stderr, "Failed to allocate memory for image block\n");
+		return NULL;
+	}
+	blk->refs = blk->owners = 1;
+	blk->mem = mem;
+	return blk;
+}
+
+// drops the reference of an Image to its pixel memory
+static void imgBlockDrop(Image *img)
+{
+	struct ImgBlock *blk = img->block;
+	if ( blk == NULL ) return;
+	img->block = NULL;
+	if ( ! (img->flags & IMG_VIEW) )
+		__atomic_sub_fetch(&blk->owners, 1, __ATOMIC_ACQ_REL);
+	if ( __atomic_sub_fetch(&blk->refs, 1, __ATOMIC_ACQ_REL) ) return;
+	if ( blk->dispose )
+		blk->dispose(blk->ctx, blk->mem);
+	else if ( blk->mapped )
+		munmap(blk->mem, blk->mapped);
+	else
+		free(blk->mem);
+	free(blk);
+}
+
+// allocates the pixel memory of an Image with width, height, depth and flags set.
+// Data is aligned to IMG_ALIGN bytes and, unless packed, so is every row.
+static int imgAllocData(Image *img)
+{
+	img->stride = img->width * img->depth/8;
+	if ( ! (img->flags & IMG_PACKED) )
+		img->stride = (img->stride + IMG_ALIGN - 1) & ~(IMG_ALIGN - 1);
+	size_t size = (size_t)img->stride * img->height;
+	size_t mapped = 0;
+	unsigned char *mem = NULL;
+
+	// huge pages only pay off for images spanning several of them
+	if ( (img->flags & IMG_HUGE_PAGES) && size >= IMG_HUGE_PAGE ) {
+		size_t len = (size + IMG_HUGE_PAGE - 1) & ~(size_t)(IMG_HUGE_PAGE - 1);
+		// explicit huge pages, if the system has some reserved
+		void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if ( p != MAP_FAILED ) {
+			mem = p;
+			mapped = len;
+		}
+		// otherwise transparent huge pages, on a huge page aligned block
+		else if ( posix_memalign((void **)&mem, IMG_HUGE_PAGE, len) == 0 )
+			madvise(mem, len, MADV_HUGEPAGE);
+		else
+			mem = NULL;
+	}
+	if ( mem == NULL &&
+	     posix_memalign((void **)&mem, IMG_ALIGN, size ? size : IMG_ALIGN) ) {
+		fprintf(stderr, "Memory allocation of image data failed\n");
+		return 1;
+	}
+	img->block = imgBlockNew(mem);
+	if ( img->block == NULL ) {
+		if ( mapped ) munmap(mem, mapped);
+		else free(mem);
+		return 1;
+	}
+	img->block->mapped = mapped;
+	img->flags &= ~IMG_VIEW;
+	img->mem_ptr = img->data = mem;
+	return 0;
+}
+
 //! Creates a new image
 /*!
  *  Allocates a memory block to store an Image structure.
@@ -33,6 +140,25 @@
  *  @return The address of the new allocated Image
  */
 Image * imgNew(unsigned int width, unsigned int height, unsigned short depth)
+{
+	return imgNewEx(width, height, depth, 0);
+}
+
+//! Creates a new image with allocation flags
+/*!
+ *  Same as imgNew(). Pixel data is aligned to IMG_ALIGN bytes and rows are
+ *  padded to a multiple of IMG_ALIGN bytes, see Image::stride, unless
+ *  @p flags holds IMG_PACKED. With IMG_HUGE_PAGES, images of 2 MB or more
+ *  use explicit huge pages when the system has them reserved, and
+ *  transparent huge pages otherwise, reducing TLB misses on large frames.
+ *  @param width the number of columns
+ *  @param height the number of rows
+ *  @param depth the pixel size in bits
+ *  @param flags IMG_PACKED and IMG_HUGE_PAGES, or 0
+ *  @return The address of the new allocated Image
+ */
+Image * imgNewEx(unsigned int width, unsigned int height, unsigned short depth,
+		unsigned int flags)
 {
 	// Allocate for the image container
 	Image * img = malloc(sizeof(Image));
@@ -46,27 +172,20 @@ Image * imgNew(unsigned int width, unsigned int height, unsigned short depth)
 	img->height = height;
 
 	img->depth = depth;
+	img->flags = flags;
 	img->format = 0;
+	img->pool = NULL;
 	img->name = NULL;
+	img->timestamp = 0;
+	img->sequence = 0;
 
-	// allocate for image data, depth/8 byte per pixel,
-	// aligned to an 8 byte boundary
-	img->mem_ptr = malloc(img->width * img->height * depth/8 + 8);
-	if(img->mem_ptr == NULL){
-		fprintf(stderr, "Memory allocation of image data failed\n");
+	if ( imgAllocData(img) ) {
 		free(img);
 		return NULL;
 	}
 
 	if ( depth==8 ) img->format = V4L2_PIX_FMT_GREY;
 
-	// make certain it is aligned to 8 bytes
-	unsigned int remainder = ((size_t)img->mem_ptr) % 8;
-	if(remainder == 0)
-		img->data = img->mem_ptr;
-	else
-		img->data = img->mem_ptr + (8 - remainder);
-
 	// return the image
 	return img;
 }
@@ -78,37 +197,35 @@ Image * imgNew(unsigned int width, unsigned int height, unsigned short depth)
  *  @param filename the name of the BMP image file
  *  @return The address of the new loaded Image
  */
+// releases the SDL surface holding the pixels of a BMP Image
+static void imgFreeSurface(void *surface, unsigned char *pixels)
+{
+	SDL_FreeSurface(surface);
+}
+
 Image *imgFromBitmap(const char * filename)
 {
 	// Load the Bitmap
 	SDL_Surface * bitmap = SDL_LoadBMP(filename);
-
-	// Allocate for the image container
-	Image * img = malloc(sizeof(Image));
-	if(img == NULL){
-		fprintf(stderr, "Failed to allocate memory for image container\n");
+	if ( bitmap==NULL ) {
+		fprintf(stderr, "Could not load bitmap '%s'\n", filename);
 		return NULL;
 	}
 
-	// Set the width and height
-	img->width = bitmap->w;
-	img->height = bitmap->h;
+	// the pixels stay in the surface, released with the last Image using them
+	Image * img = imgWrap(bitmap->pixels, bitmap->w, bitmap->h, 24, bitmap->pitch,
+			imgFreeSurface, bitmap);
+	if ( img==NULL ) {
+		SDL_FreeSurface(bitmap);
+		return NULL;
+	}
 	img->format = RGB24;
-	img->depth = 24;
 	img->name = strdup(filename);
 
-	// set the data pointer
-	img->data = bitmap->pixels;	
-
-	// set the memory pointer to NULL, so we don't cause mayhem trying to free it
-	img->mem_ptr = NULL;
-
-	// Free SDL_Surface Container
-	free(bitmap);
-
 	// return the new image
 	return img;
 }
+
 //! Loads an image from a PPM image file
 /*!
  *  Creates a new Image using the data read from the specified PPM image file.
@@ -142,24 +259,78 @@ Image *imgFromPPM(const char * filename)
                 fclose(fimg);
                 return NULL;
         }
-	int pixel_size = ( s>255 ? 6 : 3 );
-	Image *img = imgNew(w, h, 24);
+	// 16 bit samples, stored most significant byte first, give RGB48 images
+	int sample_size = ( s>255 ? 2 : 1 );
+	Image *img = imgNew(w, h, 24*sample_size);
 	if (img == NULL) {
                 return NULL;
         }
-	img->format = RGB24;
+	img->format = ( sample_size>1 ? RGB48 : RGB24 );
         img->name = strdup(filename);
 	fgetc(fimg);	
-	int i;
-	unsigned char *img_ptr = img->data;
-	for( i=0 ; i<w*h ; i++ ) {
-		img_ptr[2] = fgetc(fimg);
-		//img_ptr[2] =255;
-                img_ptr[1] = fgetc(fimg);
-                img_ptr[0] = fgetc(fimg);
-		img_ptr += pixel_size;
+	int x, y, c;
+	for( y=0 ; y<h ; y++ ) {
+		unsigned char *img_ptr = img->data + y*img->stride;
+		uint16_t *img_ptr16 = (uint16_t *)img_ptr;
+		for( x=0 ; x<w ; x++ ) {
+			for( c=2 ; c>=0 ; c-- ) {
+				if ( sample_size>1 ) {
+					int hi = fgetc(fimg);
+					img_ptr16[c] = hi << 8 | fgetc(fimg);
+				}
+				else img_ptr[c] = fgetc(fimg);
+			}
+			img_ptr += 3;
+			img_ptr16 += 3;
+		}
+	}
+	fclose(fimg);
+	return img;
+}
+
+//! Loads an image from a JPEG image file
+/*!
+ *  Creates a new RGB24 Image using the data read from the specified JPEG image file.
+ *  Only baseline JPEG files are supported.
+ *  Image can then be released by calling imgDestroy() function.
+ *  @param filename the name of the JPEG image file
+ *  @return The address of the new loaded Image
+ */
+Image *imgFromJPEG(const char * filename)
+{
+	FILE *fimg = fopen(filename, "r");
+	if ( fimg==NULL ) {
+		fprintf(stderr, "Failed to open image file '%s'\n", filename);
+		return NULL;
+	}
+	fseek(fimg, 0, SEEK_END);
+	long size = ftell(fimg);
+	rewind(fimg);
+	unsigned char *data = size > 0 ? malloc(size) : NULL;
+	if ( data==NULL || fread(data, 1, size, fimg) != (size_t)size ) {
+		fprintf(stderr, "Failed to read image file '%s'\n", filename);
+		free(data);
+		fclose(fimg);
+		return NULL;
 	}
 	fclose(fimg);
+
+	Image *img = NULL;
+	unsigned int w, h;
+	JpegDecoder *dec = jpegNew();
+	if ( dec && jpegGetSize(dec, data, size, &w, &h)==0 ) {
+		img = imgNew(w, h, 24);
+		if ( img ) {
+			img->format = RGB24;
+			img->name = strdup(filename);
+			if ( jpegDecode(dec, data, size, img, NULL) ) {
+				imgDestroy(img);
+				img = NULL;
+			}
+		}
+	}
+	jpegDestroy(dec);
+	free(data);
 	return img;
 }
 
@@ -172,6 +343,8 @@ Image *imgFromFile(const char *filename) {
 	fType += 1;
 	if ( ! strcmp(fType, "ppm") )	return imgFromPPM(filename);
 	if ( ! strcmp(fType, "bmp") )   return imgFromBitmap(filename);
+	if ( ! strcmp(fType, "jpg") || ! strcmp(fType, "jpeg") )
+		return imgFromJPEG(filename);
 	fprintf(stderr, "Image file type '%s' not supported.\n", fType);
         return NULL;	
 }
@@ -179,12 +352,15 @@ Image *imgFromFile(const char *filename) {
 //! Scales an image
 void imgScale(Image *img, unsigned int sfactor) 
 {
-	int p;
-	unsigned char *c = img->data;
-	for( p=0 ; p<img->width*img->height*img->depth/8 ; p++ ) {
-		int nc = 128+(*c-128)*sfactor;
-		*c = min(nc,255);
-		c++;
+	int p, y;
+	if ( imgMakeWritable(img) ) return;
+	for( y=0 ; y<img->height ; y++ ) {
+		unsigned char *c = img->data + y*img->stride;
+		for( p=0 ; p<img->width*img->depth/8 ; p++ ) {
+			int nc = 128+(*c-128)*sfactor;
+			*c = min(nc,255);
+			c++;
+		}
 	}
 }
 
@@ -198,14 +374,29 @@ void imgScale(Image *img, unsigned int sfactor)
  */
 
 Image *imgCopy(Image * img)
+{
+	return imgCopyEx(img, NULL);
+}
+
+//! Creates a copy of an Image in a pool
+/*!
+ *  Same as imgCopy(), but the copy is taken from @p pool, see imgPoolGet().
+ */
+Image *imgCopyEx(Image * img, ImagePool *pool)
 {
 	// Create a new empty image
-	Image * copy = imgNew(img->width, img->height, img->depth);
+	Image * copy = imgPoolGet(pool, img->width, img->height, img->depth);
+	if ( copy==NULL ) return NULL;
 
 	copy->format = img->format;
+	copy->timestamp = img->timestamp;
+	copy->sequence = img->sequence;
 	
 	// Copy the data between the images
-	memcpy(copy->data, img->data, img->width * img->height * img->depth/8 );
+	int y;
+	for( y=0 ; y<img->height ; y++ )
+		memcpy(copy->data + y*copy->stride, img->data + y*img->stride,
+			img->width * img->depth/8 );
 
 	// return the copy
 	return copy;	
@@ -224,6 +415,15 @@ Image *imgCopy(Image * img)
  *  @return The address of the new cropped Image
  */
 Image *imgCrop(Image *img, int x1, int y1, int x2, int y2)
+{
+	return imgCropEx(img, x1, y1, x2, y2, NULL);
+}
+
+//! Crops an image into a pool
+/*!
+ *  Same as imgCrop(), but the new Image is taken from @p pool, see imgPoolGet().
+ */
+Image *imgCropEx(Image *img, int x1, int y1, int x2, int y2, ImagePool *pool)
 {
 	unsigned width = x2-x1+1;
 	unsigned height = y2-y1+1;
@@ -232,17 +432,202 @@ Image *imgCrop(Image *img, int x1, int y1, int x2, int y2)
 		fprintf(stderr,"Bad image\n");
 		return NULL;
 	}
-	Image *new_img = imgNew(width, height, img->depth);
+	Image *new_img = imgPoolGet(pool, width, height, img->depth);
 	if ( new_img==NULL ) return NULL;
+	new_img->format = img->format;
 	int y;
 	for( y=y1 ; y<=y2 ; y++ )
-		memcpy(	new_img->data+(y-y1)*width*img->depth/8, 
-			img->data+(y*img->width+x1)*img->depth/8,
+		memcpy(	new_img->data+(y-y1)*new_img->stride, 
+			img->data+y*img->stride+x1*img->depth/8,
 			width*img->depth/8 );
 	return new_img;
 
 }
 
+//! Creates a view of an image area
+/*!
+ *  Creates an Image sharing the pixel data of a rectangular area of Image @p img,
+ *  without copying it. Changes made through the view are seen in @p img.
+ *  The view keeps the pixels alive, so it may outlive @p img.
+ *  Release it by calling imgDestroy().
+ *  @param img the parent Image
+ *  @param x1 the column number of first vertex
+ *  @param y1 the row number of first vertex
+ *  @param x2 the column number of second vertex
+ *  @param y2 the row number of second vertex
+ *  @return The address of the new view, or NULL if the area is outside @p img
+ */
+Image *imgView(Image *img, int x1, int y1, int x2, int y2)
+{
+	if ( img==NULL || x1<0 || y1<0 || x2<x1 || y2<y1 ||
+	     x2>=img->width || y2>=img->height ) {
+		fprintf(stderr,"Bad image view\n");
+		return NULL;
+	}
+	Image * view = malloc(sizeof(Image));
+	if(view == NULL){
+		fprintf(stderr, "Failed to allocate memory for image container\n");
+		return NULL;
+	}
+	*view = *img;
+	view->width = x2-x1+1;
+	view->height = y2-y1+1;
+	view->data = img->data + y1*img->stride + x1*img->depth/8;
+	view->name = NULL;
+	view->mem_ptr = NULL;
+	view->pool = NULL;
+	view->flags |= IMG_VIEW;
+	// keeps the parent's pixels alive, without owning them
+	if ( view->block ) __atomic_add_fetch(&view->block->refs, 1, __ATOMIC_RELAXED);
+	return view;
+}
+
+/*
+ * 16 bit and float samples.
+ * GREY16 and RGB48 images hold uint16_t samples, GREY32F and RGB96F images
+ * hold floats, 0 to 1 from black to white. Components keep the RGB24 order.
+ */
+
+// size in bytes of the samples of an image format
+static int imgSampleSize(unsigned int format)
+{
+	switch ( format ) {
+	    case GREY16:
+	    case RGB48:
+		return 2;
+	    case GREY32F:
+	    case RGB96F:
+		return 4;
+	    default:
+		return 1;
+	}
+}
+
+// number of components of an image format
+static int imgFormatChannels(unsigned int format)
+{
+	switch ( format ) {
+	    case GREY:
+	    case GREY16:
+	    case GREY32F:
+		return 1;
+	    case RGBA32:
+		return 4;
+	    default:
+		return 3;
+	}
+}
+
+// component c of pixel x,y, whatever the sample size
+static inline double imgGetSample(Image *img, int ss, unsigned int x, unsigned int y, int c)
+{
+	const unsigned char *p = img->data + y*img->stride;
+	switch ( ss ) {
+	    case 2:
+		return ((const uint16_t *)p)[x*img->depth/16 + c];
+	    case 4:
+		return ((const float *)p)[x*img->depth/32 + c];
+	    default:
+		return p[x*img->depth/8 + c];
+	}
+}
+
+// sum of all components in an area, whatever the sample size
+static double imgSumSamples(Image *img, int x1, int y1, int x2, int y2)
+{
+	int ss = imgSampleSize(img->format);
+	int comp = img->depth/(8*ss);
+	double total = 0.;
+	int x, y, c;
+	for( y=y1 ; y<=y2 ; y++ )
+	for( x=x1 ; x<=x2 ; x++ )
+		for( c=0 ; c<comp ; c++ )
+			total += imgGetSample(img, ss, x, y, c);
+	return total;
+}
+
+// swaps the first and third samples of 3 component pixels
+static void imgSwapRB(unsigned char *row, unsigned int width, int ss)
+{
+	unsigned int x;
+	int b;
+	for ( x=0 ; x<width ; x++, row += 3*ss )
+		for ( b=0 ; b<ss ; b++ ) {
+			unsigned char t = row[b];
+			row[b] = row[2*ss + b];
+			row[2*ss + b] = t;
+		}
+}
+
+//! Converts an image to another sample size
+/*!
+ *  Converts between 8 bit, 16 bit and float images with the same components:
+ *  GREY, GREY16 and GREY32F, or RGB24, BGR24, RGB48 and RGB96F.
+ *  8 bit value v becomes v*257 in 16 bits and v/255 as float. Floats are
+ *  clamped to 0..1 only when converted back to integers, so processing
+ *  chains can run in float without losing precision or clamping at each stage.
+ *  @param img the source Image
+ *  @param format the destination format
+ *  @param res the destination, with matching size and depth, or NULL to create a new Image
+ *  @return The converted Image, or NULL on error
+ */
+Image *imgConvertFormat(Image *img, unsigned int format, Image *res)
+{
+	int sss = imgSampleSize(img->format), dss = imgSampleSize(format);
+	int comp = img->depth/(8*sss);
+	if ( comp != imgFormatChannels(img->format) || comp != imgFormatChannels(format) ) {
+		fprintf(stderr, "imgConvertFormat() error: formats do not match\n");
+		return NULL;
+	}
+	unsigned short depth = comp*8*dss;
+	if ( res==NULL ) {
+		res = imgNew(img->width, img->height, depth);
+		if ( res==NULL ) return NULL;
+	}
+	else if ( res->width!=img->width || res->height!=img->height || res->depth!=depth ) {
+		fprintf(stderr, "imgConvertFormat() error: image does not match\n");
+		return NULL;
+	}
+	if ( imgMakeWritable(res) ) return NULL;
+	res->format = format;
+	res->timestamp = img->timestamp;
+	res->sequence = img->sequence;
+
+	unsigned int n = img->width * comp;
+	unsigned int y;
+	for ( y=0 ; y<img->height ; y++ ) {
+		const unsigned char *in = img->data + y*img->stride;
+		unsigned char *out = res->data + y*res->stride;
+		switch ( sss*10 + dss ) {
+		    case 12: U8_to_U16(in, (uint16_t *)out, n); break;
+		    case 14: U8_to_F32(in, (float *)out, n); break;
+		    case 21: U16_to_U8((const uint16_t *)in, out, n); break;
+		    case 24: U16_to_F32((const uint16_t *)in, (float *)out, n); break;
+		    case 41: F32_to_U8((const float *)in, out, n); break;
+		    case 42: F32_to_U16((const float *)in, (uint16_t *)out, n); break;
+		    default: memcpy(out, in, n*sss);
+		}
+		if ( (img->format==BGR24) != (format==BGR24) )
+			imgSwapRB(out, img->width, dss);
+	}
+	return res;
+}
+
+// SIMD kernels on rows of bytes, see the planar images section
+struct RowKernels {
+	// sum of |a[i]-b[i]|
+	unsigned int (*sad)(const unsigned char *a, const unsigned char *b, unsigned int n);
+	// sum of a[i]
+	unsigned int (*sum)(const unsigned char *a, unsigned int n);
+	// acc[i] += w*src[i]
+	void (*mac)(uint32_t *acc, const unsigned char *src, unsigned char w, unsigned int n);
+	// sum of |a-b| over h rows of n bytes, returned as soon as it exceeds limit
+	uint64_t (*bsad)(const unsigned char *a, unsigned int astride, const unsigned char *b,
+			unsigned int bstride, unsigned int n, unsigned int h, uint64_t limit);
+};
+
+static const struct RowKernels *imgRowKernels(void);
+
 //! Evaluates simmetry error at location
 /*!
  *  Evaluates the simmetry error of an image's square area.
@@ -298,8 +683,8 @@ Image *imgPatternDifference( Image *img, Image *pat, Image *res,
 		int x1, int y1, int x2, int y2)
 {
 	// res = abs(img-pat)
-	// res must have size: x2-x1+, y2-y1+1
-	if ( ! res ) res = imgNew(x2-x1,y2-y1,24);
+	// res must have size: x2-x1+1, y2-y1+1
+	if ( ! res ) res = imgNew(x2-x1+1,y2-y1+1,24);
 	int x, y;
 	for( x=x1 ; x<=x2 ; x++ )
 	for( y=y1 ; y<=y2 ; y++ ) {
@@ -325,26 +710,26 @@ Image *imgPatternDifference( Image *img, Image *pat, Image *res,
 //! Evaluates the addition of pixel components.
 /*!
  *  Evaluates the total addition of all (color) components' values from all pixels within the specified area of the Image @p img.
+ *  For repeated queries on the same image, see imgIntegral().
  *
  *  @param img Image to be processed.
  *  @param x1 the column number of the top left corner of the image area to be processed
  *  @param y1 the row number of the top left corner of the image area to be processed
  *  @param x2 the column number of the bottom right corner of the image area to be processed
  *  @param y2 the row number of the bottom right corner of the image area to be processed
- *  @return The calculated total value as an int 
+ *  @return The calculated total value
  */
-int imgGetSumArea(   Image *img,                     // Image to analyze (where to search)
+long long imgGetSumArea(Image *img,                     // Image to analyze (where to search)
                         int x1, int y1, int x2, int y2) // Rectangular area of img to use
 {
-        int x, y, p;
-        int total = 0;
-        int comp = img->depth/8;
-        for( x=x1 ; x<=x2 ; x++ )
-        for( y=y1 ; y<=y2 ; y++ ) {
-                unsigned char * pix = imgGetPixel(img,x,y);
-                for( p=0 ; p<comp ; p++ )
-                        total += pix[p];
-        }
+        if ( imgSampleSize(img->format)>1 )
+                return imgSumSamples(img, x1, y1, x2, y2);
+        const struct RowKernels *rk = imgRowKernels();
+        const int comp = img->depth/8;
+        long long total = 0;
+        int y;
+        for( y=y1 ; y<=y2 ; y++ )
+                total += rk->sum(img->data + y*img->stride + x1*comp, (x2-x1+1)*comp);
         return total;
 }
 
@@ -362,9 +747,13 @@ int imgGetSumArea(   Image *img,                     // Image to analyze (where
 float imgGetMeanArea(	Image *img, 			// Image to analyze (where to search)
 			int x1, int y1, int x2, int y2) // Rectangular area of img to use
 {
-	int total = imgGetSumArea(img,x1,y1,x2,y2);
+	int ss = imgSampleSize(img->format);
+	if ( ss>1 )
+		return imgSumSamples(img,x1,y1,x2,y2) /
+			( (double)(x2-x1+1) * (y2-y1+1) * (img->depth/(8*ss)) );
+	long long total = imgGetSumArea(img,x1,y1,x2,y2);
 	int comp = img->depth/8;
-	return (float)total / (float)( (x2-x1+1) * (y2-y1+1) * comp );
+	return (double)total / ( (double)(x2-x1+1) * (y2-y1+1) * comp );
 }
 
 //! Evaluates the pixel component mean value.
@@ -375,65 +764,91 @@ float imgGetMeanArea(	Image *img, 			// Image to analyze (where to search)
  *  @return the calculated mean value as a float
  */
 float imgGetMean(Image *img) {
-	return imgGetMeanArea(img, 0, 0, img->width, img->height);
+	return imgGetMeanArea(img, 0, 0, img->width-1, img->height-1);
+}
+
+// clamps a search area to the locations where the pattern fits, false if none is left
+static int imgPatternClip(Image *img, Image *pat, int *x1, int *y1, int *x2, int *y2)
+{
+	*x1 = max(*x1, (int)pat->width/2);
+	*y1 = max(*y1, (int)pat->height/2);
+	*x2 = min(*x2, (int)(img->width - pat->width + pat->width/2));
+	*y2 = min(*y2, (int)(img->height - pat->height + pat->height/2));
+	return *x1<=*x2 && *y1<=*y2;
 }
 
 //! Searches image area for a pattern
 /*!
  *  Searches the full specified area from Image @p img for ocurrences of pattern Image @p pat.
  *  Selectes and informs the location of the best matching pattern.
+ *  The matching error is the sum of absolute differences of all components.
+ *  Candidates are dropped as soon as their partial error exceeds the best one.
+ *  The area is clamped to the locations where the pattern fits the image.
+ *  Of equal errors, the location with the lowest column, then row, is selected.
  *
  *  @param img Image to be searched.
- *  @param pat Image pattern to search for.
+ *  @param pat Image pattern to search for, with the depth of @p img.
  *  @param x1 the column number of the top left corner of the image area to be searched
  *  @param y1 the row number of the top left corner of the image area to be searched
  *  @param x2 the column number of the bottom right corner of the image area
  *  @param y2 the row number of the bottom right corner of the image area to be searched
  *  @param best_x location to store the column number of the selected location.
  *  @param best_y location to store the row number of the selected location.
- *  @return The matching error for the selected location.
+ *  @return The matching error for the selected location, LLONG_MAX if there is none.
  */
-int imgFindPatternArea(	Image *img, 			// Image to analyze (where to search)
+long long imgFindPatternArea(	Image *img, 			// Image to analyze (where to search)
 			Image *pat, 			// Pattern Image to find (what to search)
 			int x1, int y1, int x2, int y2, // Rectangular area of img to use
 			int *best_x, int *best_y) 	// Pixel location in img with best match
 {
-	int best_val = 99999;
+	uint64_t best_val = LLONG_MAX;
 	*best_x = *best_y = -1;
+	if ( img->depth!=pat->depth || imgSampleSize(img->format)>1 || imgSampleSize(pat->format)>1 ) {
+		fprintf(stderr, "imgFindPatternArea() error: pattern does not match the image\n");
+		return best_val;
+	}
+	if ( ! imgPatternClip(img, pat, &x1, &y1, &x2, &y2) ) return best_val;
+	const int comp = img->depth/8;
+	const unsigned int n = pat->width*comp;
+	#ifdef AGC_LOCAL
+	// window sums for the gain control, in constant time
+	IntegralImage *ii = imgIntegral(img, 0, NULL);
+	if ( ii==NULL ) return best_val;
+	#else
+	const struct RowKernels *rk = imgRowKernels();
+	#endif
 	int x, y;
-	for( x=x1 ; x<=x2 ; x++ )
-	for( y=y1 ; y<=y2 ; y++ ) {
-		unsigned char * pix;
-		int diff = 0;
-		int xi, yi;
-		float scalef = 1.0;
-		unsigned char * pat_pix;
+	for( y=y1 ; y<=y2 ; y++ )
+	for( x=x1 ; x<=x2 ; x++ ) {
+		const unsigned char *pix = img->data + (y-pat->height/2)*img->stride
+						+ (x-pat->width/2)*comp;
+		uint64_t diff;
 		#ifdef AGC_LOCAL
 		// Use Local Automaic Gain Control
-		int sum = 0;
-                for( xi=0 ; xi<pat->width ; xi++ )
-                for( yi=0 ; yi<pat->height ; yi++ ) {
-                        pix = imgGetPixel(img, x+xi-pat->width/2, y+yi-pat->height/2);
-                        sum += pix[0] + pix[1] + pix[2];
-                }
-		scalef = 384.*pat->width*pat->height/(float)sum;
-		#endif
-		for( xi=0 ; xi<pat->width ; xi++ )
-                for( yi=0 ; yi<pat->height ; yi++ ) {
-			pix = imgGetPixel(img, 
-				x+xi-pat->width/2, 
-				y+yi-pat->height/2);
-			pat_pix = imgGetPixel(pat, xi, yi);
-			diff += abs(pix[0]-(int)(pat_pix[0]*scalef));
-			diff += abs(pix[1]-(int)(pat_pix[1]*scalef));	
-			diff += abs(pix[2]-(int)(pat_pix[2]*scalef));
+		int x0 = x-pat->width/2, y0 = y-pat->height/2, c;
+		unsigned int xi, yi;
+		long long sum = 0;
+		for( c=0 ; c<3 ; c++ )
+			sum += imgIntegralSum(ii, x0, y0, x0+pat->width-1, y0+pat->height-1, c);
+		float scalef = 384.*pat->width*pat->height/(float)sum;
+		diff = 0;
+		for( yi=0 ; yi<pat->height && diff<=best_val ; yi++ ) {
+			const unsigned char *p = pix + yi*img->stride, *q = pat->data + yi*pat->stride;
+			for( xi=0 ; xi<n ; xi++ )
+				diff += abs(p[xi]-(int)(q[xi]*scalef));
 		}
-		if (diff<best_val) {
+		#else
+		diff = rk->bsad(pix, img->stride, pat->data, pat->stride, n, pat->height, best_val);
+		#endif
+		if ( diff<best_val || ( diff==best_val && x<*best_x ) ) {
 			best_val = diff;
 			*best_x = x;
 			*best_y = y;
 		}
 	}
+	#ifdef AGC_LOCAL
+	imgIntegralDestroy(ii);
+	#endif
 	// Return minimum difference found
 	return best_val;
 }
@@ -449,7 +864,7 @@ int imgFindPatternArea(	Image *img, 			// Image to analyze (where to search)
  *  @param best_y location to store the row number of the selected location.
  *  @return The matching error for the selected location.
  */
-int imgFindPattern(Image *img, Image *pat, int *best_x, int *best_y)
+long long imgFindPattern(Image *img, Image *pat, int *best_x, int *best_y)
 {
 	return imgFindPatternArea(img, pat, 
 		pat->width/2, pat->height/2, 
@@ -457,10 +872,230 @@ int imgFindPattern(Image *img, Image *pat, int *best_x, int *best_y)
 		best_x, best_y);
 }
 
+/*
+ * Pyramid pattern search.
+ * The image and the pattern are halved levels-1 times by 2x2 averaging.
+ * Every location is tried at the coarsest level only, with the pattern
+ * shifted by up to PYR_MAX_PHASES phases along each axis, so that a match
+ * at any position lines up with the coarse pixel grid in one of them.
+ * The best local minima found there are moved to the next finer level and
+ * refined in a small window around their projection, down to full resolution.
+ */
+#define PYR_MAX_LEVELS		8
+#define PYR_MIN_PATTERN		8	// smallest pattern side at the coarsest level
+#define PYR_RADIUS		2	// refinement window, in pixels each way
+#define PYR_MAX_CANDIDATES	64
+#define PYR_MAX_PHASES		4	// pattern shifts per axis at the coarsest level
+
+struct PyrCand {
+	int x, y;
+	int phase;		// pattern shift, index in the pyramids of the pattern
+	uint64_t err;
+};
+
+// 2x2 mean of an 8 bit Image
+static Image *imgHalve(Image *img)
+{
+	const int comp = img->depth/8;
+	Image *res = imgNew(img->width/2, img->height/2, img->depth);
+	if ( ! res ) return NULL;
+	res->format = img->format;
+	unsigned int x, y;
+	int c;
+	for ( y=0 ; y<res->height ; y++ ) {
+		const unsigned char *r0 = img->data + 2*y*img->stride, *r1 = r0 + img->stride;
+		unsigned char *out = res->data + y*res->stride;
+		for ( x=0 ; x<res->width ; x++, r0+=2*comp, r1+=2*comp, out+=comp )
+			for ( c=0 ; c<comp ; c++ )
+				out[c] = (r0[c] + r0[c+comp] + r1[c] + r1[c+comp] + 2) >> 2;
+	}
+	return res;
+}
+
+// sum of absolute differences of all samples, pattern centered at x,y, or more than limit
+static uint64_t imgPatternSAD(const struct RowKernels *rk, Image *img, Image *pat, int x, int y,
+			uint64_t limit)
+{
+	const int comp = img->depth/8;
+	const unsigned char *p = img->data + (y - pat->height/2)*img->stride + (x - pat->width/2)*comp;
+	return rk->bsad(p, img->stride, pat->data, pat->stride, pat->width*comp, pat->height, limit);
+}
+
+// inserts a location in the list of the n best, sorted by error, once
+static void imgPyrKeep(struct PyrCand *best, int *n, int k, int x, int y, int phase, uint64_t err)
+{
+	int i;
+	if ( *n==k && err>=best[k-1].err ) return;
+	for ( i=0 ; i<*n ; i++ )
+		if ( best[i].x==x && best[i].y==y && best[i].phase==phase ) return;
+	i = *n<k ? (*n)++ : k-1;
+	for ( ; i>0 && best[i-1].err>err ; i-- )
+		best[i] = best[i-1];
+	best[i].x = x;
+	best[i].y = y;
+	best[i].phase = phase;
+	best[i].err = err;
+}
+
+// adds the local minima of the errors of pattern pat over area ax1..ax2, ay1..ay2 of img
+static int imgPyrMinima(const struct RowKernels *rk, Image *img, Image *pat,
+			int ax1, int ay1, int ax2, int ay2, int phase,
+			struct PyrCand *cand, int *n, int k)
+{
+	const int mw = ax2-ax1+1, mh = ay2-ay1+1;
+	uint64_t *map = malloc((size_t)mw*mh*sizeof(uint64_t));
+	if ( map==NULL ) {
+		fprintf(stderr, "imgFindPatternPyramid() error: out of memory\n");
+		return 1;
+	}
+	int x, y, dx, dy;
+	for ( y=0 ; y<=mh ; y++ ) {
+		// errors stop early above the worst candidate: the limit only drops, so
+		// such a partial sum still exceeds the error of any later candidate
+		for ( x=0 ; y<mh && x<mw ; x++ )
+			map[y*mw + x] = imgPatternSAD(rk, img, pat, ax1+x, ay1+y,
+							*n==k ? cand[k-1].err : UINT64_MAX);
+		// the row above has all its neighbours now
+		const int r = y-1;
+		for ( x=0 ; r>=0 && x<mw ; x++ ) {
+			const uint64_t err = map[r*mw + x];
+			int is_min = 1;
+			// on plateaus only the first location, in scan order, is kept
+			for ( dy=max(0, r-1) ; is_min && dy<=min(mh-1, r+1) ; dy++ )
+				for ( dx=max(0, x-1) ; is_min && dx<=min(mw-1, x+1) ; dx++ )
+					is_min = map[dy*mw + dx]>err || (map[dy*mw + dx]==err && dy*mw+dx>=r*mw+x);
+			if ( is_min )
+				imgPyrKeep(cand, n, k, ax1+x, ay1+r, phase, err);
+		}
+	}
+	free(map);
+	return 0;
+}
+
+//! Searches image area for a pattern, coarse to fine
+/*!
+ *  Same purpose as imgFindPatternArea(), much faster on large areas and patterns.
+ *  The search is exhaustive on an image and pattern reduced @p levels-1 times
+ *  by half, for several shifts of the pattern. The @p candidates best local
+ *  minima found there are then refined at each finer level. The error is the
+ *  sum of absolute differences of all samples, at full resolution.
+ *  Levels are reduced while the coarsest pattern would be smaller than 8 pixels.
+ *  With fewer than 3 levels left, imgFindPatternArea() is used instead.
+ *  The area is clamped to the locations where the pattern fits the image.
+ *
+ *  The result is usually the location found by imgFindPatternArea(), but it
+ *  is not guaranteed: on images with repetitive texture the best location may
+ *  not rank among the coarse candidates. More candidates and fewer levels
+ *  make this less likely.
+ *
+ *  @param img Image to be searched.
+ *  @param pat Image pattern to search for, with the depth of @p img.
+ *  @param x1 the column number of the top left corner of the image area to be searched
+ *  @param y1 the row number of the top left corner of the image area to be searched
+ *  @param x2 the column number of the bottom right corner of the image area
+ *  @param y2 the row number of the bottom right corner of the image area to be searched
+ *  @param levels the number of pyramid levels, 1 or 2 for an exhaustive search
+ *  @param candidates the number of locations refined from the coarsest level, up to 64
+ *  @param best_x location to store the column number of the selected location.
+ *  @param best_y location to store the row number of the selected location.
+ *  @return The matching error for the selected location, LLONG_MAX if there is none.
+ */
+long long imgFindPatternPyramid(Image *img, Image *pat, int x1, int y1, int x2, int y2,
+			int levels, int candidates, int *best_x, int *best_y)
+{
+	*best_x = *best_y = -1;
+	if ( img->depth!=pat->depth || imgSampleSize(img->format)>1 || imgSampleSize(pat->format)>1 ) {
+		fprintf(stderr, "imgFindPatternPyramid() error: pattern does not match the image\n");
+		return LLONG_MAX;
+	}
+	candidates = max(1, min(candidates, PYR_MAX_CANDIDATES));
+	levels = max(1, min(levels, PYR_MAX_LEVELS));
+	while ( levels>1 && ( (pat->width >> (levels-1)) < PYR_MIN_PATTERN
+			|| (pat->height >> (levels-1)) < PYR_MIN_PATTERN ) )
+		levels--;
+	// with one halving, the shifted patterns cost as much as the full search
+	if ( levels<3 ) return imgFindPatternArea(img, pat, x1, y1, x2, y2, best_x, best_y);
+
+	// shifts of the pattern, in full resolution pixels
+	const int scale = 1 << (levels-1);
+	const int n_shifts = min(scale, PYR_MAX_PHASES);
+	const int step = scale / n_shifts;
+	const int n_phases = n_shifts * n_shifts;
+
+	Image *im[PYR_MAX_LEVELS], *pt[PYR_MAX_PHASES*PYR_MAX_PHASES][PYR_MAX_LEVELS] = { { NULL } };
+	int l, p, ok = 1;
+	im[0] = img;
+	for ( l=1 ; l<levels ; l++ ) {
+		im[l] = ok ? imgHalve(im[l-1]) : NULL;
+		ok = im[l]!=NULL;
+	}
+	for ( p=0 ; ok && p<n_phases ; p++ ) {
+		pt[p][0] = p==0 ? pat : imgView(pat, p%n_shifts*step, p/n_shifts*step,
+						pat->width-1, pat->height-1);
+		for ( l=1 ; pt[p][l-1] && l<levels ; l++ )
+			pt[p][l] = imgHalve(pt[p][l-1]);
+		ok = pt[p][levels-1]!=NULL;
+	}
+
+	const struct RowKernels *rk = imgRowKernels();
+	struct PyrCand cand[PYR_MAX_CANDIDATES], next[PYR_MAX_CANDIDATES];
+	int n = 0, i, x, y, ax1, ay1, ax2, ay2;
+	l = levels-1;
+	for ( p=0 ; ok && p<n_phases ; p++ ) {
+		ax1 = x1>>l, ay1 = y1>>l, ax2 = x2>>l, ay2 = y2>>l;
+		if ( imgPatternClip(im[l], pt[p][l], &ax1, &ay1, &ax2, &ay2) )
+			ok = ! imgPyrMinima(rk, im[l], pt[p][l], ax1, ay1, ax2, ay2, p, cand, &n, candidates);
+	}
+	if ( ! ok ) n = 0;
+	for ( l=levels-2 ; l>=0 && n>0 ; l-- ) {
+		int nn = 0;
+		for ( i=0 ; i<n ; i++ ) {
+			p = cand[i].phase;
+			Image *fine = pt[p][l], *coarse = pt[p][l+1];
+			// projection of the coarse pattern center
+			int cx = 2*cand[i].x + fine->width/2 - 2*(coarse->width/2);
+			int cy = 2*cand[i].y + fine->height/2 - 2*(coarse->height/2);
+			if ( l==0 ) {
+				// from the shifted pattern back to the whole one
+				cx += pat->width/2 - fine->width/2 - p%n_shifts*step;
+				cy += pat->height/2 - fine->height/2 - p/n_shifts*step;
+				fine = pat;
+				p = 0;
+			}
+			ax1 = x1>>l, ay1 = y1>>l, ax2 = x2>>l, ay2 = y2>>l;
+			if ( ! imgPatternClip(im[l], fine, &ax1, &ay1, &ax2, &ay2) ) continue;
+			struct PyrCand b = { -1, -1, p, UINT64_MAX };
+			for ( y=max(ay1, cy-PYR_RADIUS) ; y<=min(ay2, cy+PYR_RADIUS) ; y++ )
+				for ( x=max(ax1, cx-PYR_RADIUS) ; x<=min(ax2, cx+PYR_RADIUS) ; x++ ) {
+					uint64_t err = imgPatternSAD(rk, im[l], fine, x, y, b.err);
+					if ( err<b.err || b.x<0 ) {
+						b.x = x;
+						b.y = y;
+						b.err = err;
+					}
+				}
+			if ( b.x>=0 )
+				imgPyrKeep(next, &nn, candidates, b.x, b.y, b.phase, b.err);
+		}
+		memcpy(cand, next, nn*sizeof(struct PyrCand));
+		n = nn;
+	}
+	for ( l=1 ; l<levels ; l++ )
+		if ( im[l] ) imgDestroy(im[l]);
+	for ( p=0 ; p<n_phases ; p++ )
+		for ( l=0 ; l<levels ; l++ )
+			if ( pt[p][l] && pt[p][l]!=pat ) imgDestroy(pt[p][l]);
+	if ( n==0 ) return LLONG_MAX;
+	*best_x = cand[0].x;
+	*best_y = cand[0].y;
+	return cand[0].err;
+}
+
 
 void imgMakeSymmetricX(Image *img)
 {
 	int x, y, r;
+	if ( imgMakeWritable(img) ) return;
 	for( y=0 ; y<img->height ; y++ ) 
 		for( x=0, r=img->width-1 ; x<r ; x++, r-- ) {
 			unsigned char *p1, *p2;
@@ -475,6 +1110,7 @@ void imgMakeSymmetricX(Image *img)
 void imgMakeSymmetricY(Image *img)
 {
         int x, y, r;
+        if ( imgMakeWritable(img) ) return;
         for( y=0 , r=img->height-1 ; y<r ; y++, r-- )
                 for( x=0 ; x<img->width ; x++ ) {
                         unsigned char *p1, *p2;
@@ -520,8 +1156,9 @@ unsigned int imgGetHeight(Image * img)
 
 void imgSetPixel(Image * img, unsigned int x, unsigned int y, unsigned char *pdata)
 {
+    if ( imgMakeWritable(img) ) return;
     // calculate the offset into the image array
-    uint32_t offset = img->depth/8 * (x + (y * img->width));
+    uint32_t offset = y * img->stride + x * img->depth/8;
     register int c;
     for( c=0 ; c<img->depth/8 ; c++ )
 	img->data[offset+c] = pdata[c];
@@ -530,8 +1167,9 @@ void imgSetPixel(Image * img, unsigned int x, unsigned int y, unsigned char *pda
 
 void imgSetPixelRGB(Image * img, unsigned int x, unsigned int y, unsigned char r, unsigned char g, unsigned char b)
 {
+    if ( imgMakeWritable(img) ) return;
     // calculate the offset into the image array
-    uint32_t offset = img->depth/8 * (x + (y * img->width));
+    uint32_t offset = y * img->stride + x * img->depth/8;
     if ( img->depth>=24 ) {
 	// set the rgb value
 	if ( img->format==BGR24 ) {
@@ -553,8 +1191,9 @@ void imgSetPixelRGB(Image * img, unsigned int x, unsigned int y, unsigned char r
 void imgSetPixelRGBA(Image * img, unsigned int x, unsigned int y, 
 		unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
+    if ( imgMakeWritable(img) ) return;
     // calculate the offset into the image array
-    uint32_t offset = img->depth/8 * (x + (y * img->width));
+    uint32_t offset = y * img->stride + x * img->depth/8;
     if ( img->depth>=24 ) {
 	// set the rgb value
 	switch ( img->format ) {
@@ -579,7 +1218,6 @@ void imgSetPixelRGBA(Image * img, unsigned int x, unsigned int y,
 	}
     }
     else {	// 8 bit/pixel
-	uint32_t offset = x + (y * img->width);
 	img->data[offset] = (r+g+b)/3;
     }
 }
@@ -593,7 +1231,7 @@ void imgSetPixelRGBA(Image * img, unsigned int x, unsigned int y,
  */
 unsigned char *imgGetPixel(Image * img, unsigned int x, unsigned int y)
 {
-	uint32_t offset = img->depth/8 * (x + (y * img->width));
+	uint32_t offset = y * img->stride + x * img->depth/8;
 	return (unsigned char *)(img->data + offset);
 }
 
@@ -602,105 +1240,1778 @@ int imgGetPixelDifference(unsigned char *p1, unsigned char *p2)
 	return abs(p1[0]-p2[0]) + abs(p1[1]-p2[1]) + abs(p1[2]-p2[2]);
 }
 
-//! Image convolution
-/*! Performs a convolution beteween Image @p img1 and Image @p img2.
- *  Convolution result is stored in preallocated Image @p res. 
- *  Image @p res should have dimensions and depth matching Image @p img1.
- *  If @p res equals NULL, a new Image is allocated.
- *  Implementation is optimized for @p img1 larger than @p img2.
- *  This is usually adequated for processing Image @p img1 through kernel Image @p img2.
- *  Image @p img2 should have odd dimensions.
- *  Image @p img2 must use a pixel depth of 8 bits or the same pixel depth as Image @p img1.
- *  @param img Location of Image structure
- *  @param x Number of pixel columns 
- *  @param y Number of pixel rows 
- *  @return The convolution resulting Image.
- */
-Image * imgConvolution(Image *img1, Image *img2, Image *res)
+// imgConvolution() for 16 bit and float images or kernels, accumulating in double.
+// Float results are not clamped, 16 bit results are rounded.
+static Image *imgConvolutionWide(Image *img1, Image *img2, Image *res)
 {
-	float mean = imgGetMean(img2);
-	unsigned long fscale = mean * img2->width * img2->height;
+	const int ss1 = imgSampleSize(img1->format), ss2 = imgSampleSize(img2->format);
+	const int comp = img1->depth/(8*ss1);
+	const int kcomp = img2->depth/(8*ss2);
+	double fscale = imgGetMean(img2) * img2->width * img2->height;
 	if ( ! res ) {
 	    res = imgNew(img1->width, img1->height, img1->depth);
+	    if ( ! res ) return NULL;
 	    res->format = img1->format;
 	}
-	int x1, y1, x2, y2;
+	if ( imgMakeWritable(res) ) return res;
+	const int ssr = imgSampleSize(res->format);
 	const int xc = img2->width / 2;
 	const int yc = img2->height / 2;
-	for( x1=0 ; x1<img1->width ; x1++ )
+	int x1, y1, x2, y2, c;
+	double acc[comp];
 	for( y1=0 ; y1<img1->height ; y1++ ) {
-	    unsigned long acc[img1->depth/8];
-	    register int c;
-	    for( c=0 ; c<img1->depth/8 ; c++ )
-		acc[c] = 0L;
-	    for( x2=0 ; x2<img2->width ; x2++ ) {
-		register int xx = x1+x2-xc;
-		if ( xx<0 || xx>=img1->width ) continue;
-	    	for( y2=0 ; y2<img2->height ; y2++ ) {
-		    register int yy = y1+y2-yc;
+	    unsigned char *out = res->data + y1*res->stride;
+	    for( x1=0 ; x1<img1->width ; x1++ ) {
+		for( c=0 ; c<comp ; c++ )
+		    acc[c] = 0.;
+		for( y2=0 ; y2<img2->height ; y2++ ) {
+		    int yy = y1+y2-yc;
 		    if ( yy<0 || yy>=img1->height ) continue;
-		    unsigned char *pix1 = imgGetPixel(img1,xx,yy);
-		    unsigned char *pix2 = imgGetPixel(img2,x2,y2);
-	    	    for( c=0 ; c<img1->depth/8 ; c++ ) 
-			if ( img2->depth <= 8 )
-			    acc[c] += pix1[c] * pix2[0];
-		    	else
-		    	    acc[c] += pix1[c] * pix2[c];
-	    	}
-	    }
-	    unsigned char rpix[img1->depth/8];
-	    for( c=0 ; c<img1->depth/8 ; c++ ) {
-		unsigned long accs = acc[c]/fscale;
-		if ( accs>255 )	accs = 255;
-                rpix[c] = accs;
+		    for( x2=0 ; x2<img2->width ; x2++ ) {
+			int xx = x1+x2-xc;
+			if ( xx<0 || xx>=img1->width ) continue;
+			for( c=0 ; c<comp ; c++ )
+			    acc[c] += imgGetSample(img1, ss1, xx, yy, c) *
+				      imgGetSample(img2, ss2, x2, y2, kcomp>1 ? c : 0);
+		    }
+		}
+		for( c=0 ; c<comp ; c++ ) {
+		    double v = acc[c]/fscale;
+		    unsigned int i = x1*comp + c;
+		    if ( ssr==4 )
+			((float *)out)[i] = v;
+		    else if ( ssr==2 )
+			((uint16_t *)out)[i] = v<0. ? 0 : v>65535. ? 65535 : lrint(v);
+		    else
+			out[i] = v<0. ? 0 : v>255. ? 255 : (unsigned char)v;
+		}
 	    }
-	    imgSetPixel(res,x1,y1,rpix);
 	}
 	return res;
 }
 
-Image *imgCreateGaussian(int dim, float sig)
-{
-    //const float sig = 40.;
-    if ( sig<=0.f ) sig = (float)dim/5.;
-    Image *k = imgNew(dim,dim,8);
-    //k->format = RGB24;
-    k->format = GREY;
-    int x,y;
-    const int dc = dim/2;
-    for( x=0 ; x<=dc ; x++ )
-    for( y=0 ; y<=dc ; y++ ) {
-	float xf = x-dc;
-	float yf = y-dc;
-	float kf = exp(-(xf*xf+yf*yf)/(2.*sig*sig));
-	unsigned char kv = kf*255.;
-	//printf("%d %d: %u\n",x,y,kv);
-	//unsigned char kvv[3] = { kv, kv, kv };
-	unsigned char kvv[3] = { kv };
-	imgSetPixel(k,x,y,kvv);
-	imgSetPixel(k,x,dim-y-1,kvv);
-	imgSetPixel(k,dim-x-1,y,kvv);
-	imgSetPixel(k,dim-x-1,dim-y-1,kvv);
-    }
-    return k;
-}
+/*
+ * 2-D convolution engine.
+ * The source is copied once into a zero padded buffer of 16 bit samples.
+ * Output is computed row by row over column tiles of CONV_TILE samples, so
+ * the accumulators and the kernel height rows being read stay in L1 cache
+ * while consecutive rows reuse them. Inner loops accumulate 8 samples in
+ * registers over all kernel taps, with specialised 3x3 and 5x5 versions.
+ */
+#define CONV_TILE	512
 
-//! Destroys the image
+// kernel taps from which imgConvolution() switches to fftConvolution()
+#define CONV_FFT_TAPS		441	// kernel shared by all components
+#define CONV_FFT_TAPS_COMP	49	// one kernel per component
+
+typedef void (*conv_fn)(const int16_t **rows, int32_t *acc, unsigned int n, unsigned int first,
+			const int16_t *kern, int kw, int kh, int kcomp, int step);
+
+// acc[k] = sum of kern[ky][kx] * rows[ky][k + kx*step], with a kernel per component
+// when kcomp>1; first is the sample number of rows[ky][0] in the image row
+static void imgConvChunk_scalar(const int16_t **rows, int32_t *acc, unsigned int n, unsigned int first,
+			const int16_t *kern, int kw, int kh, int kcomp, int step)
+{
+	unsigned int k;
+	int kx, ky;
+	for ( k=0 ; k<n ; k++ ) {
+		const int16_t *w = kern + (kcomp>1 ? (first+k) % kcomp : 0);
+		int32_t sum = 0;
+		for ( ky=0 ; ky<kh ; ky++ )
+			for ( kx=0 ; kx<kw ; kx++ )
+				sum += w[(ky*kw + kx)*kcomp] * rows[ky][k + kx*step];
+		acc[k] = sum;
+	}
+}
+
+#ifdef IMG_X86
+
+__attribute__((target("sse2"), always_inline))
+static inline void imgConvChunk_sse2_k(const int16_t **rows, int32_t *acc, unsigned int n,
+			const __m128i *wp, const int kw, const int kh, const int step)
+{
+	unsigned int k;
+	int kx, ky;
+	for ( k=0 ; k+8<=n ; k+=8 ) {
+		__m128i lo = _mm_setzero_si128(), hi = lo;
+		const __m128i *w = wp;
+		for ( ky=0 ; ky<kh ; ky++ ) {
+			const int16_t *r = rows[ky] + k;
+			for ( kx=0 ; kx<kw ; kx+=2, w++ ) {
+				__m128i a = _mm_loadu_si128((const __m128i *)(r + kx*step));
+				__m128i b = kx+1<kw ? _mm_loadu_si128((const __m128i *)(r + (kx+1)*step)) : a;
+				lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), *w));
+				hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), *w));
+			}
+		}
+		_mm_storeu_si128((__m128i *)(acc + k), lo);
+		_mm_storeu_si128((__m128i *)(acc + k + 4), hi);
+	}
+}
+
+__attribute__((target("sse2")))
+static void imgConvChunk_sse2(const int16_t **rows, int32_t *acc, unsigned int n, unsigned int first,
+			const int16_t *kern, int kw, int kh, int kcomp, int step)
+{
+	// weights kx and kx+1 of each kernel row in the halves of 32 bit lanes, for pmaddwd
+	const int pairs = (kw+1)/2;
+	__m128i wp[kh*pairs];
+	int kx, ky;
+	for ( ky=0 ; ky<kh ; ky++ )
+		for ( kx=0 ; kx<kw ; kx+=2 ) {
+			int hi = kx+1<kw ? kern[ky*kw + kx+1] : 0;
+			wp[ky*pairs + kx/2] = _mm_set1_epi32((uint16_t)kern[ky*kw + kx] | (uint32_t)(uint16_t)hi << 16);
+		}
+	if ( kw==3 && kh==3 )
+		imgConvChunk_sse2_k(rows, acc, n, wp, 3, 3, step);
+	else if ( kw==5 && kh==5 )
+		imgConvChunk_sse2_k(rows, acc, n, wp, 5, 5, step);
+	else
+		imgConvChunk_sse2_k(rows, acc, n, wp, kw, kh, step);
+	unsigned int k = n & ~7u;
+	const int16_t *tail[kh];
+	for ( ky=0 ; ky<kh ; ky++ )
+		tail[ky] = rows[ky] + k;
+	imgConvChunk_scalar(tail, acc + k, n - k, first + k, kern, kw, kh, 1, step);
+}
+
+#endif // IMG_X86
+
+#ifdef IMG_NEON
+
+__attribute__((always_inline))
+static inline void imgConvChunk_neon_k(const int16_t **rows, int32_t *acc, unsigned int n,
+			const int16_t *kern, const int kw, const int kh, const int step)
+{
+	unsigned int k;
+	int kx, ky;
+	for ( k=0 ; k+8<=n ; k+=8 ) {
+		int32x4_t lo = vdupq_n_s32(0), hi = lo;
+		for ( ky=0 ; ky<kh ; ky++ ) {
+			const int16_t *r = rows[ky] + k;
+			for ( kx=0 ; kx<kw ; kx++ ) {
+				int16x8_t a = vld1q_s16(r + kx*step);
+				lo = vmlal_n_s16(lo, vget_low_s16(a), kern[ky*kw + kx]);
+				hi = vmlal_n_s16(hi, vget_high_s16(a), kern[ky*kw + kx]);
+			}
+		}
+		vst1q_s32(acc + k, lo);
+		vst1q_s32(acc + k + 4, hi);
+	}
+}
+
+static void imgConvChunk_neon(const int16_t **rows, int32_t *acc, unsigned int n, unsigned int first,
+			const int16_t *kern, int kw, int kh, int kcomp, int step)
+{
+	if ( kw==3 && kh==3 )
+		imgConvChunk_neon_k(rows, acc, n, kern, 3, 3, step);
+	else if ( kw==5 && kh==5 )
+		imgConvChunk_neon_k(rows, acc, n, kern, 5, 5, step);
+	else
+		imgConvChunk_neon_k(rows, acc, n, kern, kw, kh, step);
+	unsigned int k = n & ~7u;
+	const int16_t *tail[kh];
+	int ky;
+	for ( ky=0 ; ky<kh ; ky++ )
+		tail[ky] = rows[ky] + k;
+	imgConvChunk_scalar(tail, acc + k, n - k, first + k, kern, kw, kh, 1, step);
+}
+
+#endif // IMG_NEON
+
+// convolution of an 8 bit image: clamp(sum/divisor + bias) per sample, samples
+// outside the image counting as zero. kern has kcomp weights per tap.
+static Image *imgConvEngine(Image *img, const int16_t *kern, int kw, int kh, int kcomp,
+			int divisor, int bias, Image *res)
+{
+	conv_fn chunk = imgConvChunk_scalar;
+	if ( kcomp==1 ) {
+#if defined(IMG_X86)
+		if ( __builtin_cpu_supports("sse2") ) chunk = imgConvChunk_sse2;
+#elif defined(IMG_NEON)
+		chunk = imgConvChunk_neon;
+#endif
+	}
+	if ( ! res ) {
+		res = imgNew(img->width, img->height, img->depth);
+		if ( ! res ) return NULL;
+		res->format = img->format;
+	}
+	if ( imgMakeWritable(res) ) return NULL;
+
+	const int comp = img->depth/8;
+	const int xc = kw/2, yc = kh/2;
+	const unsigned int n = img->width*comp;
+	// padded rows, with slack for vector loads past the last tap
+	const size_t pstride = (img->width + 2*xc)*comp + 8;
+	int16_t *pad = calloc(pstride * (img->height + 2*yc), sizeof(int16_t));
+	int32_t *acc = malloc(CONV_TILE * sizeof(int32_t));
+	if ( pad==NULL || acc==NULL ) {
+		fprintf(stderr, "Failed to allocate memory for convolution\n");
+		free(pad);
+		free(acc);
+		return NULL;
+	}
+	unsigned int x0, k;
+	int y, ky;
+	for ( y=0 ; y<img->height ; y++ ) {
+		const unsigned char *row = img->data + y*img->stride;
+		int16_t *prow = pad + (y+yc)*pstride + xc*comp;
+		for ( k=0 ; k<n ; k++ )
+			prow[k] = row[k];
+	}
+	const int16_t *rows[kh];
+	for ( x0=0 ; x0<n ; x0+=CONV_TILE ) {
+		unsigned int cn = min(CONV_TILE, n-x0);
+		for ( y=0 ; y<img->height ; y++ ) {
+			for ( ky=0 ; ky<kh ; ky++ )
+				rows[ky] = pad + (y+ky)*pstride + x0;
+			chunk(rows, acc, cn, x0, kern, kw, kh, kcomp, comp);
+			unsigned char *out = res->data + y*res->stride + x0;
+			for ( k=0 ; k<cn ; k++ ) {
+				int v = acc[k]/divisor + bias;
+				out[k] = v<0 ? 0 : v>255 ? 255 : v;
+			}
+		}
+	}
+	free(pad);
+	free(acc);
+	return res;
+}
+
+//! Image convolution
+/*! Performs a convolution beteween Image @p img1 and Image @p img2.
+ *  Convolution result is stored in preallocated Image @p res. 
+ *  Image @p res should have dimensions and depth matching Image @p img1.
+ *  If @p res equals NULL, a new Image is allocated.
+ *  In processing loops, @p res may be taken from an ImagePool with imgPoolGet().
+ *  Implementation is optimized for @p img1 larger than @p img2.
+ *  This is usually adequated for processing Image @p img1 through kernel Image @p img2.
+ *  8 bit images are processed in cache sized tiles with SIMD inner loops,
+ *  or with fftConvolution() for large kernels, with the same result.
+ *  Image @p img2 should have odd dimensions.
+ *  Image @p img2 must use a pixel depth of 8 bits or the same pixel depth as Image @p img1.
+ *  16 bit and float images, or kernels, are accumulated in double precision:
+ *  float results are not clamped, so filters can be chained without losing precision.
+ *  @param img Location of Image structure
+ *  @param x Number of pixel columns 
+ *  @param y Number of pixel rows 
+ *  @return The convolution resulting Image.
+ */
+Image * imgConvolution(Image *img1, Image *img2, Image *res)
+{
+	if ( imgSampleSize(img1->format)>1 || imgSampleSize(img2->format)>1 )
+		return imgConvolutionWide(img1, img2, res);
+	float mean = imgGetMean(img2);
+	unsigned long fscale = mean * img2->width * img2->height;
+	const int comp = img1->depth/8;
+	const int kcomp = img2->depth <= 8 ? 1 : comp;
+	if ( img2->depth > 8 && img2->depth != img1->depth ) {
+		fprintf(stderr, "Convolution kernel depth does not match the image\n");
+		return NULL;
+	}
+	if ( fscale==0 || fscale>INT_MAX ) {
+		fprintf(stderr, "Bad convolution kernel\n");
+		return NULL;
+	}
+	// large kernels are faster in the frequency domain
+	if ( img2->width * img2->height >= (kcomp>1 ? CONV_FFT_TAPS_COMP : CONV_FFT_TAPS) ) {
+		FFTKernel *fk = fftKernelNew(img2, 0);
+		if ( fk ) {
+			res = fftConvolution(img1, fk, res);
+			fftKernelDestroy(fk);
+			return res;
+		}
+	}
+	int16_t *kern = malloc(img2->width * img2->height * kcomp * sizeof(int16_t));
+	if ( kern==NULL ) {
+		fprintf(stderr, "Failed to allocate memory for convolution\n");
+		return NULL;
+	}
+	int x2, y2, c;
+	for( y2=0 ; y2<img2->height ; y2++ )
+	for( x2=0 ; x2<img2->width ; x2++ )
+	    for( c=0 ; c<kcomp ; c++ )
+		kern[(y2*img2->width + x2)*kcomp + c] = imgGetPixel(img2,x2,y2)[c];
+	res = imgConvEngine(img1, kern, img2->width, img2->height, kcomp, fscale, 0, res);
+	free(kern);
+	return res;
+}
+
+//! Convolution with a signed integer kernel
+/*!
+ *  Filters Image @p img with a kernel of @p kw x @p kh signed weights,
+ *  such as edge detectors, using the same engine as imgConvolution().
+ *  Each output sample is the weighted sum of its neighbourhood divided by
+ *  @p divisor, rounded towards zero, plus @p bias, clamped to 0..255.
+ *  Samples outside the image count as zero.
+ *  The absolute weights may add up to IMG_CONV_INT_MAX_WEIGHT at most.
+ *  @param img the 8 bit Image to filter
+ *  @param kern the weights, row by row, applied to every component
+ *  @param kw the kernel width, odd
+ *  @param kh the kernel height, odd
+ *  @param divisor the normalization factor, not 0
+ *  @param bias the value added to the result, as 128 to keep negative responses
+ *  @param res the destination, matching @p img, or NULL to create a new Image
+ *  @return The filtered Image, or NULL on error
+ */
+Image *imgConvolutionInt(Image *img, const short *kern, int kw, int kh, int divisor, int bias, Image *res)
+{
+	if ( imgSampleSize(img->format)>1 || kw<1 || kh<1 || !(kw & 1) || !(kh & 1) || divisor==0 ) {
+		fprintf(stderr, "Bad convolution parameters\n");
+		return NULL;
+	}
+	// the engine accumulates in 32 bits
+	long long wsum = 0;
+	int i;
+	for ( i=0 ; i<kw*kh ; i++ )
+		wsum += abs(kern[i]);
+	if ( wsum > IMG_CONV_INT_MAX_WEIGHT ) {
+		fprintf(stderr, "Convolution kernel weights too large, sum %lld\n", wsum);
+		return NULL;
+	}
+	return imgConvEngine(img, kern, kw, kh, 1, divisor, bias, res);
+}
+
+Image *imgCreateGaussian(int dim, float sig)
+{
+    //const float sig = 40.;
+    if ( sig<=0.f ) sig = (float)dim/5.;
+    Image *k = imgNew(dim,dim,8);
+    //k->format = RGB24;
+    k->format = GREY;
+    int x,y;
+    const int dc = dim/2;
+    for( x=0 ; x<=dc ; x++ )
+    for( y=0 ; y<=dc ; y++ ) {
+	float xf = x-dc;
+	float yf = y-dc;
+	float kf = exp(-(xf*xf+yf*yf)/(2.*sig*sig));
+	unsigned char kv = kf*255.;
+	//printf("%d %d: %u\n",x,y,kv);
+	//unsigned char kvv[3] = { kv, kv, kv };
+	unsigned char kvv[3] = { kv };
+	imgSetPixel(k,x,y,kvv);
+	imgSetPixel(k,x,dim-y-1,kvv);
+	imgSetPixel(k,dim-x-1,y,kvv);
+	imgSetPixel(k,dim-x-1,dim-y-1,kvv);
+    }
+    return k;
+}
+
+/*
+ * Separable convolution.
+ * Weights are Q12 fixed point, summing to exactly 1<<12, so flat areas keep
+ * their value. The horizontal pass keeps its results as Q4 16 bit values,
+ * rounded, and the vertical pass truncates like imgConvolution(). Samples outside the image count as zero, as in
+ * imgConvolution(): rows are copied into a zero padded buffer and out of
+ * image rows are skipped, so the inner loops have no bounds tests.
+ */
+#define SEP_SHIFT	12
+#define SEP_MAX_TAPS	255
+
+// horizontal pass of n samples: out[k] = (sum q[i]*in[k+i*step] + 128) >> 8
+static void imgSepRow_scalar(const int16_t *in, int16_t *out, unsigned int n,
+			const int16_t *q, int taps, int step)
+{
+	unsigned int k;
+	int i;
+	for ( k=0 ; k<n ; k++ ) {
+		int32_t acc = 0;
+		for ( i=0 ; i<taps ; i++ )
+			acc += q[i] * in[k + i*step];
+		out[k] = (acc + (1 << (SEP_SHIFT-5))) >> (SEP_SHIFT-4);
+	}
+}
+
+// vertical pass of n samples: out[k] = clamp((sum q[j]*rows[j][k]) >> 16)
+static void imgSepCol_scalar(const int16_t **rows, unsigned char *out, unsigned int n,
+			const int16_t *q, int taps)
+{
+	unsigned int k;
+	int j;
+	for ( k=0 ; k<n ; k++ ) {
+		int32_t acc = 0;
+		for ( j=0 ; j<taps ; j++ )
+			acc += q[j] * rows[j][k];
+		acc >>= SEP_SHIFT+4;
+		out[k] = acc>255 ? 255 : acc;
+	}
+}
+
+#ifdef IMG_X86
+
+// weights i and i+1 in the two halves of each 32 bit lane, for pmaddwd
+__attribute__((target("sse2")))
+static inline __m128i sep_pair(const int16_t *q, int i, int taps)
+{
+	int hi = i+1<taps ? q[i+1] : 0;
+	return _mm_set1_epi32((uint16_t)q[i] | (uint32_t)(uint16_t)hi << 16);
+}
+
+__attribute__((target("sse2")))
+static void imgSepRow_sse2(const int16_t *in, int16_t *out, unsigned int n,
+			const int16_t *q, int taps, int step)
+{
+	const __m128i round = _mm_set1_epi32(1 << (SEP_SHIFT-5));
+	unsigned int k;
+	int i;
+	for ( k=0 ; k+8<=n ; k+=8 ) {
+		__m128i lo = round, hi = round;
+		for ( i=0 ; i<taps ; i+=2 ) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(in + k + i*step));
+			// past the last tap b is only multiplied by 0, and stays inside the padding
+			__m128i b = _mm_loadu_si128((const __m128i *)(in + k + (i+1<taps ? i+1 : i)*step));
+			__m128i w = sep_pair(q, i, taps);
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+		}
+		_mm_storeu_si128((__m128i *)(out + k), _mm_packs_epi32(
+			_mm_srai_epi32(lo, SEP_SHIFT-4), _mm_srai_epi32(hi, SEP_SHIFT-4)));
+	}
+	imgSepRow_scalar(in + k, out + k, n - k, q, taps, step);
+}
+
+__attribute__((target("sse2")))
+static void imgSepCol_sse2(const int16_t **rows, unsigned char *out, unsigned int n,
+			const int16_t *q, int taps)
+{
+	unsigned int k;
+	int j;
+	for ( k=0 ; k+8<=n ; k+=8 ) {
+		__m128i lo = _mm_setzero_si128(), hi = lo;
+		for ( j=0 ; j<taps ; j+=2 ) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(rows[j] + k));
+			__m128i b = j+1<taps ? _mm_loadu_si128((const __m128i *)(rows[j+1] + k)) : a;
+			__m128i w = sep_pair(q, j, taps);
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+		}
+		__m128i v = _mm_packs_epi32(_mm_srai_epi32(lo, SEP_SHIFT+4), _mm_srai_epi32(hi, SEP_SHIFT+4));
+		_mm_storel_epi64((__m128i *)(out + k), _mm_packus_epi16(v, v));
+	}
+	const int16_t *tail[taps];
+	for ( j=0 ; j<taps ; j++ )
+		tail[j] = rows[j] + k;
+	imgSepCol_scalar(tail, out + k, n - k, q, taps);
+}
+
+#endif // IMG_X86
+
+#ifdef IMG_NEON
+
+static void imgSepRow_neon(const int16_t *in, int16_t *out, unsigned int n,
+			const int16_t *q, int taps, int step)
+{
+	unsigned int k;
+	int i;
+	for ( k=0 ; k+8<=n ; k+=8 ) {
+		int32x4_t lo = vdupq_n_s32(1 << (SEP_SHIFT-5)), hi = lo;
+		for ( i=0 ; i<taps ; i++ ) {
+			int16x8_t a = vld1q_s16(in + k + i*step);
+			lo = vmlal_n_s16(lo, vget_low_s16(a), q[i]);
+			hi = vmlal_n_s16(hi, vget_high_s16(a), q[i]);
+		}
+		vst1q_s16(out + k, vcombine_s16(vshrn_n_s32(lo, SEP_SHIFT-4), vshrn_n_s32(hi, SEP_SHIFT-4)));
+	}
+	imgSepRow_scalar(in + k, out + k, n - k, q, taps, step);
+}
+
+static void imgSepCol_neon(const int16_t **rows, unsigned char *out, unsigned int n,
+			const int16_t *q, int taps)
+{
+	unsigned int k;
+	int j;
+	for ( k=0 ; k+8<=n ; k+=8 ) {
+		int32x4_t lo = vdupq_n_s32(0), hi = lo;
+		for ( j=0 ; j<taps ; j++ ) {
+			int16x8_t a = vld1q_s16(rows[j] + k);
+			lo = vmlal_n_s16(lo, vget_low_s16(a), q[j]);
+			hi = vmlal_n_s16(hi, vget_high_s16(a), q[j]);
+		}
+		int16x8_t v = vcombine_s16(vshrn_n_s32(lo, SEP_SHIFT+4), vshrn_n_s32(hi, SEP_SHIFT+4));
+		vst1_u8(out + k, vqmovun_s16(v));
+	}
+	const int16_t *tail[taps];
+	for ( j=0 ; j<taps ; j++ )
+		tail[j] = rows[j] + k;
+	imgSepCol_scalar(tail, out + k, n - k, q, taps);
+}
+
+#endif // IMG_NEON
+
+// separable convolution of an 8 bit image with Q12 weights
+static Image *imgSeparableQ12(Image *img, const int16_t *hq, int hn,
+			const int16_t *vq, int vn, Image *res)
+{
+	void (*row_fn)(const int16_t *, int16_t *, unsigned int, const int16_t *, int, int) = imgSepRow_scalar;
+	void (*col_fn)(const int16_t **, unsigned char *, unsigned int, const int16_t *, int) = imgSepCol_scalar;
+#if defined(IMG_X86)
+	if ( __builtin_cpu_supports("sse2") ) {
+		row_fn = imgSepRow_sse2;
+		col_fn = imgSepCol_sse2;
+	}
+#elif defined(IMG_NEON)
+	row_fn = imgSepRow_neon;
+	col_fn = imgSepCol_neon;
+#endif
+	if ( imgSampleSize(img->format)>1 ) {
+		fprintf(stderr, "Separable convolution needs 8 bit samples\n");
+		return NULL;
+	}
+	if ( ! res ) {
+		res = imgNew(img->width, img->height, img->depth);
+		if ( ! res ) return NULL;
+		res->format = img->format;
+	}
+	if ( imgMakeWritable(res) ) return NULL;
+
+	const int comp = img->depth/8;
+	const int w = img->width, h = img->height;
+	const unsigned int n = w*comp;
+	const int hc = hn/2, vc = vn/2;
+	// padded source row, and the horizontally filtered image
+	int16_t *pad = calloc((w + 2*hc + 1)*comp + 8, sizeof(int16_t));
+	int16_t *tmp = malloc((size_t)n*h*sizeof(int16_t));
+	if ( pad==NULL || tmp==NULL ) {
+		fprintf(stderr, "Failed to allocate memory for convolution\n");
+		free(pad);
+		free(tmp);
+		return NULL;
+	}
+	int y, j;
+	unsigned int k;
+	for ( y=0 ; y<h ; y++ ) {
+		const unsigned char *row = img->data + y*img->stride;
+		for ( k=0 ; k<n ; k++ )
+			pad[hc*comp + k] = row[k];
+		row_fn(pad, tmp + (size_t)y*n, n, hq, hn, comp);
+	}
+	const int16_t *rows[vn];
+	for ( y=0 ; y<h ; y++ ) {
+		// taps of rows outside the image are dropped
+		int j0 = max(0, vc-y), j1 = min(vn, h+vc-y);
+		for ( j=j0 ; j<j1 ; j++ )
+			rows[j-j0] = tmp + (size_t)(y+j-vc)*n;
+		col_fn(rows, res->data + y*res->stride, n, vq + j0, j1-j0);
+	}
+	free(pad);
+	free(tmp);
+	return res;
+}
+
+// puts the rounding error of n Q12 weights on the centre tap, so they sum to 1<<12
+static void imgQ12Residue(int16_t *q, int n)
+{
+	int i, sum = 0;
+	for ( i=0 ; i<n ; i++ )
+		sum += q[i];
+	q[n/2] += (1 << SEP_SHIFT) - sum;
+}
+
+// converts a 1-D 8 bit kernel to Q12 weights, returns the number of taps
+static int imgKernelQ12(Image *kern, int16_t *q)
+{
+	int n = kern->width * kern->height;
+	if ( kern->depth!=8 || (kern->width!=1 && kern->height!=1) || !(n & 1) || n>SEP_MAX_TAPS ) {
+		fprintf(stderr, "Separable kernels must be 8 bit rows or columns of odd length\n");
+		return 0;
+	}
+	unsigned int sum = 0;
+	int i;
+	for ( i=0 ; i<n ; i++ )
+		sum += *imgGetPixel(kern, kern->width==1 ? 0 : i, kern->width==1 ? i : 0);
+	if ( sum==0 ) return 0;
+	for ( i=0 ; i<n ; i++ ) {
+		unsigned int v = *imgGetPixel(kern, kern->width==1 ? 0 : i, kern->width==1 ? i : 0);
+		q[i] = ((v << SEP_SHIFT) + sum/2) / sum;
+	}
+	imgQ12Residue(q, n);
+	return n;
+}
+
+//! Separable image convolution
+/*!
+ *  Filters Image @p img with row kernel @p hkern, then with column kernel
+ *  @p vkern, the same as imgConvolution() with their product as kernel,
+ *  at a cost of len(hkern)+len(vkern) instead of len(hkern)*len(vkern)
+ *  multiply-adds per sample. Accumulation is fixed point, with SIMD passes,
+ *  and the result is within 1 of imgConvolution().
+ *  Kernels are 8 bit Images of a single row or column, of odd length,
+ *  and are normalized by the sum of their weights.
+ *  @param img the 8 bit Image to filter
+ *  @param hkern the row kernel
+ *  @param vkern the column kernel, or NULL to use @p hkern
+ *  @param res the destination, matching @p img, or NULL to create a new Image
+ *  @return The filtered Image, or NULL on error
+ */
+Image *imgSeparableConvolution(Image *img, Image *hkern, Image *vkern, Image *res)
+{
+	int16_t hq[SEP_MAX_TAPS], vq[SEP_MAX_TAPS];
+	int hn = imgKernelQ12(hkern, hq);
+	int vn = imgKernelQ12(vkern ? vkern : hkern, vq);
+	if ( hn==0 || vn==0 ) return NULL;
+	return imgSeparableQ12(img, hq, hn, vq, vn, res);
+}
+
+//! Creates a 1-D Gaussian kernel
+/*!
+ *  Returns a single row kernel for imgSeparableConvolution(), matching the
+ *  rows of imgCreateGaussian().
+ *  @param dim the kernel length, odd
+ *  @param sig the standard deviation, or 0 for @p dim/5
+ *  @return The kernel, an 8 bit Image of @p dim x 1 pixels
+ */
+Image *imgCreateGaussian1D(int dim, float sig)
+{
+	if ( sig<=0.f ) sig = (float)dim/5.;
+	Image *k = imgNew(dim, 1, 8);
+	if ( k==NULL ) return NULL;
+	const int dc = dim/2;
+	int x;
+	for ( x=0 ; x<dim ; x++ ) {
+		float xf = x-dc;
+		k->data[x] = exp(-(xf*xf)/(2.*sig*sig))*255.;
+	}
+	return k;
+}
+
+//! Gaussian blur
+/*!
+ *  Same as imgConvolution() with an imgCreateGaussian() kernel, within 1,
+ *  computed as a separable convolution of imgCreateGaussian1D() rows, which
+ *  have the same 8 bit weights.
+ *  @param img the 8 bit Image to filter
+ *  @param dim the kernel size, odd, up to 255
+ *  @param sig the standard deviation, or 0 for @p dim/5
+ *  @param res the destination, matching @p img, or NULL to create a new Image
+ *  @return The filtered Image, or NULL on error
+ */
+Image *imgGaussianBlur(Image *img, int dim, float sig, Image *res)
+{
+	if ( dim<1 || !(dim & 1) || dim>SEP_MAX_TAPS ) {
+		fprintf(stderr, "Bad Gaussian kernel size %d\n", dim);
+		return NULL;
+	}
+	Image *k = imgCreateGaussian1D(dim, sig);
+	if ( k==NULL ) return NULL;
+	int16_t q[SEP_MAX_TAPS];
+	int n = imgKernelQ12(k, q);
+	imgDestroy(k);
+	if ( n==0 ) return NULL;
+	return imgSeparableQ12(img, q, n, q, n, res);
+}
+
+/*
+ * Planar images.
+ * Each component is an 8 bit Image of its own, so per channel kernels run
+ * on contiguous bytes. The row kernels below have SIMD versions selected
+ * at run time, as the conversions in convert.c.
+ */
+static unsigned int imgRowSAD_scalar(const unsigned char *a, const unsigned char *b, unsigned int n)
+{
+	unsigned int i, sad = 0;
+	for ( i = 0 ; i < n ; i++ )
+		sad += abs(a[i] - b[i]);
+	return sad;
+}
+
+static unsigned int imgRowSum_scalar(const unsigned char *a, unsigned int n)
+{
+	unsigned int i, sum = 0;
+	for ( i = 0 ; i < n ; i++ )
+		sum += a[i];
+	return sum;
+}
+
+static void imgRowMAC_scalar(uint32_t *acc, const unsigned char *src, unsigned char w, unsigned int n)
+{
+	unsigned int i;
+	for ( i = 0 ; i < n ; i++ )
+		acc[i] += w * src[i];
+}
+
+static uint64_t imgBlockSAD_scalar(const unsigned char *a, unsigned int astride, const unsigned char *b,
+			unsigned int bstride, unsigned int n, unsigned int h, uint64_t limit)
+{
+	uint64_t sad = 0;
+	unsigned int y;
+	for ( y = 0 ; y < h && sad <= limit ; y++ )
+		sad += imgRowSAD_scalar(a + y*astride, b + y*bstride, n);
+	return sad;
+}
+
+static const struct RowKernels row_scalar = { imgRowSAD_scalar, imgRowSum_scalar, imgRowMAC_scalar,
+						imgBlockSAD_scalar };
+
+#ifdef IMG_X86
+
+__attribute__((target("sse2")))
+static unsigned int imgRowSAD_sse2(const unsigned char *a, const unsigned char *b, unsigned int n)
+{
+	__m128i acc = _mm_setzero_si128();
+	unsigned int i;
+	for ( i = 0 ; i + 16 <= n ; i += 16 )
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+						_mm_loadu_si128((const __m128i *)(b + i))));
+	unsigned int sad = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+	return sad + imgRowSAD_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static unsigned int imgRowSum_sse2(const unsigned char *a, unsigned int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	unsigned int i;
+	for ( i = 0 ; i + 16 <= n ; i += 16 )
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)), zero));
+	unsigned int sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+	return sum + imgRowSum_scalar(a + i, n - i);
+}
+
+// products of 8 bit values fit in 16 bit lanes
+__attribute__((target("sse2")))
+static void imgRowMAC_sse2(uint32_t *acc, const unsigned char *src, unsigned char w, unsigned int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w16 = _mm_set1_epi16(w);
+	unsigned int i;
+	for ( i = 0 ; i + 16 <= n ; i += 16 ) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), w16);
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), w16);
+		__m128i *a = (__m128i *)(acc + i);
+		_mm_storeu_si128(a,     _mm_add_epi32(_mm_loadu_si128(a),     _mm_unpacklo_epi16(lo, zero)));
+		_mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(lo, zero)));
+		_mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(hi, zero)));
+		_mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(hi, zero)));
+	}
+	imgRowMAC_scalar(acc + i, src + i, w, n - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned int imgRowSAD_avx2(const unsigned char *a, const unsigned char *b, unsigned int n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	unsigned int i;
+	for ( i = 0 ; i + 32 <= n ; i += 32 )
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(a + i)),
+						_mm256_loadu_si256((const __m256i *)(b + i))));
+	__m128i s = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	unsigned int sad = _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(s, s));
+	_mm256_zeroupper();	// the SSE2 tail runs legacy SSE code
+	return sad + imgRowSAD_sse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void imgRowMAC_avx2(uint32_t *acc, const unsigned char *src, unsigned char w, unsigned int n)
+{
+	const __m256i w16 = _mm256_set1_epi16(w);
+	unsigned int i;
+	for ( i = 0 ; i + 16 <= n ; i += 16 ) {
+		__m256i p = _mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i))), w16);
+		__m256i *a = (__m256i *)(acc + i);
+		_mm256_storeu_si256(a,     _mm256_add_epi32(_mm256_loadu_si256(a),
+						_mm256_cvtepu16_epi32(_mm256_castsi256_si128(p))));
+		_mm256_storeu_si256(a + 1, _mm256_add_epi32(_mm256_loadu_si256(a + 1),
+						_mm256_cvtepu16_epi32(_mm256_extracti128_si256(p, 1))));
+	}
+	imgRowMAC_scalar(acc + i, src + i, w, n - i);
+}
+
+// the row kernels are inlined, the test once per row costs less than a row
+__attribute__((target("sse2")))
+static uint64_t imgBlockSAD_sse2(const unsigned char *a, unsigned int astride, const unsigned char *b,
+			unsigned int bstride, unsigned int n, unsigned int h, uint64_t limit)
+{
+	uint64_t sad = 0;
+	unsigned int y;
+	for ( y = 0 ; y < h && sad <= limit ; y++ )
+		sad += imgRowSAD_sse2(a + y*astride, b + y*bstride, n);
+	return sad;
+}
+
+__attribute__((target("avx2")))
+static uint64_t imgBlockSAD_avx2(const unsigned char *a, unsigned int astride, const unsigned char *b,
+			unsigned int bstride, unsigned int n, unsigned int h, uint64_t limit)
+{
+	uint64_t sad = 0;
+	unsigned int y;
+	for ( y = 0 ; y < h && sad <= limit ; y++ )
+		sad += imgRowSAD_avx2(a + y*astride, b + y*bstride, n);
+	return sad;
+}
+
+static const struct RowKernels row_sse2 = { imgRowSAD_sse2, imgRowSum_sse2, imgRowMAC_sse2, imgBlockSAD_sse2 };
+static const struct RowKernels row_avx2 = { imgRowSAD_avx2, imgRowSum_sse2, imgRowMAC_avx2, imgBlockSAD_avx2 };
+
+#endif // IMG_X86
+
+#ifdef IMG_NEON
+
+static unsigned int imgRowSAD_neon(const unsigned char *a, const unsigned char *b, unsigned int n)
+{
+	uint32x4_t acc = vdupq_n_u32(0);
+	unsigned int i;
+	for ( i = 0 ; i + 16 <= n ; i += 16 )
+		acc = vpadalq_u16(acc, vpaddlq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i))));
+	unsigned int sad = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+			   vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+	return sad + imgRowSAD_scalar(a + i, b + i, n - i);
+}
+
+static unsigned int imgRowSum_neon(const unsigned char *a, unsigned int n)
+{
+	uint32x4_t acc = vdupq_n_u32(0);
+	unsigned int i;
+	for ( i = 0 ; i + 16 <= n ; i += 16 )
+		acc = vpadalq_u16(acc, vpaddlq_u8(vld1q_u8(a + i)));
+	unsigned int sum = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+			   vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+	return sum + imgRowSum_scalar(a + i, n - i);
+}
+
+static void imgRowMAC_neon(uint32_t *acc, const unsigned char *src, unsigned char w, unsigned int n)
+{
+	const uint8x8_t w8 = vdup_n_u8(w);
+	unsigned int i;
+	for ( i = 0 ; i + 8 <= n ; i += 8 ) {
+		uint16x8_t p = vmull_u8(vld1_u8(src + i), w8);
+		vst1q_u32(acc + i,     vaddw_u16(vld1q_u32(acc + i),     vget_low_u16(p)));
+		vst1q_u32(acc + i + 4, vaddw_u16(vld1q_u32(acc + i + 4), vget_high_u16(p)));
+	}
+	imgRowMAC_scalar(acc + i, src + i, w, n - i);
+}
+
+static uint64_t imgBlockSAD_neon(const unsigned char *a, unsigned int astride, const unsigned char *b,
+			unsigned int bstride, unsigned int n, unsigned int h, uint64_t limit)
+{
+	uint64_t sad = 0;
+	unsigned int y;
+	for ( y = 0 ; y < h && sad <= limit ; y++ )
+		sad += imgRowSAD_neon(a + y*astride, b + y*bstride, n);
+	return sad;
+}
+
+static const struct RowKernels row_neon = { imgRowSAD_neon, imgRowSum_neon, imgRowMAC_neon, imgBlockSAD_neon };
+
+#endif // IMG_NEON
+
+static const struct RowKernels *row_impl = NULL;
+
+// selects the fastest row kernels supported by the running CPU
+static const struct RowKernels *imgRowKernels(void)
+{
+	const struct RowKernels *k = __atomic_load_n(&row_impl, __ATOMIC_RELAXED);
+	if ( k ) return k;
+	k = &row_scalar;
+#if defined(IMG_X86)
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("avx2") )		k = &row_avx2;
+	else if ( __builtin_cpu_supports("sse2") )	k = &row_sse2;
+#elif defined(IMG_NEON)
+	k = &row_neon;
+#endif
+	// concurrent first calls all store the same value
+	__atomic_store_n(&row_impl, k, __ATOMIC_RELAXED);
+	return k;
+}
+
+//! Creates a new planar image
+/*!
+ *  Allocates @p n_planes 8 bit planes of @p width x @p height pixels,
+ *  each one an Image with its own stride. Colors are undefined.
+ *  PlanarImage can then be released by calling imgPlanarDestroy().
+ *  @param width the number of columns
+ *  @param height the number of rows
+ *  @param n_planes the number of components, 1 to IMG_MAX_PLANES
+ *  @return The new PlanarImage, or NULL on error
+ */
+PlanarImage *imgPlanarNew(unsigned int width, unsigned int height, unsigned int n_planes)
+{
+	if ( n_planes<1 || n_planes>IMG_MAX_PLANES ) {
+		fprintf(stderr, "Bad number of planes: %u\n", n_planes);
+		return NULL;
+	}
+	PlanarImage *pl = calloc(1, sizeof(PlanarImage));
+	if ( pl==NULL ) {
+		fprintf(stderr, "Failed to allocate memory for planar image container\n");
+		return NULL;
+	}
+	pl->width = width;
+	pl->height = height;
+	pl->n_planes = n_planes;
+	unsigned int k;
+	for ( k=0 ; k<n_planes ; k++ ) {
+		pl->plane[k] = imgNew(width, height, 8);
+		if ( pl->plane[k]==NULL ) {
+			imgPlanarDestroy(pl);
+			return NULL;
+		}
+	}
+	return pl;
+}
+
+//! Destroys a planar image and its planes
+void imgPlanarDestroy(PlanarImage *pl)
+{
+	if ( pl==NULL ) return;
+	unsigned int k;
+	for ( k=0 ; k<pl->n_planes ; k++ )
+		if ( pl->plane[k] ) imgDestroy(pl->plane[k]);
+	free(pl);
+}
+
+// checks that a planar image can hold the result of an operation
+static int imgPlanarMatch(PlanarImage *pl, unsigned int width, unsigned int height,
+			unsigned int n_planes)
+{
+	if ( pl->width!=width || pl->height!=height || pl->n_planes!=n_planes ) {
+		fprintf(stderr, "Planar image does not match: %ux%u, %u planes\n",
+			pl->width, pl->height, pl->n_planes);
+		return 1;
+	}
+	unsigned int k;
+	for ( k=0 ; k<n_planes ; k++ )
+		if ( imgMakeWritable(pl->plane[k]) ) return 1;
+	return 0;
+}
+
+//! Splits an image into component planes
+/*!
+ *  Plane k receives byte k of every pixel of @p img, so the planes of
+ *  RGB24 images are b, g, r and those of BGR24 and RGBA32 are r, g, b(, a),
+ *  as in memory. Images of 8, 24 and 32 bit pixels are supported.
+ *  @param img the packed Image
+ *  @param res the destination, with matching size and depth/8 planes,
+ *  	       or NULL to create a new PlanarImage
+ *  @return The planar image, or NULL on error
+ */
+PlanarImage *imgToPlanar(Image *img, PlanarImage *res)
+{
+	unsigned int n = img->depth/8;
+	if ( n!=1 && n!=3 && n!=4 ) {
+		fprintf(stderr, "imgToPlanar() error: %u bit pixels not supported\n", img->depth);
+		return NULL;
+	}
+	if ( res==NULL ) {
+		res = imgPlanarNew(img->width, img->height, n);
+		if ( res==NULL ) return NULL;
+	}
+	else if ( imgPlanarMatch(res, img->width, img->height, n) ) return NULL;
+	res->format = img->format;
+
+	Image **p = res->plane;
+	unsigned int y;
+	for ( y=0 ; y<img->height ; y++ ) {
+		const unsigned char *row = img->data + y*img->stride;
+		if ( n==3 )
+			Deinterleave3(row, p[0]->data + y*p[0]->stride, p[1]->data + y*p[1]->stride,
+				p[2]->data + y*p[2]->stride, img->width);
+		else if ( n==4 )
+			Deinterleave4(row, p[0]->data + y*p[0]->stride, p[1]->data + y*p[1]->stride,
+				p[2]->data + y*p[2]->stride, p[3]->data + y*p[3]->stride, img->width);
+		else
+			memcpy(p[0]->data + y*p[0]->stride, row, img->width);
+	}
+	return res;
+}
+
+//! Merges component planes into an image
+/*!
+ *  Inverse of imgToPlanar().
+ *  @param pl the planar image
+ *  @param res the destination, with matching size and 8*n_planes bit pixels,
+ *  	       or NULL to create a new Image
+ *  @return The packed Image, or NULL on error
+ */
+Image *imgFromPlanar(PlanarImage *pl, Image *res)
+{
+	unsigned int n = pl->n_planes;
+	if ( n!=1 && n!=3 && n!=4 ) {
+		fprintf(stderr, "imgFromPlanar() error: %u planes not supported\n", n);
+		return NULL;
+	}
+	if ( res==NULL ) {
+		res = imgNew(pl->width, pl->height, 8*n);
+		if ( res==NULL ) return NULL;
+	}
+	else if ( res->width!=pl->width || res->height!=pl->height || res->depth!=8*n ) {
+		fprintf(stderr, "imgFromPlanar() error: image does not match\n");
+		return NULL;
+	}
+	if ( imgMakeWritable(res) ) return NULL;
+	res->format = pl->format;
+
+	Image **p = pl->plane;
+	unsigned int y;
+	for ( y=0 ; y<pl->height ; y++ ) {
+		unsigned char *row = res->data + y*res->stride;
+		if ( n==3 )
+			Interleave3(p[0]->data + y*p[0]->stride, p[1]->data + y*p[1]->stride,
+				p[2]->data + y*p[2]->stride, row, pl->width);
+		else if ( n==4 )
+			Interleave4(p[0]->data + y*p[0]->stride, p[1]->data + y*p[1]->stride,
+				p[2]->data + y*p[2]->stride, p[3]->data + y*p[3]->stride, row, pl->width);
+		else
+			memcpy(row, p[0]->data + y*p[0]->stride, pl->width);
+	}
+	return res;
+}
+
+//! Planar image convolution
+/*!
+ *  Same as imgConvolution(), with identical results, on every plane of @p src.
+ *  Each output row is accumulated kernel tap by kernel tap over whole rows,
+ *  which the SIMD row kernels process 16 or 32 pixels at a time.
+ *  Kernel @p kern is an 8 bit Image, or has one byte per plane of @p src.
+ *  @param src the planar image to filter
+ *  @param kern the kernel, with odd dimensions and up to 65536 pixels
+ *  @param res the destination, matching @p src, or NULL to create a new one
+ *  @return The filtered PlanarImage, or NULL on error
+ */
+PlanarImage *imgPlanarConvolution(PlanarImage *src, Image *kern, PlanarImage *res)
+{
+	if ( kern->depth>8 && kern->depth!=8*src->n_planes ) {
+		fprintf(stderr, "imgPlanarConvolution() error: kernel depth does not match\n");
+		return NULL;
+	}
+	float mean = imgGetMean(kern);
+	unsigned long fscale = mean * kern->width * kern->height;
+	if ( res==NULL ) {
+		res = imgPlanarNew(src->width, src->height, src->n_planes);
+		if ( res==NULL ) return NULL;
+	}
+	else if ( imgPlanarMatch(res, src->width, src->height, src->n_planes) ) return NULL;
+	res->format = src->format;
+
+	const struct RowKernels *rk = imgRowKernels();
+	const int w = src->width, h = src->height;
+	const int xc = kern->width / 2;
+	const int yc = kern->height / 2;
+	uint32_t *acc = malloc(w * sizeof(uint32_t));
+	if ( acc==NULL ) {
+		fprintf(stderr, "Failed to allocate memory for convolution\n");
+		return NULL;
+	}
+	unsigned int k;
+	int x, y, kx, ky;
+	for ( k=0 ; k<src->n_planes ; k++ ) {
+	    Image *in = src->plane[k], *out = res->plane[k];
+	    for ( y=0 ; y<h ; y++ ) {
+		memset(acc, 0, w * sizeof(uint32_t));
+		for ( ky=0 ; ky<kern->height ; ky++ ) {
+		    int yy = y+ky-yc;
+		    if ( yy<0 || yy>=h ) continue;
+		    const unsigned char *row = in->data + yy*in->stride;
+		    const unsigned char *krow = kern->data + ky*kern->stride;
+		    for ( kx=0 ; kx<kern->width ; kx++ ) {
+			unsigned char wt = kern->depth<=8 ? krow[kx] : krow[kx*src->n_planes + k];
+			if ( wt==0 ) continue;
+			// output columns whose tap falls inside the image
+			int d = kx-xc;
+			int x0 = max(0, -d), x1 = min(w, w-d);
+			if ( x1>x0 ) rk->mac(acc + x0, row + x0 + d, wt, x1-x0);
+		    }
+		}
+		unsigned char *orow = out->data + y*out->stride;
+		for ( x=0 ; x<w ; x++ ) {
+		    unsigned long accs = acc[x]/fscale;
+		    orow[x] = accs>255 ? 255 : accs;
+		}
+	    }
+	}
+	free(acc);
+	return res;
+}
+
+//! Searches a planar image area for a pattern
+/*!
+ *  Same as imgFindPatternArea(), on planar images: the sum of absolute
+ *  differences of up to three planes is evaluated row by row with SIMD
+ *  kernels. Locations are pattern centers, and are limited to those
+ *  where the whole pattern lies inside @p img.
+ *  @param img PlanarImage to be searched.
+ *  @param pat PlanarImage pattern to search for.
+ *  @param x1 the column number of the top left corner of the image area to be searched
+ *  @param y1 the row number of the top left corner of the image area to be searched
+ *  @param x2 the column number of the bottom right corner of the image area
+ *  @param y2 the row number of the bottom right corner of the image area to be searched
+ *  @param best_x location to store the column number of the selected location.
+ *  @param best_y location to store the row number of the selected location.
+ *  @return The matching error for the selected location, or INT_MAX if there is none.
+ */
+int imgPlanarFindPatternArea(PlanarImage *img, PlanarImage *pat,
+			int x1, int y1, int x2, int y2, int *best_x, int *best_y)
+{
+	const struct RowKernels *rk = imgRowKernels();
+	const int pw = pat->width, ph = pat->height;
+	unsigned int n = min(min(img->n_planes, pat->n_planes), 3);
+	int best_val = INT_MAX;
+	*best_x = *best_y = -1;
+
+	x1 = max(x1, pw/2);
+	y1 = max(y1, ph/2);
+	x2 = min(x2, (int)img->width - (pw - pw/2));
+	y2 = min(y2, (int)img->height - (ph - ph/2));
+	int x, y, yi;
+	unsigned int k;
+	for ( y=y1 ; y<=y2 ; y++ )
+	for ( x=x1 ; x<=x2 ; x++ ) {
+		int diff = 0;
+		for ( k=0 ; k<n ; k++ ) {
+			Image *ip = img->plane[k], *pp = pat->plane[k];
+			const unsigned char *a = ip->data + (y-ph/2)*ip->stride + x-pw/2;
+			for ( yi=0 ; yi<ph ; yi++ )
+				diff += rk->sad(a + yi*ip->stride, pp->data + yi*pp->stride, pw);
+		}
+		if ( diff<best_val ) {
+			best_val = diff;
+			*best_x = x;
+			*best_y = y;
+		}
+	}
+	return best_val;
+}
+
+//! Searches a planar image for a pattern
+/*!
+ *  Same as imgFindPattern(), see imgPlanarFindPatternArea().
+ */
+int imgPlanarFindPattern(PlanarImage *img, PlanarImage *pat, int *best_x, int *best_y)
+{
+	return imgPlanarFindPatternArea(img, pat, 0, 0, img->width-1, img->height-1,
+		best_x, best_y);
+}
+
+//! Evaluates the mean value of each plane in an area
+/*!
+ *  @param pl PlanarImage to be processed.
+ *  @param x1 the column number of the top left corner of the image area to be processed
+ *  @param y1 the row number of the top left corner of the image area to be processed
+ *  @param x2 the column number of the bottom right corner of the image area to be processed
+ *  @param y2 the row number of the bottom right corner of the image area to be processed
+ *  @param mean location to store n_planes mean values
+ */
+void imgPlanarGetMeanArea(PlanarImage *pl, int x1, int y1, int x2, int y2, float *mean)
+{
+	const struct RowKernels *rk = imgRowKernels();
+	unsigned int k;
+	int y;
+	for ( k=0 ; k<pl->n_planes ; k++ ) {
+		Image *p = pl->plane[k];
+		unsigned long long total = 0;
+		for ( y=y1 ; y<=y2 ; y++ )
+			total += rk->sum(p->data + y*p->stride + x1, x2-x1+1);
+		mean[k] = (float)total / (float)( (x2-x1+1) * (y2-y1+1) );
+	}
+}
+
+//! Evaluates the mean value of each plane
+void imgPlanarGetMean(PlanarImage *pl, float *mean)
+{
+	imgPlanarGetMeanArea(pl, 0, 0, pl->width-1, pl->height-1, mean);
+}
+
+/*
+ * Integral images.
+ * Entry (x,y) of each table holds the sums of the samples of all pixels left
+ * of column x and above row y, so row 0 and column 0 are zero and any area
+ * sum takes four reads. Rows are built from the previous one: a running sum
+ * of the row samples is added to the entries above, per component.
+ */
+
+// running row sums from line[] and sq[], for n pixels of comp samples
+static void imgIntegralRun(const unsigned char *src, const uint64_t *up, uint64_t *out,
+			const uint64_t *squp, uint64_t *sqout, unsigned int n, int comp,
+			uint64_t *line, uint64_t *sq)
+{
+	unsigned int x;
+	int c;
+	for ( x=0 ; x<n ; x++, src+=comp, up+=comp, out+=comp )
+		for ( c=0 ; c<comp ; c++ ) {
+			line[c] += src[c];
+			out[c] = up[c] + line[c];
+		}
+	if ( ! sqout ) return;
+	src -= n*comp;
+	for ( x=0 ; x<n ; x++, src+=comp, squp+=comp, sqout+=comp )
+		for ( c=0 ; c<comp ; c++ ) {
+			sq[c] += src[c] * src[c];
+			sqout[c] = squp[c] + sq[c];
+		}
+}
+
+static void imgIntegralRow_scalar(const unsigned char *src, const uint64_t *up, uint64_t *out,
+			const uint64_t *squp, uint64_t *sqout, unsigned int w, int comp)
+{
+	uint64_t line[IMG_MAX_PLANES] = { 0 }, sq[IMG_MAX_PLANES] = { 0 };
+	imgIntegralRun(src, up, out, squp, sqout, w, comp, line, sq);
+}
+
+#ifdef IMG_X86
+
+// inclusive prefix sum of the 4 lanes
+__attribute__((target("avx2")))
+static inline __m256i ii_scan4(__m256i v)
+{
+	v = _mm256_add_epi64(v, _mm256_slli_si256(v, 8));
+	__m256i t = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(1, 1, 0, 0));
+	return _mm256_add_epi64(v, _mm256_blend_epi32(_mm256_setzero_si256(), t, 0xF0));
+}
+
+__attribute__((target("avx2")))
+static void imgIntegralRow_avx2(const unsigned char *src, const uint64_t *up, uint64_t *out,
+			const uint64_t *squp, uint64_t *sqout, unsigned int w, int comp)
+{
+	uint64_t line[IMG_MAX_PLANES] = { 0 }, sq[IMG_MAX_PLANES] = { 0 };
+	__m256i run = _mm256_setzero_si256(), runsq = run;
+	unsigned int x = 0, i;
+	if ( comp==1 ) {
+		// 4 pixels per step, scanned across the lanes
+		for ( ; x+4<=w ; x+=4 ) {
+			int32_t s;
+			memcpy(&s, src + x, 4);
+			__m256i v = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(s));
+			__m256i vs = _mm256_mul_epu32(v, v);
+			run = _mm256_add_epi64(run, ii_scan4(v));
+			_mm256_storeu_si256((__m256i *)(out + x),
+				_mm256_add_epi64(run, _mm256_loadu_si256((const __m256i *)(up + x))));
+			run = _mm256_permute4x64_epi64(run, _MM_SHUFFLE(3, 3, 3, 3));
+			if ( sqout ) {
+				runsq = _mm256_add_epi64(runsq, ii_scan4(vs));
+				_mm256_storeu_si256((__m256i *)(sqout + x),
+					_mm256_add_epi64(runsq, _mm256_loadu_si256((const __m256i *)(squp + x))));
+				runsq = _mm256_permute4x64_epi64(runsq, _MM_SHUFFLE(3, 3, 3, 3));
+			}
+		}
+	}
+	else {
+		// one pixel per step, its components in the lanes; with 3 components
+		// the fourth lane lands on the next entry, written again by the next pixel
+		for ( ; x+1<w ; x++ ) {
+			int32_t s;
+			memcpy(&s, src + x*comp, 4);
+			__m256i v = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(s));
+			run = _mm256_add_epi64(run, v);
+			_mm256_storeu_si256((__m256i *)(out + x*comp),
+				_mm256_add_epi64(run, _mm256_loadu_si256((const __m256i *)(up + x*comp))));
+			if ( sqout ) {
+				runsq = _mm256_add_epi64(runsq, _mm256_mul_epu32(v, v));
+				_mm256_storeu_si256((__m256i *)(sqout + x*comp),
+					_mm256_add_epi64(runsq, _mm256_loadu_si256((const __m256i *)(squp + x*comp))));
+			}
+		}
+	}
+	// the last pixels, without reading past the row
+	uint64_t r[4], rs[4];
+	_mm256_storeu_si256((__m256i *)r, run);
+	_mm256_storeu_si256((__m256i *)rs, runsq);
+	for ( i=0 ; i<(unsigned int)comp ; i++ ) {
+		line[i] = r[comp==1 ? 0 : i];
+		sq[i] = rs[comp==1 ? 0 : i];
+	}
+	imgIntegralRun(src + x*comp, up + x*comp, out + x*comp,
+		squp ? squp + x*comp : NULL, sqout ? sqout + x*comp : NULL, w - x, comp, line, sq);
+}
+
+#endif // IMG_X86
+
+#ifdef IMG_NEON
+
+static void imgIntegralRow_neon(const unsigned char *src, const uint64_t *up, uint64_t *out,
+			const uint64_t *squp, uint64_t *sqout, unsigned int w, int comp)
+{
+	uint64_t line[IMG_MAX_PLANES] = { 0 }, sq[IMG_MAX_PLANES] = { 0 };
+	unsigned int x = 0;
+	if ( comp==3 || comp==4 ) {
+		// one pixel per step, components in two pairs of lanes
+		uint64x2_t r0 = vdupq_n_u64(0), r1 = r0, s0 = r0, s1 = r0;
+		for ( ; x+1<w ; x++ ) {
+			uint32_t s;
+			memcpy(&s, src + x*comp, 4);
+			uint32x4_t v = vmovl_u16(vget_low_u16(vmovl_u8(vcreate_u8(s))));
+			uint32x4_t vs = vmulq_u32(v, v);
+			r0 = vaddw_u32(r0, vget_low_u32(v));
+			r1 = vaddw_u32(r1, vget_high_u32(v));
+			uint64_t *o = out + x*comp;
+			const uint64_t *u = up + x*comp;
+			vst1q_u64(o, vaddq_u64(r0, vld1q_u64(u)));
+			vst1q_u64(o + 2, vaddq_u64(r1, vld1q_u64(u + 2)));
+			if ( sqout ) {
+				s0 = vaddw_u32(s0, vget_low_u32(vs));
+				s1 = vaddw_u32(s1, vget_high_u32(vs));
+				vst1q_u64(sqout + x*comp, vaddq_u64(s0, vld1q_u64(squp + x*comp)));
+				vst1q_u64(sqout + x*comp + 2, vaddq_u64(s1, vld1q_u64(squp + x*comp + 2)));
+			}
+		}
+		vst1q_u64(line, r0);
+		vst1q_u64(line + 2, r1);
+		vst1q_u64(sq, s0);
+		vst1q_u64(sq + 2, s1);
+	}
+	imgIntegralRun(src + x*comp, up + x*comp, out + x*comp,
+		squp ? squp + x*comp : NULL, sqout ? sqout + x*comp : NULL, w - x, comp, line, sq);
+}
+
+#endif // IMG_NEON
+
+//! Creates a new integral image
+/*!
+ *  Allocates the tables for Images of @p width x @p height pixels of
+ *  @p n_comp 8 bit components, to be filled by imgIntegral().
+ *  IntegralImage can then be released by calling imgIntegralDestroy().
+ *  @param width the number of columns
+ *  @param height the number of rows
+ *  @param n_comp the number of components, 1 to IMG_MAX_PLANES
+ *  @param squares non zero to also keep the sums of squared samples, for imgIntegralVariance()
+ *  @return The new IntegralImage, or NULL on error
+ */
+IntegralImage *imgIntegralNew(unsigned int width, unsigned int height, unsigned int n_comp, int squares)
+{
+	if ( n_comp<1 || n_comp>IMG_MAX_PLANES ) {
+		fprintf(stderr, "Bad number of components: %u\n", n_comp);
+		return NULL;
+	}
+	IntegralImage *ii = calloc(1, sizeof(IntegralImage));
+	if ( ii==NULL ) {
+		fprintf(stderr, "Failed to allocate memory for integral image\n");
+		return NULL;
+	}
+	ii->width = width;
+	ii->height = height;
+	ii->n_comp = n_comp;
+	ii->stride = (width+1) * n_comp;
+	size_t n = (size_t)(height+1) * ii->stride;
+	ii->sum = calloc(n, sizeof(uint64_t));
+	if ( squares ) ii->sqsum = calloc(n, sizeof(uint64_t));
+	if ( ii->sum==NULL || ( squares && ii->sqsum==NULL ) ) {
+		fprintf(stderr, "Failed to allocate memory for integral image\n");
+		imgIntegralDestroy(ii);
+		return NULL;
+	}
+	return ii;
+}
+
+//! Destroys an integral image
+void imgIntegralDestroy(IntegralImage *ii)
+{
+	if ( ii==NULL ) return;
+	free(ii->sum);
+	free(ii->sqsum);
+	free(ii);
+}
+
+//! Builds the integral image of an image
+/*!
+ *  Fills the summed area tables of Image @p img, once per frame, so that
+ *  imgIntegralSum(), imgIntegralMean() and imgIntegralVariance() answer
+ *  area queries in constant time.
+ *  @param img the Image, of 8 bit samples
+ *  @param squares non zero to also sum the squared samples
+ *  @param res the destination, with matching size, components and squares,
+ *  	       or NULL to create a new IntegralImage
+ *  @return The integral image, or NULL on error
+ */
+IntegralImage *imgIntegral(Image *img, int squares, IntegralImage *res)
+{
+	const unsigned int comp = img->depth/8;
+	if ( imgSampleSize(img->format)>1 || comp<1 || comp>IMG_MAX_PLANES ) {
+		fprintf(stderr, "imgIntegral() error: %u bit pixels not supported\n", img->depth);
+		return NULL;
+	}
+	if ( res==NULL ) {
+		res = imgIntegralNew(img->width, img->height, comp, squares);
+		if ( res==NULL ) return NULL;
+	}
+	else if ( res->width!=img->width || res->height!=img->height || res->n_comp!=comp
+			|| ( squares && res->sqsum==NULL ) ) {
+		fprintf(stderr, "Integral image does not match: %ux%u, %u components\n",
+			res->width, res->height, res->n_comp);
+		return NULL;
+	}
+	void (*row)(const unsigned char *, const uint64_t *, uint64_t *,
+		const uint64_t *, uint64_t *, unsigned int, int) = imgIntegralRow_scalar;
+#if defined(IMG_X86)
+	if ( __builtin_cpu_supports("avx2") ) row = imgIntegralRow_avx2;
+#elif defined(IMG_NEON)
+	row = imgIntegralRow_neon;
+#endif
+	uint64_t *sq = squares ? res->sqsum : NULL;
+	unsigned int y;
+	for ( y=0 ; y<img->height ; y++ ) {
+		uint64_t *up = res->sum + y*res->stride;
+		uint64_t *out = up + res->stride;
+		memset(out, 0, comp*sizeof(uint64_t));
+		if ( sq ) memset(sq + (y+1)*res->stride, 0, comp*sizeof(uint64_t));
+		row(img->data + y*img->stride, up + comp, out + comp,
+			sq ? sq + y*res->stride + comp : NULL,
+			sq ? sq + (y+1)*res->stride + comp : NULL, img->width, comp);
+	}
+	return res;
+}
+
+// clips an area to the image, false if nothing is left
+static int imgIntegralClip(IntegralImage *ii, int *x1, int *y1, int *x2, int *y2)
+{
+	if ( *x1<0 ) *x1 = 0;
+	if ( *y1<0 ) *y1 = 0;
+	if ( *x2>=(int)ii->width ) *x2 = ii->width-1;
+	if ( *y2>=(int)ii->height ) *y2 = ii->height-1;
+	return *x1<=*x2 && *y1<=*y2;
+}
+
+// area sum of component c, or of all components if c<0, from table t
+static uint64_t imgIntegralArea(IntegralImage *ii, const uint64_t *t, int x1, int y1, int x2, int y2, int c)
+{
+	const uint64_t *r1 = t + y1*ii->stride, *r2 = t + (y2+1)*ii->stride;
+	unsigned int a = x1*ii->n_comp, b = (x2+1)*ii->n_comp, k;
+	if ( c>=0 )
+		return r2[b+c] - r2[a+c] - r1[b+c] + r1[a+c];
+	uint64_t total = 0;
+	for ( k=0 ; k<ii->n_comp ; k++ )
+		total += r2[b+k] - r2[a+k] - r1[b+k] + r1[a+k];
+	return total;
+}
+
+//! Evaluates the addition of sample values in an area
+/*!
+ *  Same as imgGetSumArea(), in constant time. The area is clipped to the image.
+ *  @param ii the IntegralImage, from imgIntegral()
+ *  @param x1 the column number of the top left corner of the image area to be processed
+ *  @param y1 the row number of the top left corner of the image area to be processed
+ *  @param x2 the column number of the bottom right corner of the image area to be processed
+ *  @param y2 the row number of the bottom right corner of the image area to be processed
+ *  @param c the component, or -1 for all components
+ *  @return The sum
+ */
+long long imgIntegralSum(IntegralImage *ii, int x1, int y1, int x2, int y2, int c)
+{
+	if ( ! imgIntegralClip(ii, &x1, &y1, &x2, &y2) ) return 0;
+	return imgIntegralArea(ii, ii->sum, x1, y1, x2, y2, c);
+}
+
+//! Evaluates the mean sample value in an area
+/*!
+ *  Same as imgGetMeanArea(), in constant time, see imgIntegralSum().
+ *  @return The mean, 0 for an empty area
+ */
+double imgIntegralMean(IntegralImage *ii, int x1, int y1, int x2, int y2, int c)
+{
+	if ( ! imgIntegralClip(ii, &x1, &y1, &x2, &y2) ) return 0.0;
+	double n = (double)(x2-x1+1) * (y2-y1+1) * ( c<0 ? ii->n_comp : 1 );
+	return imgIntegralArea(ii, ii->sum, x1, y1, x2, y2, c) / n;
+}
+
+//! Evaluates the sample variance in an area
+/*!
+ *  Evaluates the variance of the samples of component @p c, or of all components,
+ *  in constant time. The IntegralImage must have been built with squares.
+ *  See imgIntegralSum().
+ *  @return The variance, or -1 if there are no squared sums
+ */
+double imgIntegralVariance(IntegralImage *ii, int x1, int y1, int x2, int y2, int c)
+{
+	if ( ii->sqsum==NULL ) {
+		fprintf(stderr, "Integral image has no squared sums\n");
+		return -1.0;
+	}
+	if ( ! imgIntegralClip(ii, &x1, &y1, &x2, &y2) ) return 0.0;
+	uint64_t n = (uint64_t)(x2-x1+1) * (y2-y1+1) * ( c<0 ? ii->n_comp : 1 );
+	uint64_t s = imgIntegralArea(ii, ii->sum, x1, y1, x2, y2, c);
+	uint64_t s2 = imgIntegralArea(ii, ii->sqsum, x1, y1, x2, y2, c);
+	// n*s2 - s*s is exact in 128 bits, no cancellation on flat areas
+	unsigned __int128 num = (unsigned __int128)s2 * n - (unsigned __int128)s * s;
+	return (double)num / ((double)n * n);
+}
+
+/*
+ * Image pool.
+ * Images given back to a pool keep their pixel memory and are handed out
+ * again for the same width, height and depth, so steady state processing
+ * loops do not allocate.
+ */
+struct PoolImage {
+	Image img;			// first, so pool Images can be cast back
+	struct PoolImage *prev, *next;	// links in the free or in the used list
+	int in_use;
+};
+
+struct ImagePool {
+	pthread_mutex_t lock;
+	struct PoolImage *free_list;
+	struct PoolImage *used;		// handed out, see imgPoolReset()
+};
+
+static void imgPoolUnlink(struct PoolImage **list, struct PoolImage *pi)
+{
+	if ( pi->prev ) pi->prev->next = pi->next;
+	else *list = pi->next;
+	if ( pi->next ) pi->next->prev = pi->prev;
+}
+
+static void imgPoolLink(struct PoolImage **list, struct PoolImage *pi)
+{
+	pi->prev = NULL;
+	pi->next = *list;
+	if ( *list ) (*list)->prev = pi;
+	*list = pi;
+}
+
+// moves a released pool Image to the free list.
+// Memory still used by views or imgRetain() handles is left to them.
+static void imgPoolRecycle(ImagePool *pool, struct PoolImage *pi)
+{
+	imgPoolUnlink(&pool->used, pi);
+	pi->in_use = 0;
+	if ( __atomic_load_n(&pi->img.block->refs, __ATOMIC_ACQUIRE) > 1 ) {
+		imgBlockDrop(&pi->img);
+		free(pi);
+		return;
+	}
+	imgPoolLink(&pool->free_list, pi);
+}
+
+// gives a pool Image back to its pool, see imgDestroy()
+static void imgPoolPut(Image *img)
+{
+	ImagePool *pool = img->pool;
+	struct PoolImage *pi = (struct PoolImage *)img;
+	pthread_mutex_lock(&pool->lock);
+	if ( pi->in_use )
+		imgPoolRecycle(pool, pi);
+	else fprintf(stderr, "Image already given back to its pool\n");
+	pthread_mutex_unlock(&pool->lock);
+}
+
+//! Creates an image pool
+/*!
+ *  Pools recycle Images. An Image obtained from imgPoolGet() goes back to its
+ *  pool when released by imgDestroy(), or when imgPoolReset() is called,
+ *  and its memory is then reused by the next request of the same geometry.
+ *  Pools may be shared by several threads.
+ *  @return The new pool, to be released by imgPoolDestroy(), or NULL on error
+ */
+ImagePool *imgPoolNew(void)
+{
+	ImagePool *pool = calloc(1, sizeof(ImagePool));
+	if ( pool==NULL ) {
+		fprintf(stderr, "Could not allocate memory for image pool\n");
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	return pool;
+}
+
+//! Gets an Image from a pool
+/*!
+ *  Returns a free pool Image of the requested geometry, allocating a new one
+ *  only when there is none. As with imgNew(), colors are undefined.
+ *  @param pool the pool, or NULL to allocate with imgNew()
+ *  @param width the number of columns
+ *  @param height the number of rows
+ *  @param depth the pixel size in bits
+ *  @return The Image, or NULL on error
+ */
+Image *imgPoolGet(ImagePool *pool, unsigned int width, unsigned int height, unsigned short depth)
+{
+	if ( pool==NULL ) return imgNew(width, height, depth);
+
+	pthread_mutex_lock(&pool->lock);
+	struct PoolImage *pi;
+	for ( pi = pool->free_list ; pi ; pi = pi->next )
+		if ( pi->img.width==width && pi->img.height==height && pi->img.depth==depth )
+			break;
+	if ( pi ) imgPoolUnlink(&pool->free_list, pi);
+	pthread_mutex_unlock(&pool->lock);
+
+	if ( pi==NULL ) {
+		pi = calloc(1, sizeof(struct PoolImage));
+		if ( pi==NULL ) {
+			fprintf(stderr, "Failed to allocate memory for image container\n");
+			return NULL;
+		}
+		pi->img.width = width;
+		pi->img.height = height;
+		pi->img.depth = depth;
+		pi->img.pool = pool;
+		if ( imgAllocData(&pi->img) ) {
+			free(pi);
+			return NULL;
+		}
+	}
+	pi->img.format = depth==8 ? V4L2_PIX_FMT_GREY : 0;
+	pi->img.name = NULL;
+	pi->img.timestamp = 0;
+	pi->img.sequence = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	pi->in_use = 1;
+	imgPoolLink(&pool->used, pi);
+	pthread_mutex_unlock(&pool->lock);
+	return &pi->img;
+}
+
+//! Gives every Image of a pool back at once
+/*!
+ *  Used as a per frame arena: Images taken from @p pool while processing
+ *  a frame need not be released one by one. They must not be used after this call.
+ */
+void imgPoolReset(ImagePool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	struct PoolImage *pi;
+	while ( (pi = pool->used) )
+		imgPoolRecycle(pool, pi);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+//! Releases a pool and all its Images
+void imgPoolDestroy(ImagePool *pool)
+{
+	if ( pool==NULL ) return;
+	imgPoolReset(pool);
+	struct PoolImage *pi;
+	while ( (pi = pool->free_list) ) {
+		pool->free_list = pi->next;
+		imgBlockDrop(&pi->img);
+		free(pi);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+//! Destroys the image
+/*!
+ *  Same as imgRelease(). Images taken from a pool go back to it.
+ *  Pixel memory is freed when no view or imgRetain() handle uses it anymore.
+ */
 void imgDestroy(Image * img)
 {
 	if ( img==NULL ) {
 		fprintf(stderr,"Cannot destroy NULL image\n");
 		return;
 	}
-	// Free the SDL surface
-	//SDL_FreeSurface(img->sdl_surface);
-	if(img->mem_ptr != NULL){
-		free(img->mem_ptr);
+	if ( img->pool ) {
+		imgPoolPut(img);
+		return;
 	}
+	imgBlockDrop(img);
 	// Free the image container
 	free(img);
 }
 
+//! Shares an image
+/*!
+ *  Returns a new handle to the pixels of @p img, without copying them, so
+ *  the same frame can be handed to several consumers. Handles are copy on
+ *  write: functions writing to an Image call imgMakeWritable() first, so a
+ *  handle being modified gets its own copy while the pixels are shared.
+ *  Pixels are freed with the last handle, released by imgRelease().
+ *  Images without shared memory, as the temporary frames given to
+ *  callbacks, are copied instead.
+ *  @param img the Image to share
+ *  @return The new handle, or NULL on error
+ */
+Image *imgRetain(Image *img)
+{
+	if ( img->block==NULL ) return imgCopy(img);
+	Image *ref = malloc(sizeof(Image));
+	if ( ref==NULL ) {
+		fprintf(stderr, "Failed to allocate memory for image container\n");
+		return NULL;
+	}
+	*ref = *img;
+	ref->pool = NULL;
+	ref->name = NULL;
+	__atomic_add_fetch(&ref->block->refs, 1, __ATOMIC_RELAXED);
+	if ( ! (ref->flags & IMG_VIEW) )
+		__atomic_add_fetch(&ref->block->owners, 1, __ATOMIC_RELAXED);
+	return ref;
+}
+
+//! Releases an image handle
+/*!
+ *  Same as imgDestroy(), the counterpart of imgRetain().
+ */
+void imgRelease(Image *img)
+{
+	imgDestroy(img);
+}
+
+//! Prepares an image to be modified
+/*!
+ *  Copies the pixels of @p img to private memory if they are shared with
+ *  imgRetain() handles, so writing does not change what the others see.
+ *  Views always write to their parent's pixels.
+ *  @param img the Image about to be written
+ *  @return 0 on success and 1 on error
+ */
+int imgMakeWritable(Image *img)
+{
+	struct ImgBlock *blk = img->block;
+	if ( blk==NULL || (img->flags & IMG_VIEW) ||
+	     __atomic_load_n(&blk->owners, __ATOMIC_ACQUIRE) < 2 ) return 0;
+
+	Image priv = *img;
+	if ( imgAllocData(&priv) ) return 1;
+	unsigned int row = img->width * img->depth/8;
+	int y;
+	for ( y=0 ; y<img->height ; y++ )
+		memcpy(priv.data + y*priv.stride, img->data + y*img->stride, row);
+	imgBlockDrop(img);
+	img->block = priv.block;
+	img->mem_ptr = img->data = priv.data;
+	img->stride = priv.stride;
+	return 0;
+}
+
+// dispose function of wrapped memory the caller keeps
+static void imgKeepData(void *ctx, unsigned char *data)
+{
+}
+
+//! Creates an image on existing pixel memory
+/*!
+ *  The Image uses @p data in place and may be shared by imgRetain() and
+ *  imgView(). When the last handle is released, @p dispose is called with
+ *  @p ctx and @p data, allowing buffers owned by other libraries or by a
+ *  capture device to be given back.
+ *  @param data the first pixel
+ *  @param width the number of columns
+ *  @param height the number of rows
+ *  @param depth the pixel size in bits
+ *  @param stride the number of bytes from one row to the next
+ *  @param dispose called when @p data is no longer used, or NULL to leave it to the caller
+ *  @param ctx passed to @p dispose
+ *  @return The new Image, or NULL on error
+ */
+Image *imgWrap(unsigned char *data, unsigned int width, unsigned int height, unsigned short depth,
+		unsigned int stride, void (*dispose)(void *ctx, unsigned char *data), void *ctx)
+{
+	Image * img = calloc(1, sizeof(Image));
+	if(img == NULL){
+		fprintf(stderr, "Failed to allocate memory for image container\n");
+		return NULL;
+	}
+	img->block = imgBlockNew(data);
+	if ( img->block==NULL ) {
+		free(img);
+		return NULL;
+	}
+	img->block->dispose = dispose ? dispose : imgKeepData;
+	img->block->ctx = ctx;
+	img->width = width;
+	img->height = height;
+	img->depth = depth;
+	img->stride = stride;
+	if ( stride==width*depth/8 ) img->flags = IMG_PACKED;
+	img->mem_ptr = img->data = data;
+	if ( depth==8 ) img->format = V4L2_PIX_FMT_GREY;
+	return img;
+}
+
 //! Save RAW file.
 /*!
  *  Creates (or overwrites) a new file @fname to store Image @p img.
@@ -712,22 +3023,51 @@ void imgDestroy(Image * img)
  */
 int imgSaveRAW(Image *img, char *fname) {
     printf("writing frame with %d bytes, into file '%s'\n",img->depth/8,fname);
-    int outfd = open(fname, O_WRONLY);
+    int outfd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if ( outfd==-1 ) {
-	perror(strcat("Opening file ",fname));
+	perror(fname);
         return 1;
     }
-    unsigned int image_len = img->width*img->height*img->depth/8;
-    int res = write(outfd, img->data, image_len);
-    if ( res<1 ) {
-	perror("Writting data");
+    unsigned int row_len = img->width*img->depth/8;
+    unsigned int y;
+    for( y=0 ; y<img->height ; y++ ) {
+	int res = write(outfd, img->data + y*img->stride, row_len);
+	if ( res<1 ) {
+	    perror("Writting data");
+	    break;
+	}
     }
     close(outfd);
  
     return 0;
 }
 
+// writes RGB48 images with 16 bit samples, most significant byte first
+static int imgSavePPM16(Image *img, char *fname) {
+    FILE *outfd = fopen(fname, "w");
+    if ( outfd==NULL ) {
+	perror(fname);
+        return 1;
+    }
+    fprintf(outfd, "P6\n%d %d\n65535\n", img->width, img->height);
+    unsigned int x, y;
+    int c;
+    for( y=0 ; y<img->height ; y++ ) {
+	uint16_t *img_ptr = (uint16_t *)(img->data + y*img->stride);
+	for( x=0 ; x<img->width ; x++ ) {
+	    for( c=2 ; c>=0 ; c-- ) {
+		fputc(img_ptr[c] >> 8, outfd);
+		fputc(img_ptr[c] & 0xff, outfd);
+	    }
+	    img_ptr += 3;
+	}
+    }
+    fclose(outfd);
+    return 0;
+}
+
 int imgSavePPM(Image *img, char *fname) {
+    if ( img->format == RGB48 ) return imgSavePPM16(img, fname);
     if ( img->depth != 24 ) {
 	fprintf(stderr, "SavePPM is only avilable for 24 bit depth images\n");
 	return 1;
@@ -740,14 +3080,15 @@ int imgSavePPM(Image *img, char *fname) {
     }
     
     fprintf(outfd, "P6\n%d %d\n255\n", img->width, img->height);
-    unsigned int i;
-    unsigned int image_len = img->width * img->height;
-    unsigned char *img_ptr = img->data;
-    for( i=0 ; i<image_len ; i++ ) {
-	fputc(img_ptr[2], outfd);
-	fputc(img_ptr[1], outfd);
-	fputc(img_ptr[0], outfd);
-	img_ptr +=3;
+    unsigned int x, y;
+    for( y=0 ; y<img->height ; y++ ) {
+	unsigned char *img_ptr = img->data + y*img->stride;
+	for( x=0 ; x<img->width ; x++ ) {
+	    fputc(img_ptr[2], outfd);
+	    fputc(img_ptr[1], outfd);
+	    fputc(img_ptr[0], outfd);
+	    img_ptr +=3;
+	}
     }
     fclose(outfd);
     return 0;
@@ -761,17 +3102,20 @@ int imgSavePAM(Image *img, char *fname) {
         return 1;
     }
 
-    fprintf(outfd, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\n", img->width, img->height, img->depth/8);
-    if ( img->depth>24 ) 	fprintf(outfd, "TUPLTYPE RGB_ALPHA\n");
-    else if ( img->depth<=8 )	fprintf(outfd, "TUPLTYPE GRAYSCALE\n");
+    int wide = ( img->format==RGB48 || img->format==GREY16 );
+    fprintf(outfd, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\n", img->width, img->height,
+	img->depth/(wide ? 16 : 8), wide ? 65535 : 255);
+    if ( img->format==RGB48 )	fprintf(outfd, "TUPLTYPE RGB\n");
+    else if ( img->depth>24 ) 	fprintf(outfd, "TUPLTYPE RGB_ALPHA\n");
+    else if ( img->depth<=16 )	fprintf(outfd, "TUPLTYPE GRAYSCALE\n");
     else 			fprintf(outfd, "TUPLTYPE RGB\n");
     fprintf(outfd, "ENDHDR\n");
-    unsigned int i;
-    unsigned int image_len = img->width * img->height;
-    unsigned char *img_ptr = img->data;
-    switch ( img->format ) {
+    unsigned int i, y;
+    for( y=0 ; y<img->height ; y++ ) {
+      unsigned char *img_ptr = img->data + y*img->stride;
+      switch ( img->format ) {
 	case BGR24:
-	    for( i=0 ; i<image_len ; i++ ) {
+	    for( i=0 ; i<img->width ; i++ ) {
 		fputc(img_ptr[2], outfd);
 		fputc(img_ptr[1], outfd);
 		fputc(img_ptr[0], outfd);
@@ -779,7 +3123,7 @@ int imgSavePAM(Image *img, char *fname) {
 	    }
 	    break;
 	case RGB24:
-	    for( i=0 ; i<image_len ; i++ ) {
+	    for( i=0 ; i<img->width ; i++ ) {
 		fputc(img_ptr[0], outfd);
 		fputc(img_ptr[1], outfd);
 		fputc(img_ptr[2], outfd);
@@ -787,7 +3131,7 @@ int imgSavePAM(Image *img, char *fname) {
 	    }
 	    break;
 	case RGBA32:
-	    for( i=0 ; i<image_len ; i++ ) {
+	    for( i=0 ; i<img->width ; i++ ) {
 		fputc(img_ptr[0], outfd);
 		fputc(img_ptr[1], outfd);
 		fputc(img_ptr[2], outfd);
@@ -796,11 +3140,21 @@ int imgSavePAM(Image *img, char *fname) {
 	    }
 	    break;
 	case GREY:
-	    for( i=0 ; i<image_len ; i++ ) {
+	    for( i=0 ; i<img->width ; i++ ) {
 		fputc(img_ptr[i], outfd);
 	    }
 	    break;
-    }		
+	case RGB48:
+	case GREY16:
+	    // 16 bit samples are stored most significant byte first
+	    for( i=0 ; i<img->width*img->depth/16 ; i++ ) {
+		uint16_t v = ((uint16_t *)img_ptr)[i];
+		fputc(v >> 8, outfd);
+		fputc(v & 0xff, outfd);
+	    }
+	    break;
+      }
+    }
     fclose(outfd);
     return 0;
 }
@@ -0,0 +1,1012 @@
+/**
+ * @file	mjpeg.c
+ *
+ * Baseline JPEG decoder, used to convert MJPEG camera frames.
+ *
+ * Handles 8 bit baseline (sequential, Huffman coded) streams with one or
+ * three components and power of two chroma subsampling, which covers what
+ * webcams deliver. Frames without Huffman tables, as sent by most MJPEG
+ * cameras, use the default tables from the JPEG standard (Annex K.3).
+ *
+ * Huffman codes up to HUFF_LOOKUP bits are decoded with a single table lookup.
+ * The IDCT is the accurate integer algorithm from the IJG library, with an
+ * AVX2 version selected at run time that gives the same results.
+ * Streams with restart markers are decoded in parallel, each worker thread
+ * taking a group of restart intervals.
+ * A DC only mode produces 1/8 scale images without running the IDCT.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define JPEG_X86
+#include <immintrin.h>
+#endif
+
+#include "easimage.h"
+
+#define HUFF_LOOKUP	9
+
+struct HuffTable {
+	unsigned char look_len[1 << HUFF_LOOKUP];	// code length, 0 for longer codes
+	unsigned char look_val[1 << HUFF_LOOKUP];	// decoded symbol
+	// AC codes with their magnitude bits fitting in HUFF_LOOKUP bits
+	unsigned char fast_len[1 << HUFF_LOOKUP];	// code plus magnitude length, 0 if not fast
+	unsigned char fast_run[1 << HUFF_LOOKUP];	// zero run before the coefficient
+	short fast_val[1 << HUFF_LOOKUP];		// coefficient value
+	int maxcode[17];		// largest code of each length, -1 if none
+	int valoff[17];			// offset from a code to its symbol index, for each length
+	unsigned char vals[256];
+};
+
+struct JpegComponent {
+	int id;
+	int h, v;			// sampling factors
+	int tq;				// quantization table
+	int td, ta;			// DC and AC Huffman tables
+	int sx, sy;			// log2 of the subsampling ratios
+	unsigned int stride;		// bytes per plane row
+	unsigned char *plane;		// decoded samples
+};
+
+typedef void (*idct_fn)(const short *coef, const unsigned short *q,
+			unsigned char *out, unsigned int stride);
+
+struct JpegDecoder {
+	unsigned short qt[4][64];	// quantization tables, natural order
+	struct HuffTable dc[4], ac[4];
+	struct HuffTable def_dc[2], def_ac[2];
+	unsigned int width, height;
+	int ncomp;
+	int hmax, vmax;
+	unsigned int mcux, mcuy;	// MCUs per row and per column
+	unsigned int restart;		// restart interval, in MCUs
+	struct JpegComponent comp[3];
+	int dc_only;
+	idct_fn idct;
+	unsigned char *scratch;
+	size_t scratch_size;
+	// entropy coded segments, one per restart interval
+	const unsigned char **seg;
+	unsigned int n_seg, max_seg;
+	const unsigned char *scan_end;
+	// colour conversion tables
+	int cr_r[256], cb_b[256], cr_g[256], cb_g[256];
+	unsigned char range[768];	// clamps -256..511 to 0..255
+};
+
+// zig-zag index to natural order
+static const unsigned char jpeg_natural[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/*
+ * Default Huffman tables (JPEG standard, Annex K.3).
+ * Code counts for lengths 1 to 16, then symbols.
+ */
+static const unsigned char dc_lum_bits[16] = { 0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0 };
+static const unsigned char dc_chr_bits[16] = { 0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0 };
+static const unsigned char dc_vals[12] = { 0,1,2,3,4,5,6,7,8,9,10,11 };
+
+static const unsigned char ac_lum_bits[16] = { 0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d };
+static const unsigned char ac_lum_vals[162] = {
+	0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,
+	0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,
+	0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
+	0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,
+	0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,
+	0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+	0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,
+	0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,
+	0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
+	0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
+	0xf9,0xfa
+};
+
+static const unsigned char ac_chr_bits[16] = { 0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77 };
+static const unsigned char ac_chr_vals[162] = {
+	0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,
+	0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,
+	0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
+	0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,
+	0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,
+	0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+	0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,
+	0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,
+	0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
+	0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
+	0xf9,0xfa
+};
+
+// builds decoding tables from the code counts and symbols of a DHT segment
+static int huffBuild(struct HuffTable *h, const unsigned char *bits, const unsigned char *vals)
+{
+	int l, i, k = 0, code = 0, total = 0;
+	for ( l = 0 ; l < 16 ; l++ ) total += bits[l];
+	if ( total > 256 ) return 1;
+	memcpy(h->vals, vals, total);
+	memset(h->look_len, 0, sizeof(h->look_len));
+
+	for ( l = 1 ; l <= 16 ; l++ ) {
+		h->valoff[l] = k - code;
+		for ( i = 0 ; i < bits[l-1] ; i++, k++, code++ ) {
+			if ( l <= HUFF_LOOKUP ) {
+				int shift = HUFF_LOOKUP - l;
+				int j;
+				for ( j = 0 ; j < (1 << shift) ; j++ ) {
+					h->look_len[(code << shift) | j] = l;
+					h->look_val[(code << shift) | j] = vals[k];
+				}
+			}
+		}
+		h->maxcode[l] = bits[l-1] ? code - 1 : -1;
+		if ( code > (1 << l) ) return 1;	// over subscribed
+		code <<= 1;
+	}
+
+	// as an AC table, decode small coefficients in the same lookup
+	memset(h->fast_len, 0, sizeof(h->fast_len));
+	for ( i = 0 ; i < (1 << HUFF_LOOKUP) ; i++ ) {
+		int len = h->look_len[i], rs = h->look_val[i];
+		int s = rs & 15;
+		if ( len == 0 || s == 0 || len + s > HUFF_LOOKUP ) continue;
+		int v = (i >> (HUFF_LOOKUP - len - s)) & ((1 << s) - 1);
+		if ( v < (1 << (s - 1)) ) v -= (1 << s) - 1;
+		h->fast_len[i] = len + s;
+		h->fast_run[i] = rs >> 4;
+		h->fast_val[i] = v;
+	}
+	return 0;
+}
+
+/*
+ * Entropy decoding
+ */
+
+struct BitReader {
+	const unsigned char *p, *end;
+	uint64_t buf;			// MSB aligned bit buffer
+	int bits;
+};
+
+// refills the bit buffer, removing stuffed zero bytes.
+// Past the end of the segment, or at a marker, zero bits are fed.
+static inline void brFill(struct BitReader *br)
+{
+	// whole bytes at once when there are no 0xFF bytes to handle
+	if ( br->p + 8 <= br->end ) {
+		uint64_t w, nw;
+		memcpy(&w, br->p, 8);
+		nw = ~w;
+		if ( ! ((nw - 0x0101010101010101ULL) & w & 0x8080808080808080ULL) ) {
+			int n = (64 - br->bits) >> 3;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			w = __builtin_bswap64(w);
+#endif
+			br->buf |= (w >> (64 - 8*n)) << (64 - 8*n - br->bits);
+			br->bits += 8*n;
+			br->p += n;
+			return;
+		}
+	}
+	while ( br->bits <= 56 ) {
+		unsigned int c = 0;
+		if ( br->p < br->end ) {
+			c = *br->p;
+			if ( c == 0xFF ) {
+				if ( br->p + 1 < br->end && br->p[1] == 0x00 )
+					br->p += 2;
+				else {
+					c = 0;
+					br->end = br->p;
+				}
+			}
+			else br->p++;
+		}
+		br->buf |= (uint64_t)c << (56 - br->bits);
+		br->bits += 8;
+	}
+}
+
+static inline unsigned int brGet(struct BitReader *br, int n)
+{
+	unsigned int v = br->buf >> (64 - n);
+	br->buf <<= n;
+	br->bits -= n;
+	return v;
+}
+
+// decodes a Huffman symbol. The buffer must hold at least 16 bits.
+static inline int huffDecode(struct BitReader *br, const struct HuffTable *h)
+{
+	unsigned int idx = br->buf >> (64 - HUFF_LOOKUP);
+	int len = h->look_len[idx];
+	if ( len ) {
+		br->buf <<= len;
+		br->bits -= len;
+		return h->look_val[idx];
+	}
+	unsigned int code = br->buf >> 48;
+	int l;
+	for ( l = HUFF_LOOKUP + 1 ; l <= 16 ; l++ ) {
+		int c = code >> (16 - l);
+		if ( c <= h->maxcode[l] ) {
+			br->buf <<= l;
+			br->bits -= l;
+			return h->vals[(h->valoff[l] + c) & 0xff];
+		}
+	}
+	// invalid code, skip a bit
+	brGet(br, 1);
+	return 0;
+}
+
+// reads an s bit magnitude and extends its sign
+static inline int brExtend(struct BitReader *br, int s)
+{
+	int v = brGet(br, s);
+	return v < (1 << (s - 1)) ? v - (1 << s) + 1 : v;
+}
+
+// decodes one block into coef, in natural order and not dequantized.
+// returns the number of coefficients decoded, so 1 means DC only.
+static int decodeBlock(struct BitReader *br, const struct HuffTable *dc,
+		const struct HuffTable *ac, int *pred, short *coef, int dc_only)
+{
+	int k, last = 1;
+
+	if ( br->bits < 32 ) brFill(br);
+	int s = huffDecode(br, dc);
+	if ( s ) *pred += brExtend(br, s & 15);
+	coef[0] = *pred;
+
+	for ( k = 1 ; k < 64 ; k++ ) {
+		if ( br->bits < 32 ) brFill(br);
+		unsigned int idx = br->buf >> (64 - HUFF_LOOKUP);
+		int len = ac->fast_len[idx];
+		if ( len ) {
+			br->buf <<= len;
+			br->bits -= len;
+			k += ac->fast_run[idx];
+			if ( k > 63 ) break;
+			if ( ! dc_only ) {
+				coef[jpeg_natural[k]] = ac->fast_val[idx];
+				last = k + 1;
+			}
+			continue;
+		}
+		int rs = huffDecode(br, ac);
+		int r = rs >> 4;
+		s = rs & 15;
+		if ( s ) {
+			k += r;
+			if ( k > 63 ) break;
+			int v = brExtend(br, s);
+			if ( ! dc_only ) {
+				coef[jpeg_natural[k]] = v;
+				last = k + 1;
+			}
+		}
+		else if ( r == 15 ) k += 15;
+		else break;
+	}
+	return last;
+}
+
+/*
+ * Inverse DCT: accurate integer algorithm from the IJG library (jidctint.c).
+ */
+
+#define CONST_BITS	13
+#define PASS1_BITS	2
+#define FIX_0_298631336	2446
+#define FIX_0_390180644	3196
+#define FIX_0_541196100	4433
+#define FIX_0_765366865	6270
+#define FIX_0_899976223	7373
+#define FIX_1_175875602	9633
+#define FIX_1_501321110	12299
+#define FIX_1_847759065	15137
+#define FIX_1_961570560	16069
+#define FIX_2_053119869	16819
+#define FIX_2_562915447	20995
+#define FIX_3_072711026	25172
+#define DESCALE(x,n)	(((x) + (1 << ((n)-1))) >> (n))
+
+static inline unsigned char clampSample(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// sample value of a block with only the DC coefficient (dequantized)
+static inline unsigned char dcSample(int dcq)
+{
+	return clampSample(DESCALE(dcq * (1 << PASS1_BITS), PASS1_BITS + 3) + 128);
+}
+
+// one dimensional IDCT of in[0], in[step], ..., in[7*step]
+#define IDCT_1D(in, step, o, ostep, shift, post) do { \
+	int z1, z2, z3, z4, z5; \
+	int tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13; \
+	z2 = in[2*step]; \
+	z3 = in[6*step]; \
+	z1 = (z2 + z3) * FIX_0_541196100; \
+	tmp2 = z1 + z3 * (-FIX_1_847759065); \
+	tmp3 = z1 + z2 * FIX_0_765366865; \
+	z2 = in[0]; \
+	z3 = in[4*step]; \
+	tmp0 = (z2 + z3) * (1 << CONST_BITS); \
+	tmp1 = (z2 - z3) * (1 << CONST_BITS); \
+	tmp10 = tmp0 + tmp3; \
+	tmp13 = tmp0 - tmp3; \
+	tmp11 = tmp1 + tmp2; \
+	tmp12 = tmp1 - tmp2; \
+	tmp0 = in[7*step]; \
+	tmp1 = in[5*step]; \
+	tmp2 = in[3*step]; \
+	tmp3 = in[1*step]; \
+	z1 = tmp0 + tmp3; \
+	z2 = tmp1 + tmp2; \
+	z3 = tmp0 + tmp2; \
+	z4 = tmp1 + tmp3; \
+	z5 = (z3 + z4) * FIX_1_175875602; \
+	tmp0 *= FIX_0_298631336; \
+	tmp1 *= FIX_2_053119869; \
+	tmp2 *= FIX_3_072711026; \
+	tmp3 *= FIX_1_501321110; \
+	z1 *= -FIX_0_899976223; \
+	z2 *= -FIX_2_562915447; \
+	z3 *= -FIX_1_961570560; \
+	z4 *= -FIX_0_390180644; \
+	z3 += z5; \
+	z4 += z5; \
+	tmp0 += z1 + z3; \
+	tmp1 += z2 + z4; \
+	tmp2 += z2 + z3; \
+	tmp3 += z1 + z4; \
+	o[0*ostep] = post(DESCALE(tmp10 + tmp3, shift)); \
+	o[7*ostep] = post(DESCALE(tmp10 - tmp3, shift)); \
+	o[1*ostep] = post(DESCALE(tmp11 + tmp2, shift)); \
+	o[6*ostep] = post(DESCALE(tmp11 - tmp2, shift)); \
+	o[2*ostep] = post(DESCALE(tmp12 + tmp1, shift)); \
+	o[5*ostep] = post(DESCALE(tmp12 - tmp1, shift)); \
+	o[3*ostep] = post(DESCALE(tmp13 + tmp0, shift)); \
+	o[4*ostep] = post(DESCALE(tmp13 - tmp0, shift)); \
+} while(0)
+
+#define IDCT_NOPOST(x)	(x)
+#define IDCT_SAMPLE(x)	clampSample((x) + 128)
+
+static void idct_scalar(const short *coef, const unsigned short *q,
+			unsigned char *out, unsigned int stride)
+{
+	int ws[64];
+	int in[64];
+	int i;
+	for ( i = 0 ; i < 64 ; i++ )
+		in[i] = coef[i] * q[i];
+	// columns
+	for ( i = 0 ; i < 8 ; i++ ) {
+		const int *c = in + i;
+		IDCT_1D(c, 8, (ws + i), 8, CONST_BITS - PASS1_BITS, IDCT_NOPOST);
+	}
+	// rows
+	for ( i = 0 ; i < 8 ; i++ ) {
+		const int *r = ws + 8*i;
+		unsigned char *o = out + i*stride;
+		IDCT_1D(r, 1, o, 1, CONST_BITS + PASS1_BITS + 3, IDCT_SAMPLE);
+	}
+}
+
+#ifdef JPEG_X86
+
+#define MUL32(a, c)	_mm256_mullo_epi32(a, _mm256_set1_epi32(c))
+
+// 1-D IDCT across vectors v[0..7], each lane an independent transform
+__attribute__((target("avx2")))
+static inline void idct_1d_avx2(__m256i *v, int shift)
+{
+	__m256i z1, z2, z3, z4, z5;
+	__m256i tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+	z2 = v[2];
+	z3 = v[6];
+	z1 = MUL32(_mm256_add_epi32(z2, z3), FIX_0_541196100);
+	tmp2 = _mm256_add_epi32(z1, MUL32(z3, -FIX_1_847759065));
+	tmp3 = _mm256_add_epi32(z1, MUL32(z2, FIX_0_765366865));
+	z2 = v[0];
+	z3 = v[4];
+	tmp0 = _mm256_slli_epi32(_mm256_add_epi32(z2, z3), CONST_BITS);
+	tmp1 = _mm256_slli_epi32(_mm256_sub_epi32(z2, z3), CONST_BITS);
+	tmp10 = _mm256_add_epi32(tmp0, tmp3);
+	tmp13 = _mm256_sub_epi32(tmp0, tmp3);
+	tmp11 = _mm256_add_epi32(tmp1, tmp2);
+	tmp12 = _mm256_sub_epi32(tmp1, tmp2);
+
+	tmp0 = v[7];
+	tmp1 = v[5];
+	tmp2 = v[3];
+	tmp3 = v[1];
+	z1 = _mm256_add_epi32(tmp0, tmp3);
+	z2 = _mm256_add_epi32(tmp1, tmp2);
+	z3 = _mm256_add_epi32(tmp0, tmp2);
+	z4 = _mm256_add_epi32(tmp1, tmp3);
+	z5 = MUL32(_mm256_add_epi32(z3, z4), FIX_1_175875602);
+	tmp0 = MUL32(tmp0, FIX_0_298631336);
+	tmp1 = MUL32(tmp1, FIX_2_053119869);
+	tmp2 = MUL32(tmp2, FIX_3_072711026);
+	tmp3 = MUL32(tmp3, FIX_1_501321110);
+	z1 = MUL32(z1, -FIX_0_899976223);
+	z2 = MUL32(z2, -FIX_2_562915447);
+	z3 = _mm256_add_epi32(MUL32(z3, -FIX_1_961570560), z5);
+	z4 = _mm256_add_epi32(MUL32(z4, -FIX_0_390180644), z5);
+	tmp0 = _mm256_add_epi32(tmp0, _mm256_add_epi32(z1, z3));
+	tmp1 = _mm256_add_epi32(tmp1, _mm256_add_epi32(z2, z4));
+	tmp2 = _mm256_add_epi32(tmp2, _mm256_add_epi32(z2, z3));
+	tmp3 = _mm256_add_epi32(tmp3, _mm256_add_epi32(z1, z4));
+
+	__m256i rnd = _mm256_set1_epi32(1 << (shift - 1));
+	__m128i cnt = _mm_cvtsi32_si128(shift);
+	tmp10 = _mm256_add_epi32(tmp10, rnd);
+	tmp11 = _mm256_add_epi32(tmp11, rnd);
+	tmp12 = _mm256_add_epi32(tmp12, rnd);
+	tmp13 = _mm256_add_epi32(tmp13, rnd);
+	v[0] = _mm256_sra_epi32(_mm256_add_epi32(tmp10, tmp3), cnt);
+	v[7] = _mm256_sra_epi32(_mm256_sub_epi32(tmp10, tmp3), cnt);
+	v[1] = _mm256_sra_epi32(_mm256_add_epi32(tmp11, tmp2), cnt);
+	v[6] = _mm256_sra_epi32(_mm256_sub_epi32(tmp11, tmp2), cnt);
+	v[2] = _mm256_sra_epi32(_mm256_add_epi32(tmp12, tmp1), cnt);
+	v[5] = _mm256_sra_epi32(_mm256_sub_epi32(tmp12, tmp1), cnt);
+	v[3] = _mm256_sra_epi32(_mm256_add_epi32(tmp13, tmp0), cnt);
+	v[4] = _mm256_sra_epi32(_mm256_sub_epi32(tmp13, tmp0), cnt);
+}
+
+__attribute__((target("avx2")))
+static inline void transpose8x8_epi32(__m256i *v)
+{
+	__m256i t0 = _mm256_unpacklo_epi32(v[0], v[1]);
+	__m256i t1 = _mm256_unpackhi_epi32(v[0], v[1]);
+	__m256i t2 = _mm256_unpacklo_epi32(v[2], v[3]);
+	__m256i t3 = _mm256_unpackhi_epi32(v[2], v[3]);
+	__m256i t4 = _mm256_unpacklo_epi32(v[4], v[5]);
+	__m256i t5 = _mm256_unpackhi_epi32(v[4], v[5]);
+	__m256i t6 = _mm256_unpacklo_epi32(v[6], v[7]);
+	__m256i t7 = _mm256_unpackhi_epi32(v[6], v[7]);
+	__m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+	__m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+	__m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+	__m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+	__m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+	__m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+	__m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+	__m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+	v[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+	v[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+	v[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+	v[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+	v[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+	v[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+	v[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+	v[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+// Same arithmetic as idct_scalar(), eight lanes at a time
+__attribute__((target("avx2")))
+static void idct_avx2(const short *coef, const unsigned short *q,
+			unsigned char *out, unsigned int stride)
+{
+	__m256i v[8];
+	int i;
+	for ( i = 0 ; i < 8 ; i++ ) {
+		__m256i c = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(coef + 8*i)));
+		__m256i qq = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(q + 8*i)));
+		v[i] = _mm256_mullo_epi32(c, qq);
+	}
+	idct_1d_avx2(v, CONST_BITS - PASS1_BITS);	// columns
+	transpose8x8_epi32(v);
+	idct_1d_avx2(v, CONST_BITS + PASS1_BITS + 3);	// rows
+	transpose8x8_epi32(v);
+	const __m256i center = _mm256_set1_epi32(128);
+	for ( i = 0 ; i < 8 ; i++ ) {
+		__m256i x = _mm256_add_epi32(v[i], center);
+		__m128i w = _mm_packs_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+		_mm_storel_epi64((__m128i *)(out + i*stride), _mm_packus_epi16(w, w));
+	}
+}
+
+#endif // JPEG_X86
+
+/*
+ * Stream parsing
+ */
+
+static inline unsigned int get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static int jpegError(const char *msg)
+{
+	fprintf(stderr, "jpegDecode() error: %s\n", msg);
+	return 1;
+}
+
+static int parseSOF(struct JpegDecoder *dec, const unsigned char *p, unsigned int len)
+{
+	if ( len < 6 ) return jpegError("bad frame header");
+	if ( p[0] != 8 ) return jpegError("only 8 bit samples are supported");
+	dec->height = get16(p + 1);
+	dec->width = get16(p + 3);
+	dec->ncomp = p[5];
+	if ( dec->width == 0 || dec->height == 0 ) return jpegError("bad image size");
+	if ( dec->ncomp != 1 && dec->ncomp != 3 ) return jpegError("only 1 or 3 components are supported");
+	if ( len < 6u + 3*dec->ncomp ) return jpegError("bad frame header");
+
+	int c;
+	dec->hmax = dec->vmax = 1;
+	for ( c = 0 ; c < dec->ncomp ; c++ ) {
+		struct JpegComponent *comp = &dec->comp[c];
+		comp->id = p[6 + 3*c];
+		comp->h = p[7 + 3*c] >> 4;
+		comp->v = p[7 + 3*c] & 15;
+		comp->tq = p[8 + 3*c] & 3;
+		if ( comp->h < 1 || comp->h > 4 || comp->v < 1 || comp->v > 4 )
+			return jpegError("bad sampling factors");
+		if ( dec->ncomp == 1 ) comp->h = comp->v = 1;	// single block MCUs
+		dec->hmax = max(dec->hmax, comp->h);
+		dec->vmax = max(dec->vmax, comp->v);
+	}
+	for ( c = 0 ; c < dec->ncomp ; c++ ) {
+		struct JpegComponent *comp = &dec->comp[c];
+		int rx = dec->hmax / comp->h, ry = dec->vmax / comp->v;
+		if ( rx * comp->h != dec->hmax || ry * comp->v != dec->vmax ||
+		     (rx & (rx - 1)) || (ry & (ry - 1)) )
+			return jpegError("unsupported subsampling");
+		comp->sx = rx == 4 ? 2 : rx - 1;
+		comp->sy = ry == 4 ? 2 : ry - 1;
+	}
+	dec->mcux = (dec->width + 8*dec->hmax - 1) / (8*dec->hmax);
+	dec->mcuy = (dec->height + 8*dec->vmax - 1) / (8*dec->vmax);
+	return 0;
+}
+
+static int parseDHT(struct JpegDecoder *dec, const unsigned char *p, unsigned int len)
+{
+	while ( len >= 17 ) {
+		int tc = p[0] >> 4, th = p[0] & 3;
+		unsigned int i, total = 0;
+		for ( i = 0 ; i < 16 ; i++ ) total += p[1 + i];
+		if ( len < 17 + total ) break;
+		if ( huffBuild(tc ? &dec->ac[th] : &dec->dc[th], p + 1, p + 17) )
+			return jpegError("bad Huffman table");
+		p += 17 + total;
+		len -= 17 + total;
+	}
+	return len ? jpegError("bad Huffman table") : 0;
+}
+
+static int parseDQT(struct JpegDecoder *dec, const unsigned char *p, unsigned int len)
+{
+	while ( len >= 65 ) {
+		int pq = p[0] >> 4, tq = p[0] & 3;
+		unsigned int i, n = pq ? 129 : 65;
+		if ( len < n ) break;
+		for ( i = 0 ; i < 64 ; i++ )
+			dec->qt[tq][jpeg_natural[i]] = pq ? get16(p + 1 + 2*i) : p[1 + i];
+		p += n;
+		len -= n;
+	}
+	return len ? jpegError("bad quantization table") : 0;
+}
+
+static int parseSOS(struct JpegDecoder *dec, const unsigned char *p, unsigned int len)
+{
+	if ( dec->ncomp == 0 ) return jpegError("scan before frame header");
+	if ( len < 1 || len < 1u + 2*p[0] + 3 ) return jpegError("bad scan header");
+	if ( p[0] != dec->ncomp ) return jpegError("only interleaved single scan images are supported");
+	int i, c;
+	for ( i = 0 ; i < p[0] ; i++ ) {
+		for ( c = 0 ; c < dec->ncomp ; c++ )
+			if ( dec->comp[c].id == p[1 + 2*i] ) break;
+		if ( c != i ) return jpegError("unexpected scan component");
+		dec->comp[c].td = p[2 + 2*i] >> 4 & 3;
+		dec->comp[c].ta = p[2 + 2*i] & 3;
+	}
+	return 0;
+}
+
+// parses markers up to the start of scan. Returns the entropy coded data.
+static const unsigned char *jpegParse(struct JpegDecoder *dec,
+			const unsigned char *data, unsigned int size)
+{
+	const unsigned char *p = data, *end = data + size;
+	if ( size < 4 || p[0] != 0xFF || p[1] != 0xD8 ) {
+		jpegError("not a JPEG stream");
+		return NULL;
+	}
+	p += 2;
+
+	// webcams usually leave the Huffman tables out
+	dec->dc[0] = dec->def_dc[0];
+	dec->dc[1] = dec->def_dc[1];
+	dec->ac[0] = dec->def_ac[0];
+	dec->ac[1] = dec->def_ac[1];
+	dec->restart = 0;
+	dec->ncomp = 0;
+
+	while ( p + 4 <= end ) {
+		if ( *p != 0xFF ) { p++; continue; }
+		unsigned int m = p[1];
+		if ( m == 0xFF ) { p++; continue; }	// fill byte
+		p += 2;
+		if ( m == 0xD8 || (m >= 0xD0 && m <= 0xD7) || m == 0x01 ) continue;
+		if ( m == 0xD9 ) break;
+		unsigned int len = get16(p);
+		if ( len < 2 || p + len > end ) break;
+		const unsigned char *seg = p + 2;
+		len -= 2;
+		p += len + 2;
+		int err = 0;
+		switch ( m ) {
+			case 0xC0:	// baseline
+			case 0xC1:	// extended sequential, Huffman
+				err = parseSOF(dec, seg, len);
+				break;
+			case 0xC4:
+				err = parseDHT(dec, seg, len);
+				break;
+			case 0xDB:
+				err = parseDQT(dec, seg, len);
+				break;
+			case 0xDD:
+				if ( len >= 2 ) dec->restart = get16(seg);
+				break;
+			case 0xDA:
+				if ( parseSOS(dec, seg, len) ) return NULL;
+				return p;
+			default:
+				if ( m >= 0xC2 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC ) {
+					jpegError("progressive, lossless and arithmetic coded JPEG are not supported");
+					return NULL;
+				}
+				break;	// APPn, COM, ...
+		}
+		if ( err ) return NULL;
+	}
+	jpegError("no image data");
+	return NULL;
+}
+
+// splits the entropy coded data at restart markers
+static int jpegFindSegments(struct JpegDecoder *dec, const unsigned char *scan,
+			const unsigned char *end)
+{
+	unsigned int total = dec->mcux * dec->mcuy;
+	unsigned int expected = dec->restart ? (total + dec->restart - 1) / dec->restart : 1;
+	if ( expected > dec->max_seg ) {
+		const unsigned char **seg = realloc(dec->seg, expected * sizeof(*seg));
+		if ( seg == NULL ) return jpegError("out of memory");
+		dec->seg = seg;
+		dec->max_seg = expected;
+	}
+	dec->seg[0] = scan;
+	dec->n_seg = 1;
+	dec->scan_end = end;
+	if ( expected == 1 ) return 0;
+
+	const unsigned char *p = scan;
+	while ( p + 1 < end ) {
+		p = memchr(p, 0xFF, end - p - 1);
+		if ( p == NULL ) break;
+		unsigned int m = p[1];
+		if ( m == 0x00 || m == 0xFF ) {
+			p++;
+			continue;
+		}
+		if ( m >= 0xD0 && m <= 0xD7 ) {
+			if ( dec->n_seg < expected )
+				dec->seg[dec->n_seg++] = p + 2;
+			p += 2;
+			continue;
+		}
+		dec->scan_end = p;	// end of scan
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Decoding
+ */
+
+// decodes the MCUs of one restart interval into the component planes
+static void jpegDecodeInterval(struct JpegDecoder *dec, unsigned int index)
+{
+	const unsigned char *start = dec->seg[index];
+	const unsigned char *end = index + 1 < dec->n_seg ? dec->seg[index + 1] - 2 : dec->scan_end;
+	struct BitReader br = { start, end, 0, 0 };
+	int pred[3] = { 0, 0, 0 };
+	short coef[64] __attribute__((aligned(16)));
+
+	unsigned int total = dec->mcux * dec->mcuy;
+	unsigned int first = dec->restart ? index * dec->restart : 0;
+	unsigned int last = dec->restart ? min(first + dec->restart, total) : total;
+	unsigned int m;
+	int c, h, v;
+
+	for ( m = first ; m < last ; m++ ) {
+		unsigned int mx = m % dec->mcux, my = m / dec->mcux;
+		for ( c = 0 ; c < dec->ncomp ; c++ ) {
+			struct JpegComponent *comp = &dec->comp[c];
+			const unsigned short *q = dec->qt[comp->tq];
+			for ( v = 0 ; v < comp->v ; v++ )
+			for ( h = 0 ; h < comp->h ; h++ ) {
+				unsigned int bx = mx * comp->h + h;
+				unsigned int by = my * comp->v + v;
+				if ( dec->dc_only ) {
+					decodeBlock(&br, &dec->dc[comp->td], &dec->ac[comp->ta],
+						&pred[c], coef, 1);
+					comp->plane[by * comp->stride + bx] = dcSample(coef[0] * q[0]);
+					continue;
+				}
+				memset(coef, 0, sizeof(coef));
+				int n = decodeBlock(&br, &dec->dc[comp->td], &dec->ac[comp->ta],
+						&pred[c], coef, 0);
+				unsigned char *out = comp->plane + by * 8 * comp->stride + bx * 8;
+				if ( n == 1 ) {
+					// flat block, no IDCT needed
+					unsigned char s = dcSample(coef[0] * q[0]);
+					int r;
+					for ( r = 0 ; r < 8 ; r++ )
+						memset(out + r * comp->stride, s, 8);
+				}
+				else
+					dec->idct(coef, q, out, comp->stride);
+			}
+		}
+	}
+}
+
+struct JpegJob {
+	struct JpegDecoder *dec;
+	Image *img;
+	unsigned int n_tasks;
+	unsigned int rows;		// output rows per colour conversion band
+};
+
+static void jpegDecodeTask(void *arg, unsigned int task)
+{
+	struct JpegJob *job = arg;
+	struct JpegDecoder *dec = job->dec;
+	unsigned int i0 = (unsigned long)dec->n_seg * task / job->n_tasks;
+	unsigned int i1 = (unsigned long)dec->n_seg * (task + 1) / job->n_tasks;
+	unsigned int i;
+	for ( i = i0 ; i < i1 ; i++ )
+		jpegDecodeInterval(dec, i);
+}
+
+// converts a row with full resolution luma and chroma subsampled by 2^sx.
+// ir is the offset of the red byte in the output pixel.
+static inline __attribute__((always_inline)) void jpegColorRow(const struct JpegDecoder *dec,
+		const unsigned char *py, const unsigned char *pb, const unsigned char *pr,
+		unsigned char *out, unsigned int width, int sx, int ir)
+{
+	const unsigned char *range = dec->range + 256;
+	const int ib = 2 - ir;
+	unsigned int x = 0, i, n = 1 << sx;
+	for ( ; x + n <= width ; pb++, pr++ ) {
+		int cred = dec->cr_r[*pr];
+		int cgreen = (dec->cb_g[*pb] + dec->cr_g[*pr]) >> 16;
+		int cblue = dec->cb_b[*pb];
+		for ( i = 0 ; i < n ; i++, x++, out += 3 ) {
+			int l = py[x];
+			out[ir] = range[l + cred];
+			out[1]  = range[l + cgreen];
+			out[ib] = range[l + cblue];
+		}
+	}
+	for ( ; x < width ; x++, out += 3 ) {
+		int l = py[x];
+		out[ir] = range[l + dec->cr_r[*pr]];
+		out[1]  = range[l + ((dec->cb_g[*pb] + dec->cr_g[*pr]) >> 16)];
+		out[ib] = range[l + dec->cb_b[*pb]];
+	}
+}
+
+// converts output rows [y0,y1) from the component planes
+static void jpegColorTask(void *arg, unsigned int band)
+{
+	struct JpegJob *job = arg;
+	struct JpegDecoder *dec = job->dec;
+	Image *img = job->img;
+	unsigned int y0 = band * job->rows;
+	unsigned int y1 = min(y0 + job->rows, img->height);
+	unsigned int x, y;
+	const int ir = img->format == BGR24 ? 0 : 2;
+	const int ib = 2 - ir;
+	const struct JpegComponent *cy = &dec->comp[0];
+	const struct JpegComponent *cb = &dec->comp[1];
+	const struct JpegComponent *cr = &dec->comp[2];
+
+	for ( y = y0 ; y < y1 ; y++ ) {
+		unsigned char *out = img->data + y * img->stride;
+		const unsigned char *py = cy->plane + (y >> cy->sy) * cy->stride;
+		if ( img->format == GREY ) {
+			for ( x = 0 ; x < img->width ; x++ )
+				out[x] = py[x >> cy->sx];
+			continue;
+		}
+		if ( dec->ncomp == 1 ) {
+			for ( x = 0 ; x < img->width ; x++, out += 3 )
+				out[0] = out[1] = out[2] = py[x];
+			continue;
+		}
+		const unsigned char *pb = cb->plane + (y >> cb->sy) * cb->stride;
+		const unsigned char *pr = cr->plane + (y >> cr->sy) * cr->stride;
+		// common webcam layouts
+		if ( cy->sx == 0 && cb->sx == cr->sx && cb->sx <= 1 ) {
+			if ( cb->sx ) {
+				if ( ir ) jpegColorRow(dec, py, pb, pr, out, img->width, 1, 2);
+				else      jpegColorRow(dec, py, pb, pr, out, img->width, 1, 0);
+			}
+			else {
+				if ( ir ) jpegColorRow(dec, py, pb, pr, out, img->width, 0, 2);
+				else      jpegColorRow(dec, py, pb, pr, out, img->width, 0, 0);
+			}
+			continue;
+		}
+		for ( x = 0 ; x < img->width ; x++, out += 3 ) {
+			int l = py[x >> cy->sx];
+			int u = pb[x >> cb->sx];
+			int v = pr[x >> cr->sx];
+			out[ir] = clampSample(l + dec->cr_r[v]);
+			out[1]  = clampSample(l + ((dec->cb_g[u] + dec->cr_g[v]) >> 16));
+			out[ib] = clampSample(l + dec->cb_b[u]);
+		}
+	}
+}
+
+/**
+ *  \addtogroup convert
+ *  @{
+ */
+
+//! Creates a JPEG decoder
+/*!
+ *  A decoder keeps its tables and work buffers between frames,
+ *  so a stream of MJPEG frames is decoded without further allocations.
+ *  @return The new decoder, to be released by jpegDestroy()
+ */
+JpegDecoder *jpegNew(void)
+{
+	JpegDecoder *dec = calloc(1, sizeof(JpegDecoder));
+	if ( dec == NULL ) {
+		fprintf(stderr, "Could not allocate memory for JPEG decoder\n");
+		return NULL;
+	}
+	huffBuild(&dec->def_dc[0], dc_lum_bits, dc_vals);
+	huffBuild(&dec->def_dc[1], dc_chr_bits, dc_vals);
+	huffBuild(&dec->def_ac[0], ac_lum_bits, ac_lum_vals);
+	huffBuild(&dec->def_ac[1], ac_chr_bits, ac_chr_vals);
+
+	// YCbCr to RGB, as in the IJG library (jdcolor.c)
+	int i;
+	for ( i = 0 ; i < 256 ; i++ ) {
+		int x = i - 128;
+		dec->cr_r[i] = (91881 * x + 32768) >> 16;	// 1.40200
+		dec->cb_b[i] = (116130 * x + 32768) >> 16;	// 1.77200
+		dec->cr_g[i] = -46802 * x;			// 0.71414
+		dec->cb_g[i] = -22554 * x + 32768;		// 0.34414
+	}
+	for ( i = 0 ; i < 768 ; i++ )
+		dec->range[i] = clampSample(i - 256);
+
+	dec->idct = idct_scalar;
+#ifdef JPEG_X86
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("avx2") ) dec->idct = idct_avx2;
+#endif
+	return dec;
+}
+
+//! Releases a JPEG decoder
+void jpegDestroy(JpegDecoder *dec)
+{
+	if ( dec == NULL ) return;
+	free(dec->scratch);
+	free(dec->seg);
+	free(dec);
+}
+
+//! Gets the size of a JPEG image
+/*!
+ *  Parses the headers of the JPEG stream @p data, of @p size bytes.
+ *  @return 0 on success and 1 if the stream can not be decoded
+ */
+int jpegGetSize(JpegDecoder *dec, const unsigned char *data, unsigned int size,
+		unsigned int *width, unsigned int *height)
+{
+	if ( jpegParse(dec, data, size) == NULL ) return 1;
+	*width = dec->width;
+	*height = dec->height;
+	return 0;
+}
+
+//! Decodes a JPEG image
+/*!
+ *  Decodes the baseline JPEG (or MJPEG frame) @p data, of @p size bytes, into Image @p img.
+ *  Image @p img must use the RGB24, BGR24 or GREY format.
+ *  If it has the size of the JPEG image, a full decode is done.
+ *  If its size is 1/8 of the JPEG image size (rounded up), only the DC
+ *  coefficients are used, which is much faster and suited for previews.
+ *  When @p workers is not NULL and the stream has restart markers, restart
+ *  intervals are decoded in parallel. Colour conversion is always split over
+ *  the pool threads.
+ *  @param dec decoder created by jpegNew()
+ *  @param data the JPEG stream
+ *  @param size the size of the JPEG stream in bytes
+ *  @param img destination Image
+ *  @param workers optional pool of worker threads
+ *  @return 0 on success and 1 on error
+ */
+int jpegDecode(JpegDecoder *dec, const unsigned char *data, unsigned int size,
+		Image *img, WorkPool *workers)
+{
+	const unsigned char *scan = jpegParse(dec, data, size);
+	if ( scan == NULL ) return 1;
+
+	if ( img->format != RGB24 && img->format != BGR24 && img->format != GREY )
+		return jpegError("output image must be RGB24, BGR24 or GREY");
+	if ( imgMakeWritable(img) ) return 1;
+	if ( img->width == dec->width && img->height == dec->height )
+		dec->dc_only = 0;
+	else if ( img->width == (dec->width + 7) / 8 && img->height == (dec->height + 7) / 8 )
+		dec->dc_only = 1;
+	else
+		return jpegError("output image size does not match");
+
+	// component planes, padded to whole MCUs
+	size_t need = 0;
+	int c;
+	const unsigned int bs = dec->dc_only ? 1 : 8;
+	for ( c = 0 ; c < dec->ncomp ; c++ ) {
+		struct JpegComponent *comp = &dec->comp[c];
+		comp->stride = dec->mcux * comp->h * bs;
+		need += (size_t)comp->stride * dec->mcuy * comp->v * bs;
+	}
+	if ( need > dec->scratch_size ) {
+		unsigned char *s = realloc(dec->scratch, need);
+		if ( s == NULL ) return jpegError("out of memory");
+		dec->scratch = s;
+		dec->scratch_size = need;
+	}
+	need = 0;
+	for ( c = 0 ; c < dec->ncomp ; c++ ) {
+		struct JpegComponent *comp = &dec->comp[c];
+		comp->plane = dec->scratch + need;
+		need += (size_t)comp->stride * dec->mcuy * comp->v * bs;
+	}
+
+	if ( jpegFindSegments(dec, scan, data + size) ) return 1;
+
+	struct JpegJob job;
+	job.dec = dec;
+	job.img = img;
+	job.n_tasks = min(dec->n_seg, poolSize(workers));
+	poolRun(workers, jpegDecodeTask, &job, job.n_tasks);
+
+	unsigned int n_bands = poolSize(workers);
+	job.rows = (img->height + n_bands - 1) / n_bands;
+	poolRun(workers, jpegColorTask, &job, n_bands);
+	return 0;
+}
+
+/**
+ *  @}
+ */
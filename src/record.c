@@ -0,0 +1,342 @@
+/**
+ * @file	record.c
+ *
+ * Streaming frame recorder.
+ *
+ * Frames are copied into a bounded queue and appended to a single container
+ * file by a writer thread, so producers never wait for the disk unless asked to.
+ * The writer gathers frames into a large aligned buffer and writes it with
+ * O_DIRECT where the file system allows it, bypassing the page cache.
+ * The file layout is described with RecFrameHeader in easimage.h.
+ *
+ */
+
+#define _GNU_SOURCE		/* O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "easimage.h"
+
+#define REC_ALIGN	4096		// O_DIRECT offset, size and memory alignment
+#define REC_CHUNK	(4 << 20)	// bytes per write
+
+struct RecSlot {
+	RecFrameHeader hdr;
+	unsigned char *data;
+	unsigned int capacity;
+	int ready;			// filled and waiting for the writer
+	int skip;			// could not be filled, not to be written
+};
+
+struct Recorder {
+	int fd;
+	int direct;			// fd uses O_DIRECT
+	int policy;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full;
+	struct RecSlot *slots;
+	unsigned int n_slots, head, count;
+	int writer_busy;		// the writer is copying the head slot
+	int stop, error;
+	unsigned char *chunk;		// aligned staging buffer
+	unsigned int chunk_used;
+	unsigned long long offset;	// file offset of the staging buffer
+	RecStats stats;
+};
+
+// writes the staging buffer. The last write is padded to the alignment
+// O_DIRECT needs, and the file is then cut back to its real size.
+static int recFlush(Recorder *rec, int final)
+{
+	unsigned int len = rec->chunk_used;
+	if ( final && rec->direct ) {
+		len = (len + REC_ALIGN - 1) & ~(REC_ALIGN - 1);
+		memset(rec->chunk + rec->chunk_used, 0, len - rec->chunk_used);
+	}
+	unsigned int done = 0;
+	while ( done < len ) {
+		ssize_t r = pwrite(rec->fd, rec->chunk + done, len - done, rec->offset + done);
+		if ( r == -1 && errno == EINTR ) continue;
+		if ( r == -1 && errno == EINVAL && rec->direct ) {
+			// the file system refused direct I/O after all
+			fcntl(rec->fd, F_SETFL, fcntl(rec->fd, F_GETFL) & ~O_DIRECT);
+			rec->direct = 0;
+			continue;
+		}
+		if ( r <= 0 ) {
+			perror("Recorder write");
+			return 1;
+		}
+		done += r;
+	}
+	rec->offset += rec->chunk_used;
+	rec->chunk_used = 0;
+	if ( final && ftruncate(rec->fd, rec->offset) == -1 ) {
+		perror("Recorder truncate");
+		return 1;
+	}
+	return 0;
+}
+
+// copies bytes into the staging buffer, writing it out whenever it fills
+static int recAppend(Recorder *rec, const void *src, unsigned int size)
+{
+	const unsigned char *p = src;
+	while ( size ) {
+		unsigned int n = min(size, REC_CHUNK - rec->chunk_used);
+		memcpy(rec->chunk + rec->chunk_used, p, n);
+		rec->chunk_used += n;
+		p += n;
+		size -= n;
+		if ( rec->chunk_used == REC_CHUNK && recFlush(rec, 0) ) return 1;
+	}
+	return 0;
+}
+
+static void *recWriter(void *arg)
+{
+	Recorder *rec = arg;
+	pthread_mutex_lock(&rec->lock);
+	while(1) {
+		while ( ! (rec->count && rec->slots[rec->head].ready) && ! rec->stop )
+			pthread_cond_wait(&rec->not_empty, &rec->lock);
+		if ( ! (rec->count && rec->slots[rec->head].ready) ) break;
+
+		struct RecSlot *s = &rec->slots[rec->head];
+		int error = rec->error;
+		rec->writer_busy = 1;
+		pthread_mutex_unlock(&rec->lock);
+
+		int written = 0;
+		if ( ! error && ! s->skip ) {
+			error = recAppend(rec, &s->hdr, sizeof(s->hdr)) ||
+				recAppend(rec, s->data, s->hdr.size);
+			written = ! error;
+		}
+
+		pthread_mutex_lock(&rec->lock);
+		rec->error = error;
+		if ( written ) {
+			rec->stats.frames++;
+			rec->stats.bytes += sizeof(s->hdr) + s->hdr.size;
+		}
+		else rec->stats.dropped++;
+		s->ready = 0;
+		rec->writer_busy = 0;
+		rec->head = (rec->head + 1) % rec->n_slots;
+		rec->count--;
+		pthread_cond_broadcast(&rec->not_full);
+	}
+	pthread_mutex_unlock(&rec->lock);
+
+	if ( ! rec->error && recFlush(rec, 1) ) rec->error = 1;
+	return NULL;
+}
+
+//! Opens a recorder file
+/*!
+ *  Creates (or truncates) @p filename and starts a writer thread appending
+ *  the frames given to recWrite(), or captured by a camera after camRecord().
+ *  Up to @p n_slots frames wait in memory for the writer. When the queue is full
+ *  the @p policy decides: REC_DROP_NEWEST drops the incoming frame,
+ *  REC_DROP_OLDEST drops the oldest queued frame, and REC_BLOCK makes
+ *  recWrite() wait for room.
+ *  @param filename the name of the file to write
+ *  @param n_slots number of queued frames. Zero selects REC_DEFAULT_SLOTS.
+ *  @param policy REC_DROP_NEWEST, REC_DROP_OLDEST or REC_BLOCK
+ *  @return The new recorder, to be closed by recClose(), or NULL on error
+ */
+Recorder *recOpen(const char *filename, unsigned int n_slots, int policy)
+{
+	if ( n_slots == 0 ) n_slots = REC_DEFAULT_SLOTS;
+	Recorder *rec = calloc(1, sizeof(Recorder));
+	if ( rec == NULL ) {
+		fprintf(stderr, "Could not allocate memory for recorder\n");
+		return NULL;
+	}
+	rec->policy = policy;
+	rec->n_slots = n_slots;
+	rec->slots = calloc(n_slots, sizeof(*rec->slots));
+	if ( rec->slots == NULL || posix_memalign((void **)&rec->chunk, REC_ALIGN, REC_CHUNK) ) {
+		fprintf(stderr, "Could not allocate memory for recorder\n");
+		free(rec->slots);
+		free(rec);
+		return NULL;
+	}
+
+	rec->direct = 1;
+	rec->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT | O_CLOEXEC, 0644);
+	if ( rec->fd == -1 && errno == EINVAL ) {
+		rec->direct = 0;
+		rec->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	}
+	if ( rec->fd == -1 ) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", filename, errno, strerror(errno));
+		free(rec->chunk);
+		free(rec->slots);
+		free(rec);
+		return NULL;
+	}
+
+	// file header
+	unsigned int hdr[2] = { 16, 0 };
+	memcpy(rec->chunk, REC_FILE_MAGIC, 8);
+	memcpy(rec->chunk + 8, hdr, sizeof(hdr));
+	rec->chunk_used = 16;
+	rec->stats.bytes = 16;
+
+	pthread_mutex_init(&rec->lock, NULL);
+	pthread_cond_init(&rec->not_empty, NULL);
+	pthread_cond_init(&rec->not_full, NULL);
+	if ( pthread_create(&rec->thread, NULL, recWriter, rec) ) {
+		perror("Creating recorder thread");
+		close(rec->fd);
+		free(rec->chunk);
+		free(rec->slots);
+		free(rec);
+		return NULL;
+	}
+	return rec;
+}
+
+//! Queues a frame for recording
+/*!
+ *  Copies Image @p img, with its timestamp and sequence number, into the recorder queue.
+ *  @param rec the recorder
+ *  @param img the frame
+ *  @param size number of data bytes, for compressed frames. Zero uses the Image size.
+ *  @return 0 when the frame was queued, 1 when it was dropped
+ */
+int recWrite(Recorder *rec, Image *img, unsigned int size)
+{
+	int compressed = size != 0;
+	if ( ! compressed ) size = img->width * img->height * img->depth/8;
+
+	pthread_mutex_lock(&rec->lock);
+	while ( rec->count == rec->n_slots && ! rec->error ) {
+		if ( rec->policy == REC_BLOCK ) {
+			pthread_cond_wait(&rec->not_full, &rec->lock);
+			continue;
+		}
+		struct RecSlot *old = &rec->slots[rec->head];
+		if ( rec->policy == REC_DROP_OLDEST && ! rec->writer_busy && old->ready ) {
+			old->ready = 0;
+			rec->head = (rec->head + 1) % rec->n_slots;
+			rec->count--;
+			rec->stats.dropped++;
+			break;
+		}
+		rec->stats.dropped++;
+		pthread_mutex_unlock(&rec->lock);
+		return 1;
+	}
+	if ( rec->error ) {
+		rec->stats.dropped++;
+		pthread_mutex_unlock(&rec->lock);
+		return 1;
+	}
+	// reserve the tail slot, then fill it without holding the lock
+	struct RecSlot *s = &rec->slots[(rec->head + rec->count) % rec->n_slots];
+	rec->count++;
+	rec->stats.max_queued = max(rec->stats.max_queued, rec->count);
+	pthread_mutex_unlock(&rec->lock);
+
+	s->skip = 0;
+	if ( s->capacity < size ) {
+		unsigned char *data = realloc(s->data, size);
+		if ( data ) {
+			s->data = data;
+			s->capacity = size;
+		}
+		else s->skip = 1;
+	}
+	if ( ! s->skip ) {
+		memcpy(s->hdr.magic, "FRME", 4);
+		s->hdr.size = size;
+		s->hdr.width = img->width;
+		s->hdr.height = img->height;
+		s->hdr.format = img->format;
+		s->hdr.depth = img->depth;
+		s->hdr.sequence = img->sequence;
+		s->hdr.reserved = 0;
+		s->hdr.timestamp = img->timestamp;
+		unsigned int row = img->width * img->depth/8;
+		if ( compressed || img->stride == row )
+			memcpy(s->data, img->data, size);
+		else {
+			unsigned int y;
+			for ( y = 0 ; y < img->height ; y++ )
+				memcpy(s->data + y * row, img->data + y * img->stride, row);
+		}
+	}
+
+	pthread_mutex_lock(&rec->lock);
+	s->ready = 1;
+	pthread_cond_signal(&rec->not_empty);
+	pthread_mutex_unlock(&rec->lock);
+	return s->skip;
+}
+
+//! Gets the counters of a recorder
+void recGetStats(Recorder *rec, RecStats *stats)
+{
+	pthread_mutex_lock(&rec->lock);
+	*stats = rec->stats;
+	pthread_mutex_unlock(&rec->lock);
+}
+
+//! Closes a recorder
+/*!
+ *  Waits for the queued frames to be written and closes the file.
+ *  Cameras recording to @p rec must be detached first with camRecord(cam, NULL).
+ *  @return 0 on success and 1 if a write failed
+ */
+int recClose(Recorder *rec)
+{
+	if ( rec == NULL ) return 0;
+	pthread_mutex_lock(&rec->lock);
+	rec->stop = 1;
+	pthread_cond_signal(&rec->not_empty);
+	pthread_mutex_unlock(&rec->lock);
+	pthread_join(rec->thread, NULL);
+
+	int error = rec->error;
+	if ( close(rec->fd) == -1 ) error = 1;
+	unsigned int i;
+	for ( i = 0 ; i < rec->n_slots ; i++ )
+		free(rec->slots[i].data);
+	free(rec->slots);
+	free(rec->chunk);
+	pthread_mutex_destroy(&rec->lock);
+	pthread_cond_destroy(&rec->not_empty);
+	pthread_cond_destroy(&rec->not_full);
+	free(rec);
+	return error;
+}
+
+//! Records every frame captured by a camera
+/*!
+ *  Once attached, each frame dequeued from the driver, by camGrabImage(), the
+ *  capture thread, camera groups or camAcquireFrame(), is queued in @p rec in
+ *  the camera format, before any conversion. Capture never waits for the disk,
+ *  so recorders using the REC_BLOCK policy are refused.
+ *  Frames recorded from MJPEG cameras keep their compressed size.
+ *  @param cam the Camera to record
+ *  @param rec the recorder, or NULL to stop recording
+ *  @return 0 on success and 1 on error
+ */
+int camRecord(Camera *cam, Recorder *rec)
+{
+	if ( rec && rec->policy == REC_BLOCK ) {
+		fprintf(stderr, "camRecord() error: capture can not wait for a REC_BLOCK recorder\n");
+		return 1;
+	}
+	cam->recorder = rec;
+	return 0;
+}
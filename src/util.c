@@ -13,6 +13,7 @@
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "easimage.h"
 
@@ -142,3 +143,143 @@ int appProcEvents() {
 		return easimageAppEnd;
 }
 
+
+/*
+ * Worker pool.
+ * Persistent threads that split a job into tasks. Tasks are handed out through
+ * an atomic counter; the calling thread also runs tasks while it waits.
+ */
+struct WorkPool {
+	pthread_mutex_t lock;
+	pthread_cond_t start;		// signalled when a new job is posted
+	pthread_cond_t done;		// signalled when the last worker finishes a job
+	pthread_t *threads;
+	unsigned int n_threads;
+	void (*task)(void *arg, unsigned int index);
+	void *arg;
+	unsigned int n_tasks;
+	unsigned int next_task;
+	unsigned int busy;		// workers still running the current job
+	unsigned long job;		// job counter
+	int quit;
+};
+
+static void poolRunTasks(WorkPool *pool)
+{
+	unsigned int i;
+	while ( (i = __atomic_fetch_add(&pool->next_task, 1, __ATOMIC_RELAXED)) < pool->n_tasks )
+		pool->task(pool->arg, i);
+}
+
+static void *poolWorker(void *arg)
+{
+	WorkPool *pool = arg;
+	unsigned long seen = 0;
+	pthread_mutex_lock(&pool->lock);
+	while(1) {
+		while ( pool->job == seen && ! pool->quit )
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if ( pool->quit ) break;
+		seen = pool->job;
+		pthread_mutex_unlock(&pool->lock);
+
+		poolRunTasks(pool);
+
+		pthread_mutex_lock(&pool->lock);
+		if ( --pool->busy == 0 )
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+//! Creates a worker pool
+/*!
+ *  Starts @p n_threads persistent worker threads.
+ *  Jobs are then run in parallel by calling poolRun().
+ *  @param n_threads number of worker threads, not counting the calling thread
+ *  @return The new pool, or NULL on error
+ */
+WorkPool *poolNew(unsigned int n_threads)
+{
+	WorkPool *pool = calloc(1, sizeof(WorkPool));
+	if ( pool==NULL ) {
+		fprintf(stderr, "Could not allocate memory for worker pool\n");
+		return NULL;
+	}
+	pool->threads = calloc(n_threads, sizeof(pthread_t));
+	if ( n_threads && pool->threads==NULL ) {
+		fprintf(stderr, "Could not allocate memory for worker pool\n");
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for( pool->n_threads=0 ; pool->n_threads<n_threads ; pool->n_threads++ ) {
+		if ( pthread_create(&pool->threads[pool->n_threads], NULL, poolWorker, pool) ) {
+			perror("Creating worker thread");
+			poolDestroy(pool);
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+//! Runs a job on a worker pool
+/*!
+ *  Calls @p task(@p arg, i) for every i from 0 to @p n_tasks-1, spreading the
+ *  calls over the pool threads and the calling thread.
+ *  Returns when all tasks are done. Jobs must not be posted concurrently.
+ *  If @p pool is NULL, tasks are run by the calling thread.
+ */
+void poolRun(WorkPool *pool, void (*task)(void *arg, unsigned int index),
+		void *arg, unsigned int n_tasks)
+{
+	unsigned int i;
+	if ( pool==NULL || pool->n_threads==0 || n_tasks<2 ) {
+		for( i=0 ; i<n_tasks ; i++ )
+			task(arg, i);
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->task = task;
+	pool->arg = arg;
+	pool->n_tasks = n_tasks;
+	pool->next_task = 0;
+	pool->busy = pool->n_threads;
+	pool->job++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	poolRunTasks(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	while ( pool->busy )
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+//! Number of threads working on poolRun() jobs, including the caller
+unsigned int poolSize(WorkPool *pool)
+{
+	return pool ? pool->n_threads+1 : 1;
+}
+
+//! Stops the worker threads and releases the pool
+void poolDestroy(WorkPool *pool)
+{
+	if ( pool==NULL ) return;
+	unsigned int i;
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for( i=0 ; i<pool->n_threads ; i++ )
+		pthread_join(pool->threads[i], NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool);
+}
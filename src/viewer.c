@@ -110,7 +110,7 @@ void viewDisplayImage(Viewer * view, Image * img)
 				img->width,
 				img->height,
 				img->depth, 
-				img->width * img->depth/8,
+				img->stride,
 				r_mask,
 				g_mask,
 				b_mask,